@@ -0,0 +1,731 @@
+/*
+  USB/IP emulator of a micronucleus bootloader
+
+  Exports a virtual micronucleus device (VID 0x16D0, PID 0x0753, protocol 2.5)
+  over USB/IP, so the unchanged command line tool can upload to it through the
+  kernel usbfs and libusb, for example to measure upload times without hardware:
+    ./emulator &
+    sudo modprobe vhci-hcd
+    sudo usbip attach -r 127.0.0.1 -b 1-1
+    sudo ./micronucleus --run blink.hex
+
+  The device answers the standard requests of the enumeration and the vendor
+  requests of main.c: device info, transfer page, write data, erase, exit and
+  keepalive. Writing the last word of a page and erasing halt the emulated CPU
+  like the SPM instruction, requests during this time fail like on the real
+  device. Every stage of a control transfer (setup, each data packet of 8
+  bytes, status) takes one USB frame, since a low speed device gets one
+  transaction per frame from a full speed hub.
+  Exit closes the connection like the real device disconnecting from USB. The
+  emulator then waits for the next attach with the flash unchanged, like the
+  bootloader after a reset.
+
+  SET_ADDRESS is handled by the vhci driver and never reaches the emulator.
+  Linux only.
+*/
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "littleWire_util.h"
+
+#define USBIP_PORT 3240
+#define USBIP_VERSION 0x0111
+#define USBIP_BUSID "1-1"
+#define USBIP_BUSNUM 1
+#define USBIP_DEVNUM 2
+
+#define OP_REQ_DEVLIST 0x8005
+#define OP_REP_DEVLIST 0x0005
+#define OP_REQ_IMPORT 0x8003
+#define OP_REP_IMPORT 0x0003
+
+#define USBIP_CMD_SUBMIT 1
+#define USBIP_CMD_UNLINK 2
+#define USBIP_RET_SUBMIT 3
+#define USBIP_RET_UNLINK 4
+#define USBIP_HEADER_SIZE 48
+#define USBIP_DIR_IN 1
+
+#define USB_SPEED_LOW 1 /* enum usb_device_speed of the kernel */
+#define MAX_PENDING 64  /* the kernel has few URBs of a single device in flight */
+#define MAX_REPLY 64
+
+/* Defaults of the t85_default configuration */
+#define DEFAULT_BOOTLOADER_ADDRESS 0x1A00
+#define DEFAULT_POSTSCRIPT_SIZE 6
+#define DEFAULT_PAGE_SIZE 64
+#define DEFAULT_WRITE_SLEEP 5     /* milliseconds reported to the host */
+#define DEFAULT_SPM_US 4500       /* page write and page erase time of the ATtiny85 */
+#define DEFAULT_STAGE_US 1000     /* one low speed transaction per frame */
+#define DEFAULT_AUTO_EXIT_MS 6000
+#define DEFAULT_SIGNATURE1 0x93
+#define EEPROM_SIZE 512           /* ATtiny85 */
+#define EEPROM_WRITE_SLEEP 8      /* milliseconds reported to the host for 2 bytes */
+#define EEPROM_BYTE_US 3400       /* erase and write of one EEPROM byte */
+#define DEFAULT_SIGNATURE2 0x0B
+
+#define TINYVECTOR_RESET_OFFSET 4
+
+static const unsigned char deviceDescriptor[18] = {
+  18, 1,        /* bLength, bDescriptorType */
+  0x10, 0x01,   /* bcdUSB 1.1 */
+  0xFF, 0, 0,   /* vendor specific class */
+  8,            /* bMaxPacketSize0 */
+  0xD0, 0x16,   /* idVendor */
+  0x53, 0x07,   /* idProduct */
+  0x05, 0x02,   /* bcdDevice is the protocol version 2.5 */
+  0, 0, 0,      /* no strings */
+  1             /* bNumConfigurations */
+};
+
+static const unsigned char configurationDescriptor[18] = {
+  9, 2, 18, 0,  /* bLength, bDescriptorType, wTotalLength */
+  1, 1, 0,      /* bNumInterfaces, bConfigurationValue, iConfiguration */
+  0x80, 50,     /* bus powered, 100 mA */
+  9, 4, 0, 0,   /* interface 0, alternate setting 0 */
+  0,            /* no endpoints besides endpoint 0 */
+  0, 0, 0, 0    /* class, subclass, protocol, iInterface */
+};
+
+static const unsigned char languageDescriptor[4] = { 4, 3, 0x09, 0x04 };
+
+typedef struct {
+  uint32_t seqnum;
+  unsigned long long due;   /* micros() when the transfer completes */
+  int status;
+  int direction;
+  unsigned int length;
+  unsigned char data[MAX_REPLY];
+} pending_urb;
+
+static struct {
+  unsigned int bootloader_address;
+  unsigned int postscript_size;
+  unsigned int page_size;
+  unsigned int write_sleep;
+  unsigned int spm_us;
+  unsigned int stage_us;
+  unsigned int auto_exit_ms;
+  int health;
+  int eeprom_enabled;
+  const char *dump_file;
+
+  unsigned char flash[65536];
+  unsigned char page_buffer[256];
+  unsigned char eeprom[EEPROM_SIZE];
+  unsigned int address;             /* currentAddress of main.c */
+  unsigned char configuration;
+  unsigned long long bus_free;      /* end of the last transfer on the bus */
+  unsigned long long busy_until;    /* end of the current SPM operation */
+  unsigned long long last_request;  /* last vendor request, for the auto exit */
+  unsigned long long exit_at;       /* 0 or time of the disconnect after cmd_exit */
+  unsigned int spm_after;           /* SPM time started by the current request after its status stage */
+  int exit_after;                   /* the current request is cmd_exit */
+  uint16_t health_counters[4];      /* resets, packets, resyncs, dropped setups */
+
+  unsigned long transfers;
+  unsigned long failed;
+  unsigned long words;
+  unsigned long pages;
+  unsigned long eeprom_bytes;
+  unsigned long long session_start;
+} device;
+
+static pending_urb pending[MAX_PENDING];
+static int pending_count = 0;
+
+/******************************************************************************
+* Socket helpers, USB/IP is big endian
+******************************************************************************/
+static int readAll(int sock, void *buffer, size_t length) {
+  unsigned char *p = buffer;
+  while (length > 0) {
+    ssize_t res = read(sock, p, length);
+    if (res < 0 && errno == EINTR) continue;
+    if (res <= 0) return -1;
+    p += res;
+    length -= res;
+  }
+  return 0;
+}
+
+static int writeAll(int sock, const void *buffer, size_t length) {
+  const unsigned char *p = buffer;
+  while (length > 0) {
+    ssize_t res = write(sock, p, length);
+    if (res < 0 && errno == EINTR) continue;
+    if (res <= 0) return -1;
+    p += res;
+    length -= res;
+  }
+  return 0;
+}
+
+static unsigned char* put16(unsigned char *p, unsigned int value) {
+  p[0] = value >> 8;
+  p[1] = value;
+  return p + 2;
+}
+
+static unsigned char* put32(unsigned char *p, uint32_t value) {
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+  return p + 4;
+}
+
+static uint32_t get32(const unsigned char *p) {
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+/* struct usbip_usb_device of the USB/IP protocol, 312 bytes */
+static unsigned char* putDevice(unsigned char *p) {
+  memset(p, 0, 256 + 32);
+  snprintf((char *) p, 256, "/sys/devices/emulator/usb%d/%s", USBIP_BUSNUM, USBIP_BUSID);
+  strcpy((char *) p + 256, USBIP_BUSID);
+  p += 256 + 32;
+  p = put32(p, USBIP_BUSNUM);
+  p = put32(p, USBIP_DEVNUM);
+  p = put32(p, USB_SPEED_LOW);
+  p = put16(p, 0x16D0);
+  p = put16(p, 0x0753);
+  p = put16(p, 0x0205);
+  *p++ = deviceDescriptor[4]; /* bDeviceClass, bDeviceSubClass, bDeviceProtocol */
+  *p++ = deviceDescriptor[5];
+  *p++ = deviceDescriptor[6];
+  *p++ = device.configuration;
+  *p++ = 1; /* bNumConfigurations */
+  *p++ = 1; /* bNumInterfaces */
+  return p;
+}
+
+/******************************************************************************
+* Emulated bootloader, see usbFunctionSetup() and the main loop of main.c
+******************************************************************************/
+static void resetDevice(void) {
+  device.address = 0;
+  device.configuration = 0;
+  device.bus_free = device.busy_until = 0;
+  device.last_request = device.session_start = micros();
+  device.exit_at = 0;
+  memset(device.page_buffer, 0xFF, sizeof(device.page_buffer));
+  device.health_counters[0]++;
+  device.transfers = device.failed = device.words = device.pages = device.eeprom_bytes = 0;
+}
+
+static int hasUserProgram(void) {
+  return device.flash[device.bootloader_address - TINYVECTOR_RESET_OFFSET + 1] != 0xFF;
+}
+
+static void writeWordToPageBuffer(unsigned int data) {
+  if (device.address == 0) {
+    if (device.bootloader_address < 8192) {
+      data = 0xC000 + (device.bootloader_address / 2) - 1; // rjmp
+    } else {
+      data = 0x940C; // far jmp
+    }
+  } else if (device.address == 2 && device.bootloader_address >= 8192) {
+    data = device.bootloader_address / 2;
+  }
+  device.page_buffer[device.address % device.page_size] = data;
+  device.page_buffer[device.address % device.page_size + 1] = data >> 8;
+  device.address = (device.address + 2) & 0xFFFF;
+  device.words++;
+}
+
+/* boot_page_write() programs only zeros, the page buffer is cleared afterwards */
+static void writeFlashPage(void) {
+  unsigned int page = (device.address - 2) & ~(device.page_size - 1) & 0xFFFF;
+  unsigned int i;
+
+  if (page < device.bootloader_address) {
+    for (i = 0; i < device.page_size; i++) device.flash[page + i] &= device.page_buffer[i];
+    device.spm_after = device.spm_us;
+    device.pages++;
+  }
+  memset(device.page_buffer, 0xFF, sizeof(device.page_buffer));
+}
+
+/* eeprom_update_byte() only writes bytes which change, writeEeprom() waits for the end of the write */
+static void writeEeprom(unsigned int address, unsigned int data) {
+  unsigned int count = address & 0x8000 ? 1 : 2;
+  unsigned int i;
+
+  for (i = 0; i < count; i++) {
+    unsigned int byte = (address + i) & (EEPROM_SIZE - 1);
+    if (device.eeprom[byte] != ((data >> (8 * i)) & 0xFF)) {
+      device.eeprom[byte] = data >> (8 * i);
+      device.spm_after += EEPROM_BYTE_US;
+      device.eeprom_bytes++;
+    }
+  }
+}
+
+static void eraseApplication(void) {
+  unsigned int pages = device.bootloader_address / device.page_size;
+
+  memset(device.flash, 0xFF, device.bootloader_address);
+  device.spm_after = pages * device.spm_us;
+  device.address = 0;
+}
+
+/* Returns the length of the reply or -1 to stall */
+static int vendorRequest(const unsigned char *setup, unsigned char *reply) {
+  unsigned int request = setup[1];
+  unsigned int value = setup[2] | (setup[3] << 8);
+  unsigned int index = setup[4] | (setup[5] << 8);
+  unsigned int progmem_size = device.bootloader_address - device.postscript_size;
+
+  if (request == 0) {
+    if (device.health && value == 1) {
+      unsigned int i;
+      for (i = 0; i < 4; i++) {
+        reply[2 * i] = device.health_counters[i];
+        reply[2 * i + 1] = device.health_counters[i] >> 8;
+      }
+      return 8;
+    }
+    if (device.eeprom_enabled && value == 2) {
+      reply[0] = EEPROM_SIZE & 0xFF;
+      reply[1] = EEPROM_SIZE >> 8;
+      reply[2] = EEPROM_WRITE_SLEEP;
+      return 3;
+    }
+    reply[0] = progmem_size >> 8;
+    reply[1] = progmem_size;
+    reply[2] = device.page_size;
+    reply[3] = device.write_sleep;
+    reply[4] = DEFAULT_SIGNATURE1;
+    reply[5] = DEFAULT_SIGNATURE2;
+    return 6;
+  } else if (request == 1) {
+    // address zero always has to be written first to ensure reset vector patching
+    if (device.address != 0) {
+      device.address = index & ~(device.page_size - 1);
+      memset(device.page_buffer, 0xFF, sizeof(device.page_buffer));
+    }
+  } else if (request == 3) {
+    writeWordToPageBuffer(value);
+    writeWordToPageBuffer(index);
+    if (device.address % device.page_size == 0) writeFlashPage();
+  } else if (request == 6 && device.eeprom_enabled) {
+    writeEeprom(index, value);
+  } else if ((request & 0x3F) == 2) {
+    eraseApplication();
+  } else if ((request & 0x3F) == 4) {
+    device.exit_after = 1;
+  }
+  return 0;
+}
+
+static int standardRequest(const unsigned char *setup, unsigned char *reply) {
+  unsigned int request = setup[1];
+  unsigned int value = setup[2] | (setup[3] << 8);
+  const unsigned char *descriptor = NULL;
+  int length = 0;
+
+  switch (request) {
+    case 0: // GET_STATUS
+      reply[0] = reply[1] = 0;
+      return 2;
+    case 1: case 3: case 5: case 11: // CLEAR_FEATURE, SET_FEATURE, SET_ADDRESS, SET_INTERFACE
+      return 0;
+    case 6: // GET_DESCRIPTOR
+      if (value >> 8 == 1) {
+        descriptor = deviceDescriptor;
+        length = sizeof(deviceDescriptor);
+      } else if (value >> 8 == 2) {
+        descriptor = configurationDescriptor;
+        length = sizeof(configurationDescriptor);
+      } else if (value == 0x0300) {
+        descriptor = languageDescriptor;
+        length = sizeof(languageDescriptor);
+      } else {
+        return -1;
+      }
+      memcpy(reply, descriptor, length);
+      return length;
+    case 8: // GET_CONFIGURATION
+      reply[0] = device.configuration;
+      return 1;
+    case 9: // SET_CONFIGURATION
+      device.configuration = value;
+      return 0;
+    case 10: // GET_INTERFACE
+      reply[0] = 0;
+      return 1;
+  }
+  return -1;
+}
+
+/* Executes the request and queues its completion */
+static void submitUrb(uint32_t seqnum, int direction, unsigned int ep, unsigned int buffer_length, const unsigned char *setup) {
+  unsigned long long start = micros();
+  unsigned int length = setup[6] | (setup[7] << 8);
+  pending_urb *urb;
+  unsigned int stages;
+  int res;
+
+  if (pending_count >= MAX_PENDING) {
+    fprintf(stderr, "Too many pending URBs, dropping seqnum %u\n", seqnum);
+    return;
+  }
+  urb = &pending[pending_count++];
+  urb->seqnum = seqnum;
+  urb->direction = direction;
+  urb->length = 0;
+  urb->status = 0;
+
+  if (start < device.bus_free) start = device.bus_free;
+  device.transfers++;
+
+  if (ep != 0) {
+    urb->status = -EPIPE; // there are no other endpoints
+    urb->due = start;
+    return;
+  }
+  if (start < device.busy_until) {
+    // the CPU is halted by SPM and does not answer, the host controller gives up after three tries
+    urb->status = -EPROTO;
+    urb->due = device.bus_free = start + 3 * device.stage_us;
+    device.failed++;
+    return;
+  }
+
+  if (length > buffer_length) length = buffer_length;
+  device.spm_after = 0;
+  device.exit_after = 0;
+  if ((setup[0] & 0x60) == 0x40) {
+    res = vendorRequest(setup, urb->data);
+  } else if ((setup[0] & 0x60) == 0) {
+    res = standardRequest(setup, urb->data);
+  } else {
+    res = -1;
+  }
+  if (res < 0) {
+    urb->status = -EPIPE;
+  } else if (direction == USBIP_DIR_IN) {
+    urb->length = (unsigned int) res < length ? (unsigned int) res : length;
+  }
+
+  stages = 2; // setup and status
+  if (direction != USBIP_DIR_IN) {
+    stages += (length + 7) / 8; // data of OUT requests is accepted and ignored
+  } else if (res >= 0) {
+    // a reply shorter than requested ends with a short packet, which may have zero length
+    stages += urb->length / 8 + (urb->length < length || urb->length % 8 ? 1 : 0);
+  }
+  urb->due = device.bus_free = start + stages * device.stage_us;
+  device.health_counters[1] += stages;
+
+  // main.c executes erase, page write and exit in the main loop after the status stage
+  if ((setup[0] & 0x60) == 0x40) device.last_request = urb->due;
+  if (device.spm_after) device.busy_until = urb->due + device.spm_after;
+  if (device.exit_after) device.exit_at = urb->due + 5000; // main.c leaves after the next 5 ms timeout
+}
+
+static int sendRetSubmit(int sock, const pending_urb *urb) {
+  unsigned char header[USBIP_HEADER_SIZE + MAX_REPLY];
+  unsigned char *p = header;
+
+  memset(header, 0, USBIP_HEADER_SIZE);
+  p = put32(p, USBIP_RET_SUBMIT);
+  p = put32(p, urb->seqnum);
+  p += 12; // devid, direction and ep are zero in replies
+  p = put32(p, (uint32_t) urb->status);
+  p = put32(p, urb->length);
+  memcpy(header + USBIP_HEADER_SIZE, urb->data, urb->length);
+  return writeAll(sock, header, USBIP_HEADER_SIZE + urb->length);
+}
+
+static int sendRetUnlink(int sock, uint32_t seqnum, int status) {
+  unsigned char header[USBIP_HEADER_SIZE];
+  unsigned char *p = header;
+
+  memset(header, 0, sizeof(header));
+  p = put32(p, USBIP_RET_UNLINK);
+  p = put32(p, seqnum);
+  p += 12;
+  put32(p, (uint32_t) status);
+  return writeAll(sock, header, sizeof(header));
+}
+
+static int unlinkUrb(uint32_t seqnum) {
+  int i;
+  for (i = 0; i < pending_count; i++) {
+    if (pending[i].seqnum == seqnum) {
+      memmove(&pending[i], &pending[i + 1], (pending_count - i - 1) * sizeof(pending_urb));
+      pending_count--;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void dumpFlash(void) {
+  FILE *file;
+
+  if (!device.dump_file) return;
+  file = fopen(device.dump_file, "wb");
+  if (!file || fwrite(device.flash, 1, device.bootloader_address, file) != device.bootloader_address) {
+    fprintf(stderr, "Could not write %s: %s\n", device.dump_file, strerror(errno));
+  }
+  if (file) fclose(file);
+}
+
+/* Serves the URBs of one attach until the device exits or the host detaches. */
+static void runSession(int sock) {
+  unsigned char header[USBIP_HEADER_SIZE];
+  unsigned char discard[4096];
+  const char *reason = "detached";
+
+  resetDevice();
+  pending_count = 0;
+  printf("Attached, emulating micronucleus 2.5 at 0x%04X with %u byte pages\n", device.bootloader_address, device.page_size);
+
+  for (;;) {
+    unsigned long long now = micros();
+    unsigned long long wakeup = 0;
+    struct timeval tv;
+    fd_set readfds;
+    int res;
+
+    while (pending_count > 0 && pending[0].due <= now) {
+      if (sendRetSubmit(sock, &pending[0]) < 0) goto end;
+      unlinkUrb(pending[0].seqnum);
+    }
+    if (device.exit_at && now >= device.exit_at && pending_count == 0) {
+      reason = "exit request";
+      break;
+    }
+    if (device.auto_exit_ms && hasUserProgram() && now >= device.last_request + device.auto_exit_ms * 1000ULL) {
+      reason = "auto exit timeout";
+      break;
+    }
+
+    if (pending_count > 0) wakeup = pending[0].due;
+    if (device.exit_at && (!wakeup || device.exit_at < wakeup)) wakeup = device.exit_at;
+    if (!wakeup) wakeup = now + 100000; // check the auto exit
+    wakeup -= now < wakeup ? now : wakeup;
+    tv.tv_sec = wakeup / 1000000;
+    tv.tv_usec = wakeup % 1000000;
+
+    FD_ZERO(&readfds);
+    FD_SET(sock, &readfds);
+    res = select(sock + 1, &readfds, NULL, NULL, &tv);
+    if (res < 0 && errno != EINTR) break;
+    if (res <= 0) continue;
+
+    if (readAll(sock, header, sizeof(header)) < 0) break;
+    if (get32(header) == USBIP_CMD_SUBMIT) {
+      int direction = get32(header + 12);
+      unsigned int buffer_length = get32(header + 24);
+      unsigned int numberOfPackets = get32(header + 32);
+
+      if (direction != USBIP_DIR_IN) {
+        // vendor requests of micronucleus have no data stage, other data is ignored
+        unsigned int remaining = buffer_length;
+        while (remaining > 0) {
+          unsigned int chunk = remaining < sizeof(discard) ? remaining : sizeof(discard);
+          if (readAll(sock, discard, chunk) < 0) goto end;
+          remaining -= chunk;
+        }
+      }
+      if (numberOfPackets != 0 && numberOfPackets != 0xFFFFFFFF) {
+        fprintf(stderr, "Isochronous transfers are not supported\n");
+        break;
+      }
+      submitUrb(get32(header + 4), direction, get32(header + 16), buffer_length, header + 40);
+    } else if (get32(header) == USBIP_CMD_UNLINK) {
+      int found = unlinkUrb(get32(header + 20));
+      if (sendRetUnlink(sock, get32(header + 4), found ? -ECONNRESET : 0) < 0) break;
+    } else {
+      fprintf(stderr, "Unknown USB/IP command 0x%08X\n", get32(header));
+      break;
+    }
+  }
+
+end:
+  printf("Disconnected by %s after %.3f s: %lu transfers, %lu failed while busy, %lu words, %lu pages written\n",
+         reason, (micros() - device.session_start) / 1e6, device.transfers, device.failed, device.words, device.pages);
+  if (device.eeprom_enabled) printf("%lu EEPROM bytes written\n", device.eeprom_bytes);
+  dumpFlash();
+}
+
+/* Answers OP_REQ_DEVLIST and OP_REQ_IMPORT, returns 1 if the device was imported */
+static int handleRequest(int sock) {
+  unsigned char request[8 + 32];
+  unsigned char reply[8 + 4 + 312 + 4];
+  unsigned char *p = reply;
+  unsigned int code;
+
+  if (readAll(sock, request, 8) < 0) return 0;
+  code = (request[2] << 8) | request[3];
+
+  if (code == OP_REQ_DEVLIST) {
+    p = put16(p, USBIP_VERSION);
+    p = put16(p, OP_REP_DEVLIST);
+    p = put32(p, 0);
+    p = put32(p, 1);
+    p = putDevice(p);
+    *p++ = configurationDescriptor[14]; // bInterfaceClass, bInterfaceSubClass, bInterfaceProtocol
+    *p++ = configurationDescriptor[15];
+    *p++ = configurationDescriptor[16];
+    *p++ = 0;
+    writeAll(sock, reply, p - reply);
+    return 0;
+  }
+  if (code == OP_REQ_IMPORT) {
+    if (readAll(sock, request + 8, 32) < 0) return 0;
+    request[8 + 31] = 0;
+    int found = strcmp((char *) request + 8, USBIP_BUSID) == 0;
+    p = put16(p, USBIP_VERSION);
+    p = put16(p, OP_REP_IMPORT);
+    p = put32(p, found ? 0 : 1);
+    if (found) p = putDevice(p);
+    return writeAll(sock, reply, p - reply) == 0 && found;
+  }
+  fprintf(stderr, "Unknown USB/IP request 0x%04X\n", code);
+  return 0;
+}
+
+static void printUsage(void) {
+  puts("usage: emulator [--port PORT] [--bootloader-address HEX] [--postscript BYTES] [--page-size BYTES]");
+  puts("                [--write-sleep MS] [--spm-us US] [--stage-us US] [--auto-exit-ms MS] [--health]");
+  puts("                [--eeprom]");
+  puts("                [--load file.bin] [--dump file.bin]");
+  puts("");
+  puts("   --port: TCP port of the USB/IP server, default 3240.");
+  puts("   --bootloader-address: BOOTLOADER_ADDRESS of the emulated configuration, default 1A00.");
+  puts("   --postscript: POSTSCRIPT_SIZE below the bootloader, default 6.");
+  puts("   --page-size: SPM_PAGESIZE, default 64.");
+  puts("   --write-sleep: Write time in ms reported to the host, default 5.");
+  puts("   --spm-us: Time the CPU is halted by a page write or page erase, default 4500.");
+  puts("   --stage-us: Time of a setup, data or status stage of a control transfer, default 1000.");
+  puts("   --auto-exit-ms: Exit after this idle time if a user program is present, 0 to disable, default 6000.");
+  puts("   --health: Answer the health counters request of ENABLE_HEALTH_COUNTERS.");
+  puts("   --eeprom: Answer the EEPROM requests of ENABLE_EEPROM_WRITE with a 512 byte EEPROM.");
+  puts("   --load: Initial flash content.");
+  puts("   --dump: Write the flash below the bootloader to this file after every session.");
+  puts("");
+  puts("Attach with: sudo modprobe vhci-hcd; sudo usbip attach -r 127.0.0.1 -b " USBIP_BUSID);
+}
+
+int main(int argc, char **argv) {
+  struct sockaddr_in address;
+  const char *load_file = NULL;
+  int port = USBIP_PORT;
+  int listener;
+  int one = 1;
+  int arg_pos;
+
+  device.bootloader_address = DEFAULT_BOOTLOADER_ADDRESS;
+  device.postscript_size = DEFAULT_POSTSCRIPT_SIZE;
+  device.page_size = DEFAULT_PAGE_SIZE;
+  device.write_sleep = DEFAULT_WRITE_SLEEP;
+  device.spm_us = DEFAULT_SPM_US;
+  device.stage_us = DEFAULT_STAGE_US;
+  device.auto_exit_ms = DEFAULT_AUTO_EXIT_MS;
+
+  for (arg_pos = 1; arg_pos < argc; arg_pos++) {
+    const char *next = arg_pos + 1 < argc ? argv[arg_pos + 1] : NULL;
+    if (strcmp(argv[arg_pos], "--help") == 0 || strcmp(argv[arg_pos], "-h") == 0) {
+      printUsage();
+      return EXIT_SUCCESS;
+    } else if (strcmp(argv[arg_pos], "--health") == 0) {
+      device.health = 1;
+      continue;
+    } else if (strcmp(argv[arg_pos], "--eeprom") == 0) {
+      device.eeprom_enabled = 1;
+      continue;
+    } else if (next == NULL) {
+      printUsage();
+      return EXIT_FAILURE;
+    } else if (strcmp(argv[arg_pos], "--port") == 0) {
+      port = atoi(next);
+    } else if (strcmp(argv[arg_pos], "--bootloader-address") == 0) {
+      device.bootloader_address = strtoul(next, NULL, 16);
+    } else if (strcmp(argv[arg_pos], "--postscript") == 0) {
+      device.postscript_size = atoi(next);
+    } else if (strcmp(argv[arg_pos], "--page-size") == 0) {
+      device.page_size = atoi(next);
+    } else if (strcmp(argv[arg_pos], "--write-sleep") == 0) {
+      device.write_sleep = atoi(next);
+    } else if (strcmp(argv[arg_pos], "--spm-us") == 0) {
+      device.spm_us = atoi(next);
+    } else if (strcmp(argv[arg_pos], "--stage-us") == 0) {
+      device.stage_us = atoi(next);
+    } else if (strcmp(argv[arg_pos], "--auto-exit-ms") == 0) {
+      device.auto_exit_ms = atoi(next);
+    } else if (strcmp(argv[arg_pos], "--load") == 0) {
+      load_file = next;
+    } else if (strcmp(argv[arg_pos], "--dump") == 0) {
+      device.dump_file = next;
+    } else {
+      printUsage();
+      return EXIT_FAILURE;
+    }
+    arg_pos++;
+  }
+
+  if (device.page_size < 2 || device.page_size > sizeof(device.page_buffer) || (device.page_size & (device.page_size - 1))
+      || device.bootloader_address % device.page_size || device.bootloader_address > 0x10000
+      || device.bootloader_address <= device.postscript_size + TINYVECTOR_RESET_OFFSET) {
+    fprintf(stderr, "Invalid page size or bootloader address\n");
+    return EXIT_FAILURE;
+  }
+
+  memset(device.flash, 0xFF, sizeof(device.flash));
+  memset(device.eeprom, 0xFF, sizeof(device.eeprom));
+  if (load_file) {
+    FILE *file = fopen(load_file, "rb");
+    if (!file) {
+      fprintf(stderr, "Could not open %s: %s\n", load_file, strerror(errno));
+      return EXIT_FAILURE;
+    }
+    if (fread(device.flash, 1, device.bootloader_address, file) == 0) {
+      fprintf(stderr, "Could not read %s\n", load_file);
+    }
+    fclose(file);
+  }
+
+  listener = socket(AF_INET, SOCK_STREAM, 0);
+  if (listener < 0) {
+    perror("socket");
+    return EXIT_FAILURE;
+  }
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(listener, (struct sockaddr *) &address, sizeof(address)) < 0 || listen(listener, 4) < 0) {
+    perror("bind");
+    return EXIT_FAILURE;
+  }
+  printf("Listening for USB/IP on 127.0.0.1:%d, bus id " USBIP_BUSID "\n", port);
+  fflush(stdout);
+
+  for (;;) {
+    int sock = accept(listener, NULL, NULL);
+    if (sock < 0) {
+      if (errno == EINTR) continue;
+      perror("accept");
+      return EXIT_FAILURE;
+    }
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (handleRequest(sock)) runSession(sock);
+    close(sock);
+    fflush(stdout);
+  }
+}
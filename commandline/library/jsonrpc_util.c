@@ -0,0 +1,200 @@
+#include <jsonrpc_util.h>
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+static FILE *jsonrpc_output = NULL;
+
+void jsonrpc_setOutput(FILE *output) {
+  jsonrpc_output = output;
+}
+
+static FILE* jsonrpc_getOutput(void) {
+  return jsonrpc_output ? jsonrpc_output : stdout;
+}
+
+static const char* jsonrpc_skipSpace(const char *p) {
+  while (*p && isspace((unsigned char) *p)) p++;
+  return p;
+}
+
+/* Parse a string, copy its decoded content to value. Returns pointer behind it or NULL */
+static const char* jsonrpc_parseString(const char *p, char *value, size_t size) {
+  size_t length = 0;
+
+  if (*p != '"') return NULL;
+  p++;
+  while (*p != '"') {
+    char c = *p++;
+    if (c == 0) return NULL;
+    if (c == '\\') {
+      c = *p++;
+      switch (c) {
+        case 'b': c = '\b'; break;
+        case 'f': c = '\f'; break;
+        case 'n': c = '\n'; break;
+        case 'r': c = '\r'; break;
+        case 't': c = '\t'; break;
+        case '"': case '\\': case '/': break;
+        case 'u': {
+          char digits[5] = { 0 };
+          char *end;
+          strncpy(digits, p, 4);
+          unsigned long code = strtoul(digits, &end, 16);
+          if (end != digits + 4) return NULL;
+          p += 4;
+          c = code < 0x80 ? (char) code : '?'; // paths and serial numbers are expected to be ASCII
+          break;
+        }
+        default: return NULL;
+      }
+    }
+    if (length + 1 < size) value[length++] = c;
+  }
+  value[length] = 0;
+  return p + 1;
+}
+
+/* Parse any value. Strings are decoded, objects and arrays are skipped and read as empty string. */
+static const char* jsonrpc_parseValue(const char *p, char *value, size_t size) {
+  p = jsonrpc_skipSpace(p);
+  if (*p == '"') return jsonrpc_parseString(p, value, size);
+
+  value[0] = 0;
+  if (*p == '{' || *p == '[') {
+    int depth = 0;
+    char scratch[2];
+    do {
+      if (*p == '"') {
+        p = jsonrpc_parseString(p, scratch, sizeof(scratch));
+        if (p == NULL) return NULL;
+        continue;
+      }
+      if (*p == '{' || *p == '[') depth++;
+      if (*p == '}' || *p == ']') depth--;
+      if (*p == 0) return NULL;
+      p++;
+    } while (depth > 0);
+    return p;
+  }
+
+  // number, true, false or null
+  size_t length = 0;
+  while (isalnum((unsigned char) *p) || *p == '-' || *p == '+' || *p == '.') {
+    if (length + 1 < size) value[length++] = *p;
+    p++;
+  }
+  if (length == 0) return NULL;
+  value[length] = 0;
+  return p;
+}
+
+/* Parse the members of the request or of its params */
+static const char* jsonrpc_parseObject(const char *p, jsonrpc_request *request, int is_params) {
+  char name[JSONRPC_MAX_NAME];
+  char value[JSONRPC_MAX_VALUE];
+
+  p = jsonrpc_skipSpace(p);
+  if (*p != '{') return NULL;
+  p = jsonrpc_skipSpace(p + 1);
+  if (*p == '}') return p + 1;
+
+  for (;;) {
+    p = jsonrpc_parseString(jsonrpc_skipSpace(p), name, sizeof(name));
+    if (p == NULL) return NULL;
+    p = jsonrpc_skipSpace(p);
+    if (*p != ':') return NULL;
+    p = jsonrpc_skipSpace(p + 1);
+
+    if (is_params) {
+      if (request->param_count >= JSONRPC_MAX_PARAMS) return NULL;
+      jsonrpc_param *param = &request->params[request->param_count++];
+      strcpy(param->name, name);
+      p = jsonrpc_parseValue(p, param->value, sizeof(param->value));
+    } else if (strcmp(name, "params") == 0 && *p == '{') {
+      p = jsonrpc_parseObject(p, request, 1);
+    } else if (strcmp(name, "id") == 0) {
+      // keep the JSON text, so the id is sent back unchanged
+      const char *start = p;
+      p = jsonrpc_parseValue(p, value, sizeof(value));
+      if (p == NULL || (size_t) (p - start) >= sizeof(request->id)) return NULL;
+      memcpy(request->id, start, p - start);
+      request->id[p - start] = 0;
+    } else if (strcmp(name, "method") == 0) {
+      p = jsonrpc_parseValue(p, request->method, sizeof(request->method));
+    } else {
+      p = jsonrpc_parseValue(p, value, sizeof(value)); // "jsonrpc" and unknown members are ignored
+    }
+    if (p == NULL) return NULL;
+
+    p = jsonrpc_skipSpace(p);
+    if (*p == '}') return p + 1;
+    if (*p != ',') return NULL;
+    p++;
+  }
+}
+
+int jsonrpc_parseRequest(const char *line, jsonrpc_request *request) {
+  memset(request, 0, sizeof(*request));
+  const char *p = jsonrpc_parseObject(line, request, 0);
+  if (p == NULL || *jsonrpc_skipSpace(p) != 0) return JSONRPC_PARSE_ERROR;
+  if (request->method[0] == 0) return JSONRPC_INVALID_REQUEST;
+  return 0;
+}
+
+const char* jsonrpc_getParam(const jsonrpc_request *request, const char *name) {
+  int i;
+  for (i = 0; i < request->param_count; i++) {
+    if (strcmp(request->params[i].name, name) == 0) return request->params[i].value;
+  }
+  return NULL;
+}
+
+void jsonrpc_quote(char *buffer, size_t size, const char *text) {
+  size_t length = 0;
+
+  if (size < 3) {
+    if (size) buffer[0] = 0;
+    return;
+  }
+  buffer[length++] = '"';
+  for (; *text; text++) {
+    char escaped[8];
+    unsigned char c = *text;
+    if (c == '"' || c == '\\') {
+      sprintf(escaped, "\\%c", c);
+    } else if (c < 0x20) {
+      sprintf(escaped, "\\u%04x", c);
+    } else {
+      escaped[0] = c;
+      escaped[1] = 0;
+    }
+    if (length + strlen(escaped) + 2 > size) break; // room for the closing quote
+    strcpy(buffer + length, escaped);
+    length += strlen(escaped);
+  }
+  buffer[length++] = '"';
+  buffer[length] = 0;
+}
+
+void jsonrpc_sendResult(const jsonrpc_request *request, const char *result) {
+  if (request->id[0] == 0) return;
+  fprintf(jsonrpc_getOutput(), "{\"jsonrpc\":\"2.0\",\"id\":%s,\"result\":%s}\n", request->id, result);
+  fflush(jsonrpc_getOutput());
+}
+
+void jsonrpc_sendError(const jsonrpc_request *request, int code, const char *message) {
+  char quoted[JSONRPC_MAX_VALUE];
+
+  if (request && request->id[0] == 0) return;
+  jsonrpc_quote(quoted, sizeof(quoted), message);
+  fprintf(jsonrpc_getOutput(), "{\"jsonrpc\":\"2.0\",\"id\":%s,\"error\":{\"code\":%d,\"message\":%s}}\n",
+          request ? request->id : "null", code, quoted);
+  fflush(jsonrpc_getOutput());
+}
+
+void jsonrpc_sendNotification(const char *method, const char *params) {
+  fprintf(jsonrpc_getOutput(), "{\"jsonrpc\":\"2.0\",\"method\":\"%s\",\"params\":%s}\n", method, params);
+  fflush(jsonrpc_getOutput());
+}
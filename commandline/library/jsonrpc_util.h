@@ -0,0 +1,58 @@
+#ifndef JSONRPC_UTIL_H
+#define JSONRPC_UTIL_H
+
+/*
+  Minimal line delimited JSON-RPC 2.0 for the --server mode of micronucleus.
+  One request per line, with flat params of strings, numbers or booleans.
+  Nested values in params are not supported and read as empty string.
+*/
+
+#include <stdio.h>
+
+#define JSONRPC_MAX_LINE 4096
+#define JSONRPC_MAX_PARAMS 16
+#define JSONRPC_MAX_NAME 32
+#define JSONRPC_MAX_VALUE 1024
+
+// error codes of the JSON-RPC 2.0 specification
+#define JSONRPC_PARSE_ERROR -32700
+#define JSONRPC_INVALID_REQUEST -32600
+#define JSONRPC_METHOD_NOT_FOUND -32601
+#define JSONRPC_INVALID_PARAMS -32602
+#define JSONRPC_SERVER_ERROR -32000 // first of the implementation defined errors
+
+typedef struct _jsonrpc_param {
+  char name[JSONRPC_MAX_NAME];
+  char value[JSONRPC_MAX_VALUE]; // decoded string, or the text of a number, true, false or null
+} jsonrpc_param;
+
+typedef struct _jsonrpc_request {
+  char id[JSONRPC_MAX_NAME]; // JSON text of the id, empty for a notification
+  char method[JSONRPC_MAX_NAME];
+  int param_count;
+  jsonrpc_param params[JSONRPC_MAX_PARAMS];
+} jsonrpc_request;
+
+/* Set the stream for responses and notifications, stdout by default */
+void jsonrpc_setOutput(FILE *output);
+
+/* Parse one line. Returns 0 for success, JSONRPC_PARSE_ERROR or JSONRPC_INVALID_REQUEST */
+int jsonrpc_parseRequest(const char *line, jsonrpc_request *request);
+
+/* Returns the value of a named parameter, or NULL if it was not given */
+const char* jsonrpc_getParam(const jsonrpc_request *request, const char *name);
+
+/* Write text as quoted JSON string to buffer, truncated to size */
+void jsonrpc_quote(char *buffer, size_t size, const char *text);
+
+/* Send a response with result as JSON text. Nothing is sent for notifications. */
+void jsonrpc_sendResult(const jsonrpc_request *request, const char *result);
+
+/* Send an error response. request may be NULL if the request could not be parsed. */
+void jsonrpc_sendError(const jsonrpc_request *request, int code, const char *message);
+
+/* Send a notification with params as JSON text */
+void jsonrpc_sendNotification(const char *method, const char *params);
+
+// end JSONRPC_UTIL_H section:
+#endif
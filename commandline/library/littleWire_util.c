@@ -1,4 +1,8 @@
 #include <littleWire_util.h>
+#if !(defined _WIN32 || defined _WIN64)
+#include <errno.h>
+#include <time.h>
+#endif
 
 /* Delay in miliseconds */
 void delay(unsigned int duration) {
@@ -11,3 +15,42 @@ void delay(unsigned int duration) {
     usleep(duration*1000);
   #endif
 }
+
+/* Microseconds from a monotonic clock */
+unsigned long long micros(void) {
+  #if defined _WIN32 || defined _WIN64
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return counter.QuadPart / frequency.QuadPart * 1000000ULL
+           + counter.QuadPart % frequency.QuadPart * 1000000ULL / frequency.QuadPart;
+  #else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+  #endif
+}
+
+/* Sleep until micros() reaches deadline, returns at once if it passed already */
+void delayUntil(unsigned long long deadline) {
+  #if defined _WIN32 || defined _WIN64
+    // Sleep() has a resolution of about 1 ms, round up so the deadline is never missed early
+    unsigned long long now = micros();
+    if (now < deadline) Sleep((DWORD) ((deadline - now + 999) / 1000));
+  #elif defined TIMER_ABSTIME && !defined __APPLE__
+    // absolute deadline, so interruptions and scheduling do not add up over many waits
+    struct timespec wakeup;
+    wakeup.tv_sec = deadline / 1000000;
+    wakeup.tv_nsec = (deadline % 1000000) * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeup, NULL) == EINTR);
+  #else
+    // no clock_nanosleep() on Mac OS, sleep the remaining time again after an interruption
+    unsigned long long now;
+    while ((now = micros()) < deadline) {
+      struct timespec remaining;
+      remaining.tv_sec = (deadline - now) / 1000000;
+      remaining.tv_nsec = ((deadline - now) % 1000000) * 1000;
+      nanosleep(&remaining, NULL);
+    }
+  #endif
+}
@@ -10,5 +10,12 @@
 /* Delay in milliseconds */
 void delay(unsigned int duration);
 
+/* Microseconds from a monotonic clock, for deadlines */
+unsigned long long micros(void);
+
+/* Sleep until micros() reaches the deadline. Unlike a sequence of delay() calls,
+   waits for deadlines computed from one start time do not accumulate errors. */
+void delayUntil(unsigned long long deadline);
+
 // end LITTLEWIRE_UTIL_H section:
 #endif
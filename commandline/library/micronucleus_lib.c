@@ -31,141 +31,521 @@
 /***************************************************************/
 #include "micronucleus_lib.h"
 #include "littleWire_util.h"
+#include "usbcapture_util.h"
 
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
+#if defined(__linux__)
+#include <dirent.h>
+#endif
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+#endif
+
+// lock files held by this process, a device which enumerates again keeps its lock
+static struct {
+  char key[MICRONUCLEUS_LOCK_KEY_MAX];
+  int fd;
+  int count;
+} micronucleus_locks[MICRONUCLEUS_MAX_CANDIDATES];
 
-// called every 100 ms
-micronucleus* micronucleus_connect(int fast_mode) {
-  micronucleus *nucleus = NULL;
-  struct usb_bus *busses;
+/*
+ * usb_control_msg() with MICRONUCLEUS_USB_TIMEOUT, which logs the transfer while a capture is written
+ */
+static int micronucleus_controlMsg(usb_dev_handle *device, int requesttype, int request, int value, int index,
+                                   char *bytes, int size) {
+  usbcapture_transfer transfer;
+  struct usb_device *dev;
+  int res;
+
+  if (!usbcapture_isOpen()) {
+    return usb_control_msg(device, requesttype, request, value, index, bytes, size, MICRONUCLEUS_USB_TIMEOUT);
+  }
+
+  transfer.setup[0] = requesttype;
+  transfer.setup[1] = request;
+  transfer.setup[2] = value;
+  transfer.setup[3] = value >> 8;
+  transfer.setup[4] = index;
+  transfer.setup[5] = index >> 8;
+  transfer.setup[6] = size;
+  transfer.setup[7] = size >> 8;
+  transfer.data_length = 0;
+  if (!(requesttype & USB_ENDPOINT_IN) && size > 0) {
+    transfer.data_length = size < USBCAPTURE_MAX_DATA ? size : USBCAPTURE_MAX_DATA;
+    memcpy(transfer.data, bytes, transfer.data_length);
+  }
+  dev = usb_device(device);
+  transfer.bus = (dev && dev->bus) ? atoi(dev->bus->dirname) : 0;
+  transfer.address = dev ? dev->devnum : 0;
+
+  transfer.start = usbcapture_now();
+  res = usb_control_msg(device, requesttype, request, value, index, bytes, size, MICRONUCLEUS_USB_TIMEOUT);
+  transfer.end = usbcapture_now();
+
+  transfer.result = res;
+  if ((requesttype & USB_ENDPOINT_IN) && res > 0) {
+    transfer.data_length = res < USBCAPTURE_MAX_DATA ? res : USBCAPTURE_MAX_DATA;
+    memcpy(transfer.data, bytes, transfer.data_length);
+  }
+  usbcapture_write(&transfer);
+  return res;
+}
+
+/*
+ * Read the 6 byte configuration reply of a version 2.x device
+ * Returns 0 for success, -1 if the device did not answer correctly
+ */
+static int micronucleus_getInfo(micronucleus *nucleus, int fast_mode) {
+  // get 6 byte nucleus info
+  unsigned char buffer[6];
+  errno = 0;
+  int res = micronucleus_controlMsg(nucleus->device, USB_ENDPOINT_IN| USB_TYPE_VENDOR | USB_RECIP_DEVICE, 0, 0, 0, (char *)buffer, 6);
+
+  // Device descriptor was found, but talking to it was not successful. This can happen when the device is being reset.
+  if (res<0) return -1;
+
+  // Only seen on windows.
+  // This happens if the USB device is not listening, but did not disconnect from the USB bus,
+  // which is a desirable behavior, since otherwise you get that nasty error in device manager.
+  if (res<6) {
+  	fprintf(stderr, "%s. Micronucleus device seems to be inactive. Please unplug and replug or reset the device.\n", strerror(errno));
+  	return -1;
+  }
+
+  assert(res >= 6);
+
+  nucleus->flash_size = (buffer[0]<<8) + buffer[1];
+  nucleus->page_size = buffer[2];
+  nucleus->pages = (nucleus->flash_size / nucleus->page_size);
+  if (nucleus->pages * nucleus->page_size < nucleus->flash_size) nucleus->pages += 1;
+
+  nucleus->bootloader_start = nucleus->pages*nucleus->page_size;
+
+  if ((nucleus->version.major>=2)&&(!fast_mode)) {
+    // firmware v2 reports more aggressive write times. Add 2ms if fast mode is not used.
+    nucleus->write_sleep = (buffer[3] & 127) + 2;
+  } else {
+    nucleus->write_sleep = (buffer[3] & 127);
+  }
+
+  // if bit 7 of write sleep time is set, divide the erase time by four to
+  // accommodate to the 4*page erase of the ATtiny841/441
+  if (buffer[3]&128) {
+       nucleus->erase_sleep = nucleus->write_sleep * nucleus->pages / 4;
+  } else {
+       nucleus->erase_sleep = nucleus->write_sleep * nucleus->pages;
+  }
+
+  nucleus->signature1 = buffer[4];
+  nucleus->signature2 = buffer[5];
+  return 0;
+}
+
+/*
+ * Read the serial number, which is stored in front of OSCCAL and the user reset vector.
+ * A device with ENABLE_SERIAL_NUMBER reports string index 3 even if no serial number was written yet.
+ */
+static void micronucleus_getSerial(micronucleus *nucleus, int iSerialNumber) {
+  nucleus->serial_size = 0;
+  nucleus->serial_number[0] = 0;
+  if (iSerialNumber != 3 || nucleus->bootloader_start < nucleus->flash_size + 6 + 4) return;
+
+  nucleus->serial_size = nucleus->bootloader_start - nucleus->flash_size - 6;
+  if (usb_get_string_simple(nucleus->device, 3, nucleus->serial_number, sizeof(nucleus->serial_number)) <= 0) {
+    nucleus->serial_number[0] = 0; // not written yet
+  }
+}
+
+#if defined(__linux__)
+/*
+ * Read a decimal attribute of a device in sysfs, returns -1 if it does not exist
+ */
+static int micronucleus_readSysfsNumber(const char *device_name, const char *attribute) {
+  char path[300];
+  int value = -1;
+  snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/%s", device_name, attribute);
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) return -1;
+  if (fscanf(fp, "%d", &value) != 1) value = -1;
+  fclose(fp);
+  return value;
+}
+#endif
+
+/*
+ * Get the physical port of a device like "1-1.4", which stays the same when the device enumerates again.
+ * libusb-0.1 has no API for it, so it is only available from sysfs on Linux and empty otherwise.
+ */
+static void micronucleus_getPortPath(struct usb_bus *bus, struct usb_device *dev, char *port_path, size_t size) {
+  port_path[0] = 0;
+#if defined(__linux__)
+  DIR *dir = opendir("/sys/bus/usb/devices");
+  if (dir == NULL) return;
+
+  int busnum = atoi(bus->dirname);
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    // skip interfaces like "1-1.4:1.0" and root hubs like "usb1"
+    if (entry->d_name[0] == '.' || strchr(entry->d_name, ':') || strncmp(entry->d_name, "usb", 3) == 0) continue;
+    if (micronucleus_readSysfsNumber(entry->d_name, "busnum") == busnum
+        && micronucleus_readSysfsNumber(entry->d_name, "devnum") == dev->devnum) {
+      snprintf(port_path, size, "%.*s", (int) size - 1, entry->d_name);
+      break;
+    }
+  }
+  closedir(dir);
+#else
+  (void) bus;
+  (void) dev;
+  (void) size;
+#endif
+}
+
+/*
+ * Compare a bus or device name of libusb with the one given by the user.
+ * Numbers are compared by value, so "1:5" selects bus "001" device "005" too.
+ */
+static int micronucleus_nameMatches(const char *name, unsigned int number, const char *wanted) {
+  char *end;
+  if (strcmp(name, wanted) == 0) return 1;
+  unsigned long value = strtoul(wanted, &end, 10);
+  return *wanted && *end == 0 && value == number;
+}
+
+/*
+ * Check the selector criteria, which are known without opening the device
+ */
+static int micronucleus_isSelected(const micronucleus_selector *selector, struct usb_bus *bus, struct usb_device *dev) {
+  if (selector == NULL) return 1;
+  if (selector->bus && !micronucleus_nameMatches(bus->dirname, atoi(bus->dirname), selector->bus)) return 0;
+  if (selector->device && !micronucleus_nameMatches(dev->filename, dev->devnum, selector->device)) return 0;
+  if (selector->port_path) {
+    char port_path[MICRONUCLEUS_PATH_MAX];
+    micronucleus_getPortPath(bus, dev, port_path, sizeof(port_path));
+    if (strcmp(port_path, selector->port_path) != 0) return 0;
+  }
+  return 1;
+}
+
+/*
+ * The lock key is the port path, so it stays the same when the device enumerates again after a reset.
+ * Without a port path the bus and device names are used.
+ */
+static void micronucleus_getLockKey(struct usb_bus *bus, struct usb_device *dev, char *key, size_t size) {
+  char port_path[MICRONUCLEUS_PATH_MAX];
+  char *c;
+
+  micronucleus_getPortPath(bus, dev, port_path, sizeof(port_path));
+  if (port_path[0]) {
+    snprintf(key, size, "%s", port_path);
+  } else {
+    snprintf(key, size, "%.*s-%.*s", MICRONUCLEUS_PATH_MAX - 1, bus->dirname, MICRONUCLEUS_PATH_MAX - 1, dev->filename);
+  }
+  for (c = key; *c; c++) {
+    if (!isalnum((unsigned char) *c) && *c != '.' && *c != '-') *c = '_';
+  }
+}
+
+/*
+ * Take the advisory lock file of a device, which is released by the system if the process dies.
+ * Returns 0 for success, -1 if another process holds the lock
+ */
+static int micronucleus_lock(const char *key) {
+  int i;
+  int free_slot = -1;
+
+  for (i = 0; i < MICRONUCLEUS_MAX_CANDIDATES; i++) {
+    if (micronucleus_locks[i].count && strcmp(micronucleus_locks[i].key, key) == 0) {
+      micronucleus_locks[i].count++;
+      return 0;
+    }
+    if (!micronucleus_locks[i].count && free_slot < 0) free_slot = i;
+  }
+  if (free_slot < 0) return -1;
+
+  int fd = -1;
+#if !defined(_WIN32)
+  char path[MICRONUCLEUS_LOCK_KEY_MAX + 300];
+  const char *directory = getenv("TMPDIR");
+  if (directory == NULL || directory[0] == 0) directory = "/tmp";
+  snprintf(path, sizeof(path), "%s/micronucleus-%s.lock", directory, key);
+
+  fd = open(path, O_RDWR | O_CREAT, 0666);
+  // without a lock file the interface claim is still exclusive on most platforms
+  if (fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) != 0) {
+    close(fd);
+    return -1;
+  }
+#endif
+  snprintf(micronucleus_locks[free_slot].key, MICRONUCLEUS_LOCK_KEY_MAX, "%s", key);
+  micronucleus_locks[free_slot].fd = fd;
+  micronucleus_locks[free_slot].count = 1;
+  return 0;
+}
+
+static void micronucleus_unlock(const char *key) {
+  int i;
+
+  for (i = 0; i < MICRONUCLEUS_MAX_CANDIDATES; i++) {
+    if (micronucleus_locks[i].count && strcmp(micronucleus_locks[i].key, key) == 0) {
+      if (--micronucleus_locks[i].count == 0) {
+#if !defined(_WIN32)
+        if (micronucleus_locks[i].fd >= 0) close(micronucleus_locks[i].fd); // releases the flock
+#endif
+      }
+      return;
+    }
+  }
+}
+
+/*
+ * Open a device and read its configuration.
+ * Devices claimed by another process are skipped with errno set to EBUSY.
+ *     Returns: device handle for success, NULL for fail
+ */
+static micronucleus* micronucleus_open(struct usb_bus *bus, struct usb_device *dev, int fast_mode) {
+  micronucleus *nucleus = malloc(sizeof(micronucleus));
+  nucleus->version.major = (dev->descriptor.bcdDevice >> 8) & 0xFF;
+  nucleus->version.minor = dev->descriptor.bcdDevice & 0xFF;
+
+  if (nucleus->version.major > MICRONUCLEUS_MAX_MAJOR_VERSION) {
+    fprintf(stderr,
+            "Warning: device with unknown new version of Micronucleus detected.\n"
+            "This tool doesn't know how to upload to this new device. Updates may be available.\n"
+            "Device reports version as: %d.%d\n",
+            nucleus->version.major, nucleus->version.minor);
+    free(nucleus);
+    return NULL;
+  }
+
+  // the lock is taken before the first request, so a running upload of another process is not disturbed
+  micronucleus_getLockKey(bus, dev, nucleus->lock_key, sizeof(nucleus->lock_key));
+  if (micronucleus_lock(nucleus->lock_key) != 0) {
+    free(nucleus);
+    errno = EBUSY;
+    return NULL;
+  }
+
+  errno = 0;
+  nucleus->device = usb_open(dev);
+  if (errno == 13) {
+          fprintf(stderr, "usb_open(): %s. For Linux, copy file https://github.com/micronucleus/micronucleus/blob/master/commandline/49-micronucleus.rules to /etc/udev/rules.d.\n", strerror(errno));
+          micronucleus_close(nucleus);
+          return NULL;
+  }
+  if (!nucleus->device) {
+          fprintf(stderr, "Error opening bus %s device %s: %s\n", bus->dirname, dev->filename, strerror(errno));
+          micronucleus_close(nucleus);
+          return NULL;
+  }
+
+  // Claiming the interface is exclusive, which covers processes using another lock directory.
+  // Other errors are ignored, since the bootloader only uses control transfers.
+  if (usb_claim_interface(nucleus->device, 0) == -EBUSY) {
+    micronucleus_close(nucleus);
+    errno = EBUSY;
+    return NULL;
+  }
+  micronucleus_getPortPath(bus, dev, nucleus->port_path, sizeof(nucleus->port_path));
+
+  if (nucleus->version.major>=2) {  // Version 2.x
+    if (micronucleus_getInfo(nucleus, fast_mode) != 0) {
+      micronucleus_close(nucleus);
+      return NULL;
+    }
+    micronucleus_getSerial(nucleus, dev->descriptor.iSerialNumber);
+  } else {  // Version 1.x
+    // get 4 byte nucleus info
+    unsigned char buffer[4];
+    int res = micronucleus_controlMsg(nucleus->device, USB_ENDPOINT_IN| USB_TYPE_VENDOR | USB_RECIP_DEVICE, 0, 0, 0, (char *)buffer, 4);
+
+    // Device descriptor was found, but talking to it was not successful. This can happen when the device is being reset.
+    if (res<0) {
+      micronucleus_close(nucleus);
+      return NULL;
+    }
+
+    assert(res >= 4);
+
+    nucleus->flash_size = (buffer[0]<<8) + buffer[1];
+    nucleus->page_size = buffer[2];
+    nucleus->pages = (nucleus->flash_size / nucleus->page_size);
+    if (nucleus->pages * nucleus->page_size < nucleus->flash_size) nucleus->pages += 1;
 
-  // Initialize USB and find micronucleus device
+    nucleus->bootloader_start = nucleus->pages*nucleus->page_size;
+
+    nucleus->write_sleep = (buffer[3] & 127);
+    nucleus->erase_sleep = nucleus->write_sleep * nucleus->pages;
+
+    nucleus->signature1 = 0;
+    nucleus->signature2 = 0;
+    nucleus->serial_size = 0;
+    nucleus->serial_number[0] = 0;
+  }
+  return nucleus;
+}
+
+static struct usb_bus* micronucleus_findBusses(void) {
   usb_init();
   usb_find_busses();
   usb_find_devices();
+  return usb_get_busses();
+}
 
-  busses = usb_get_busses();
+static int micronucleus_isBootloader(struct usb_device *dev) {
+  return dev->descriptor.idVendor == MICRONUCLEUS_VENDOR_ID && dev->descriptor.idProduct == MICRONUCLEUS_PRODUCT_ID;
+}
 
+int micronucleus_listDevices(micronucleus_candidate *candidates, int max_candidates) {
+  int count = 0;
   struct usb_bus *bus;
-  for (bus = busses; bus; bus = bus->next) {
-    struct usb_device *dev;
+  struct usb_device *dev;
+
+  for (bus = micronucleus_findBusses(); bus; bus = bus->next) {
+    for (dev = bus->devices; dev && count < max_candidates; dev = dev->next) {
+      if (!micronucleus_isBootloader(dev)) continue;
+
+      micronucleus_candidate *candidate = &candidates[count++];
+      memset(candidate, 0, sizeof(*candidate));
+      snprintf(candidate->bus, sizeof(candidate->bus), "%.*s", (int) sizeof(candidate->bus) - 1, bus->dirname);
+      snprintf(candidate->device, sizeof(candidate->device), "%.*s", (int) sizeof(candidate->device) - 1, dev->filename);
+      candidate->address = dev->devnum;
+      micronucleus_getPortPath(bus, dev, candidate->port_path, sizeof(candidate->port_path));
+      candidate->version.major = (dev->descriptor.bcdDevice >> 8) & 0xFF;
+      candidate->version.minor = dev->descriptor.bcdDevice & 0xFF;
+
+      // the geometry is only known after asking the device, which also resets its idle timeout
+      micronucleus *nucleus = micronucleus_open(bus, dev, 0);
+      if (nucleus == NULL) {
+        candidate->claimed = (errno == EBUSY);
+        continue;
+      }
+      candidate->responding = 1;
+      candidate->flash_size = nucleus->flash_size;
+      candidate->page_size = nucleus->page_size;
+      candidate->pages = nucleus->pages;
+      candidate->signature1 = nucleus->signature1;
+      candidate->signature2 = nucleus->signature2;
+      strcpy(candidate->serial_number, nucleus->serial_number);
+      micronucleus_close(nucleus);
+    }
+  }
+  return count;
+}
 
+// called every 100 ms
+micronucleus* micronucleus_connectSelected(const micronucleus_selector *selector, int fast_mode) {
+  static int warned_count = 0; // the warning is printed once while the polling sees the same devices
+  struct usb_bus *busses = micronucleus_findBusses();
+  struct usb_bus *bus;
+  struct usb_device *dev;
+  int any_criterion = selector && (selector->bus || selector->device || selector->port_path || selector->serial_number);
+
+  if (!any_criterion) {
+    int count = 0;
+    for (bus = busses; bus; bus = bus->next) {
+      for (dev = bus->devices; dev; dev = dev->next) {
+        if (micronucleus_isBootloader(dev)) count++;
+      }
+    }
+    if (count > 1 && count != warned_count) {
+      fprintf(stderr, "Warning: %d micronucleus devices found, using the first one.\n"
+              "Select one by bus and device, port path or serial number.\n", count);
+    }
+    warned_count = count;
+  }
+
+  for (bus = busses; bus; bus = bus->next) {
     for (dev = bus->devices; dev; dev = dev->next) {
       /* Check if this device is a micronucleus */
-      if (dev->descriptor.idVendor == MICRONUCLEUS_VENDOR_ID && dev->descriptor.idProduct == MICRONUCLEUS_PRODUCT_ID)  {
-        nucleus = malloc(sizeof(micronucleus));
-        nucleus->version.major = (dev->descriptor.bcdDevice >> 8) & 0xFF;
-        nucleus->version.minor = dev->descriptor.bcdDevice & 0xFF;
-
-        if (nucleus->version.major > MICRONUCLEUS_MAX_MAJOR_VERSION) {
-          fprintf(stderr,
-                  "Warning: device with unknown new version of Micronucleus detected.\n"
-                  "This tool doesn't know how to upload to this new device. Updates may be available.\n"
-                  "Device reports version as: %d.%d\n",
-                  nucleus->version.major, nucleus->version.minor);
-          return NULL;
-        }
-
-        errno = 0;
-        nucleus->device = usb_open(dev);
-        if (errno == 13) {
-                fprintf(stderr, "usb_open(): %s. For Linux, copy file https://github.com/micronucleus/micronucleus/blob/master/commandline/49-micronucleus.rules to /etc/udev/rules.d.\n", strerror(errno));
-                return NULL;
-        }
-        if (!nucleus->device) {
-                fprintf(stderr, "Error opening bus %s device %s: %s\n", bus->dirname, dev->filename, strerror(errno));
-                return NULL;
-        }
-
-        if (nucleus->version.major>=2) {  // Version 2.x
-          // get 6 byte nucleus info
-          unsigned char buffer[6];
-          errno = 0;
-          int res = usb_control_msg(nucleus->device, USB_ENDPOINT_IN| USB_TYPE_VENDOR | USB_RECIP_DEVICE, 0, 0, 0, (char *)buffer, 6, MICRONUCLEUS_USB_TIMEOUT);
-
-          // Device descriptor was found, but talking to it was not successful. This can happen when the device is being reset.
-          if (res<0) return NULL;
-
-          // Only seen on windows.
-          // This happens if the USB device is not listening, but did not disconnect from the USB bus,
-          // which is a desirable behavior, since otherwise you get that nasty error in device manager.
-          if (res<6) {
-          	fprintf(stderr, "%s. Micronucleus device seems to be inactive. Please unplug and replug or reset the device.\n", strerror(errno));
-          	return NULL;
-          }
-
-          assert(res >= 6);
-
-          nucleus->flash_size = (buffer[0]<<8) + buffer[1];
-          nucleus->page_size = buffer[2];
-          nucleus->pages = (nucleus->flash_size / nucleus->page_size);
-          if (nucleus->pages * nucleus->page_size < nucleus->flash_size) nucleus->pages += 1;
-
-          nucleus->bootloader_start = nucleus->pages*nucleus->page_size;
-
-          if ((nucleus->version.major>=2)&&(!fast_mode)) {
-            // firmware v2 reports more aggressive write times. Add 2ms if fast mode is not used.
-            nucleus->write_sleep = (buffer[3] & 127) + 2;
-          } else {
-            nucleus->write_sleep = (buffer[3] & 127);
-          }
-
-          // if bit 7 of write sleep time is set, divide the erase time by four to
-          // accommodate to the 4*page erase of the ATtiny841/441
-          if (buffer[3]&128) {
-               nucleus->erase_sleep = nucleus->write_sleep * nucleus->pages / 4;
-          } else {
-               nucleus->erase_sleep = nucleus->write_sleep * nucleus->pages;
-          }
-
-          nucleus->signature1 = buffer[4];
-          nucleus->signature2 = buffer[5];
-
-        } else {  // Version 1.x
-          // get 4 byte nucleus info
-          unsigned char buffer[4];
-          int res = usb_control_msg(nucleus->device, USB_ENDPOINT_IN| USB_TYPE_VENDOR | USB_RECIP_DEVICE, 0, 0, 0, (char *)buffer, 4, MICRONUCLEUS_USB_TIMEOUT);
-
-          // Device descriptor was found, but talking to it was not successful. This can happen when the device is being reset.
-          if (res<0) return NULL;
-
-          assert(res >= 4);
-
-          nucleus->flash_size = (buffer[0]<<8) + buffer[1];
-          nucleus->page_size = buffer[2];
-          nucleus->pages = (nucleus->flash_size / nucleus->page_size);
-          if (nucleus->pages * nucleus->page_size < nucleus->flash_size) nucleus->pages += 1;
-
-          nucleus->bootloader_start = nucleus->pages*nucleus->page_size;
-
-          nucleus->write_sleep = (buffer[3] & 127);
-          nucleus->erase_sleep = nucleus->write_sleep * nucleus->pages;
-
-          nucleus->signature1 = 0;
-          nucleus->signature2 = 0;
-        }
+      if (!micronucleus_isBootloader(dev) || !micronucleus_isSelected(selector, bus, dev)) continue;
+
+      micronucleus *nucleus = micronucleus_open(bus, dev, fast_mode);
+      if (nucleus == NULL) continue;
+
+      // the serial number can only be read from the opened device
+      if (selector && selector->serial_number && strcmp(nucleus->serial_number, selector->serial_number) != 0) {
+        micronucleus_close(nucleus);
+        continue;
       }
+      return nucleus;
     }
   }
 
-  return nucleus;
+  return NULL;
 }
 
-int micronucleus_eraseFlash(micronucleus* deviceHandle, micronucleus_callback progress) {
-  int res;
-  res = usb_control_msg(deviceHandle->device, USB_ENDPOINT_OUT| USB_TYPE_VENDOR | USB_RECIP_DEVICE, 2, 0, 0, NULL, 0, MICRONUCLEUS_USB_TIMEOUT);
+micronucleus* micronucleus_connect(int fast_mode) {
+  return micronucleus_connectSelected(NULL, fast_mode);
+}
 
-  // give microcontroller enough time to erase all writable pages and come back online
-  float i = 0;
-  while (i < 1.0) {
-    // update progress callback if one was supplied
-    if (progress) progress(i);
+micronucleus* micronucleus_reentry(int vendor_id, int product_id, int fast_mode) {
+  struct usb_bus *bus;
+  struct usb_device *dev;
+
+  usb_init();
+  usb_find_busses();
+  usb_find_devices();
 
-    delay(((float) deviceHandle->erase_sleep) / 100.0f);
-    i += 0.01;
+  for (bus = usb_get_busses(); bus; bus = bus->next) {
+    for (dev = bus->devices; dev; dev = dev->next) {
+      if (dev->descriptor.idVendor != vendor_id || dev->descriptor.idProduct != product_id) continue;
+
+      // The interface is not claimed, since a driver of the application may be bound to it
+      char lock_key[MICRONUCLEUS_LOCK_KEY_MAX];
+      micronucleus_getLockKey(bus, dev, lock_key, sizeof(lock_key));
+      if (micronucleus_lock(lock_key) != 0) continue;
+
+      usb_dev_handle *device = usb_open(dev);
+      if (!device) {
+        fprintf(stderr, "Error opening bus %s device %s: %s\n", bus->dirname, dev->filename, strerror(errno));
+        micronucleus_unlock(lock_key);
+        return NULL;
+      }
+
+      // Ask the application to jump to the bootloader. It keeps its USB address, so the handle stays valid.
+      if (micronucleus_controlMsg(device, USB_ENDPOINT_OUT| USB_TYPE_VENDOR | USB_RECIP_DEVICE, MICRONUCLEUS_REENTRY_REQUEST, 0, 0, NULL, 0) < 0) {
+        usb_close(device);
+        micronucleus_unlock(lock_key);
+        return NULL;
+      }
+      delay(MICRONUCLEUS_REENTRY_WAIT);
+
+      // The enumerated device descriptor is the one of the application, so ask the bootloader for its own
+      unsigned char descriptor[18];
+      if (usb_get_descriptor(device, USB_DT_DEVICE, 0, descriptor, sizeof(descriptor)) != sizeof(descriptor)
+          || descriptor[13] < 2 || descriptor[13] > MICRONUCLEUS_MAX_MAJOR_VERSION) {
+        usb_close(device);
+        micronucleus_unlock(lock_key);
+        return NULL;
+      }
+
+      micronucleus *nucleus = malloc(sizeof(micronucleus));
+      nucleus->device = device;
+      strcpy(nucleus->lock_key, lock_key);
+      nucleus->version.major = descriptor[13];
+      nucleus->version.minor = descriptor[12];
+      if (micronucleus_getInfo(nucleus, fast_mode) != 0) {
+        micronucleus_close(nucleus);
+        return NULL;
+      }
+      micronucleus_getSerial(nucleus, descriptor[16]);
+      micronucleus_getPortPath(bus, dev, nucleus->port_path, sizeof(nucleus->port_path));
+      return nucleus;
+    }
   }
 
+  return NULL;
+}
+
+/*
+ * Map the result of the erase request, returns 1 if the device must be connected again
+ */
+static int micronucleus_eraseResult(micronucleus* deviceHandle, int res) {
   /* Under Linux, the erase process is often aborted with errors such as:
    usbfs: USBDEVFS_CONTROL failed cmd micronucleus rqt 192 rq 2 len 0 ret -84
    This seems to be because the erase is taking long enough that the device
@@ -189,144 +569,179 @@ int micronucleus_eraseFlash(micronucleus* deviceHandle, micronucleus_callback pr
   }
 }
 
-int micronucleus_writeFlash(micronucleus* deviceHandle, unsigned int program_size, unsigned char* program, micronucleus_callback prog) {
+int micronucleus_eraseFlash(micronucleus* deviceHandle, micronucleus_callback progress) {
+  int res;
+  res = micronucleus_controlMsg(deviceHandle->device, USB_ENDPOINT_OUT| USB_TYPE_VENDOR | USB_RECIP_DEVICE, 2, 0, 0, NULL, 0);
+
+  // give microcontroller enough time to erase all writable pages and come back online
+  // The erase started when the request completed, and all progress steps are relative to this time.
+  unsigned long long start = micros();
+  int i;
+  for (i = 0; i < 100; i++) {
+    // update progress callback if one was supplied
+    if (progress) progress(i / 100.0f);
+
+    delayUntil(start + deviceHandle->erase_sleep * 1000ULL * (i + 1) / 100);
+  }
+
+  return micronucleus_eraseResult(deviceHandle, res);
+}
+
+/*
+ * Fill page_buffer with the page at address of the program. Micronucleus >= 2 gets the patched
+ * reset vectors and the serial number, the user reset vector is saved from page 0 for the last page.
+ * Returns the number of bytes to write, 0 if the page contains no data, or a negative error
+ */
+static int micronucleus_preparePage(micronucleus* deviceHandle, unsigned int address, unsigned int program_size,
+                                    unsigned char* program, unsigned char* page_buffer, unsigned int* userReset) {
   unsigned char page_length = deviceHandle->page_size;
-  unsigned char page_buffer[page_length];
-  unsigned int  address; // overall flash memory address
   unsigned int  page_address; // address within this page when copying buffer
-  unsigned int  res;
-  unsigned int  pagecontainsdata;
-  unsigned int  userReset;
-
-  for (address = 0; address < deviceHandle->flash_size; address += deviceHandle->page_size) {
-    // work around a bug in older bootloader versions
-    if (deviceHandle->version.major == 1 && deviceHandle->version.minor <= 2
-        && address / deviceHandle->page_size == deviceHandle->pages - 1) {
-      page_length = deviceHandle->flash_size % deviceHandle->page_size;
+  unsigned int  pagecontainsdata = 0;
+
+  // work around a bug in older bootloader versions
+  if (deviceHandle->version.major == 1 && deviceHandle->version.minor <= 2
+      && address / deviceHandle->page_size == deviceHandle->pages - 1) {
+    page_length = deviceHandle->flash_size % deviceHandle->page_size;
+  }
+
+  // copy in bytes from user program
+  for (page_address = 0; page_address < page_length; page_address += 1) {
+    if (address + page_address > program_size) {
+      page_buffer[page_address] = 0xFF; // pad out remainder with unprogrammed bytes
+    } else {
+      pagecontainsdata=1; // page contains data and needs to be written
+      page_buffer[page_address] = program[address + page_address]; // load from user program
     }
+  }
 
-    pagecontainsdata=0;
+  // Reset vector patching is done in the host tool in micronucleus >=2
+  if (deviceHandle->version.major >=2)
+  {
+    if ( address == 0 ) {
+      // save user reset vector (bootloader will patch with its vector)
+      unsigned int word0, word1;
+      word0 = page_buffer [1] * 0x100 + page_buffer [0];
+      word1 = page_buffer [3] * 0x100 + page_buffer [2];
+
+      if (word0==0x940c) {  // long jump
+        *userReset = word1;
+      } else if ((word0&0xf000)==0xc000) {  // rjmp
+        *userReset = (word0 & 0x0fff) - 0 + 1;
+      } else {
+        fprintf(stderr,
+                "The reset vector of the user program does not contain a branch instruction,\n"
+                "therefore the bootloader can not be inserted. Please rearrange your code.\n"
+                );
+        return -8;  // choose #define ENOEXEC     8   /* Exec format error */
+      }
 
-    // copy in bytes from user program
-    for (page_address = 0; page_address < page_length; page_address += 1) {
-      if (address + page_address > program_size) {
-        page_buffer[page_address] = 0xFF; // pad out remainder with unprogrammed bytes
+      // Patch in jmp to bootloader.
+      if (deviceHandle->bootloader_start > 0x2000) {
+        //  jmp
+        unsigned data = 0x940c;
+        page_buffer [ 0 ] = data >> 0 & 0xff;
+        page_buffer [ 1 ] = data >> 8 & 0xff;
+        page_buffer [ 2 ] = deviceHandle->bootloader_start >> 0 & 0xff;
+        page_buffer [ 3 ] = deviceHandle->bootloader_start >> 8 & 0xff;
       } else {
-        pagecontainsdata=1; // page contains data and needs to be written
-        page_buffer[page_address] = program[address + page_address]; // load from user program
+        // rjmp
+        unsigned data =  0xc000 | ((deviceHandle->bootloader_start/2 - 1) & 0x0fff);
+        page_buffer [ 0 ] = data >> 0 & 0xff;
+        page_buffer [ 1 ] = data >> 8 & 0xff;
       }
-    }
 
-    // Reset vector patching is done in the host tool in micronucleus >=2
-    if (deviceHandle->version.major >=2)
-    {
-      if ( address == 0 ) {
-        // save user reset vector (bootloader will patch with its vector)
-        unsigned int word0, word1;
-        word0 = page_buffer [1] * 0x100 + page_buffer [0];
-        word1 = page_buffer [3] * 0x100 + page_buffer [2];
-
-        if (word0==0x940c) {  // long jump
-          userReset = word1;
-        } else if ((word0&0xf000)==0xc000) {  // rjmp
-          userReset = (word0 & 0x0fff) - 0 + 1;
-        } else {
-          fprintf(stderr,
-                  "The reset vector of the user program does not contain a branch instruction,\n"
-                  "therefore the bootloader can not be inserted. Please rearrange your code.\n"
-                  );
-          return -8;  // choose #define ENOEXEC     8   /* Exec format error */
-        }
-
-        // Patch in jmp to bootloader.
-        if (deviceHandle->bootloader_start > 0x2000) {
-          //  jmp
-          unsigned data = 0x940c;
-          page_buffer [ 0 ] = data >> 0 & 0xff;
-          page_buffer [ 1 ] = data >> 8 & 0xff;
-          page_buffer [ 2 ] = deviceHandle->bootloader_start >> 0 & 0xff;
-          page_buffer [ 3 ] = deviceHandle->bootloader_start >> 8 & 0xff;
-        } else {
-          // rjmp
-          unsigned data =  0xc000 | ((deviceHandle->bootloader_start/2 - 1) & 0x0fff);
-          page_buffer [ 0 ] = data >> 0 & 0xff;
-          page_buffer [ 1 ] = data >> 8 & 0xff;
-        }
+    }
 
+    if ( address >= deviceHandle->bootloader_start - deviceHandle->page_size && deviceHandle->serial_number[0] ) {
+      // write serial number string descriptor in front of OSCCAL, it was erased together with the user program
+      unsigned int offset = deviceHandle->flash_size - address;
+      unsigned int length = strlen(deviceHandle->serial_number);
+      unsigned int i;
+      page_buffer [offset + 0] = 2 + 2 * length;
+      page_buffer [offset + 1] = 3; // string descriptor type
+      for (i = 0; i < length; i++) {
+        page_buffer [offset + 2 + 2 * i] = deviceHandle->serial_number[i];
+        page_buffer [offset + 3 + 2 * i] = 0;
       }
+    }
 
-      if ( address >= deviceHandle->bootloader_start - deviceHandle->page_size ) {
-        // move user reset vector to end of last page
-        // The reset vector is always the last vector in the tinyvectortable
-        unsigned int user_reset_addr = (deviceHandle->pages*deviceHandle->page_size) - 4;
-
-        if (user_reset_addr > 0x2000) {
-          //  jmp
-          unsigned data = 0x940c;
-          page_buffer [user_reset_addr - address + 0] = data >> 0 & 0xff;
-          page_buffer [user_reset_addr - address + 1] = data >> 8 & 0xff;
-          page_buffer [user_reset_addr - address + 2] = userReset >> 0 & 0xff;
-          page_buffer [user_reset_addr - address + 3] = userReset >> 8 & 0xff;
-        } else {
-          // rjmp
-          unsigned data =  0xc000 | ((userReset - user_reset_addr/2 - 1) & 0x0fff);
-          page_buffer [user_reset_addr - address + 0] = data >> 0 & 0xff;
-          page_buffer [user_reset_addr - address + 1] = data >> 8 & 0xff;
-        }
+    if ( address >= deviceHandle->bootloader_start - deviceHandle->page_size ) {
+      // move user reset vector to end of last page
+      // The reset vector is always the last vector in the tinyvectortable
+      unsigned int user_reset_addr = (deviceHandle->pages*deviceHandle->page_size) - 4;
+
+      if (user_reset_addr > 0x2000) {
+        //  jmp
+        unsigned data = 0x940c;
+        page_buffer [user_reset_addr - address + 0] = data >> 0 & 0xff;
+        page_buffer [user_reset_addr - address + 1] = data >> 8 & 0xff;
+        page_buffer [user_reset_addr - address + 2] = *userReset >> 0 & 0xff;
+        page_buffer [user_reset_addr - address + 3] = *userReset >> 8 & 0xff;
+      } else {
+        // rjmp
+        unsigned data =  0xc000 | ((*userReset - user_reset_addr/2 - 1) & 0x0fff);
+        page_buffer [user_reset_addr - address + 0] = data >> 0 & 0xff;
+        page_buffer [user_reset_addr - address + 1] = data >> 8 & 0xff;
       }
     }
+  }
 
+  // always write last page so bootloader can insert the tiny vector table
+  if ( address >= deviceHandle->bootloader_start - deviceHandle->page_size )
+    pagecontainsdata = 1;
 
-    // always write last page so bootloader can insert the tiny vector table
-    if ( address >= deviceHandle->bootloader_start - deviceHandle->page_size )
-      pagecontainsdata = 1;
+  return pagecontainsdata ? page_length : 0;
+}
 
+/*
+ * Ask the microcontroller to write the data of this page
+ */
+static int micronucleus_sendPage(micronucleus* deviceHandle, unsigned int address, unsigned char* page_buffer, unsigned char page_length) {
+  int res = 0;
+
+  if (deviceHandle->version.major == 1) {
+    // Firmware rev.1 transfers a page as a single block
     // ask microcontroller to write this page's data
-    if (pagecontainsdata) {
-
-      if (deviceHandle->version.major == 1) {
-        // Firmware rev.1 transfers a page as a single block
-        // ask microcontroller to write this page's data
-        res = usb_control_msg(deviceHandle->device,
-               USB_ENDPOINT_OUT| USB_TYPE_VENDOR | USB_RECIP_DEVICE,
-               1,
-               page_length, address,
-               page_buffer, page_length,
-               MICRONUCLEUS_USB_TIMEOUT);
-      } else if (deviceHandle->version.major >= 2) {
-        // Firmware rev.2 uses individual set up packets to transfer data
-        res = usb_control_msg(deviceHandle->device, USB_ENDPOINT_OUT| USB_TYPE_VENDOR | USB_RECIP_DEVICE, 1, page_length, address, NULL, 0, MICRONUCLEUS_USB_TIMEOUT);
-        if (res) return res;
-        int i;
-
-        for (i=0; i< page_length; i+=4)
-        {
-          int w1,w2;
-          w1=(page_buffer[i+1]<<8)+(page_buffer[i+0]<<0);
-          w2=(page_buffer[i+3]<<8)+(page_buffer[i+2]<<0);
-
-          res = usb_control_msg(deviceHandle->device, USB_ENDPOINT_OUT| USB_TYPE_VENDOR | USB_RECIP_DEVICE, 3, w1, w2, NULL, 0, MICRONUCLEUS_USB_TIMEOUT);
-          if (res) return res;
-        }
-      }
-    /*
-      res = usb_control_msg(deviceHandle->device,
-             USB_ENDPOINT_OUT| USB_TYPE_VENDOR | USB_RECIP_DEVICE,
-             1,
-             page_length, address,
-             (char*)page_buffer, page_length,
-             MICRONUCLEUS_USB_TIMEOUT);
-
-      if (res != page_length) return -1;
-    */
-      // give microcontroller enough time to write this page and come back online
-      delay(deviceHandle->write_sleep);
+    res = micronucleus_controlMsg(deviceHandle->device,
+           USB_ENDPOINT_OUT| USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+           1,
+           page_length, address,
+           (char *)page_buffer, page_length);
+    // usb_control_msg() returns the number of bytes sent, a short transfer did not write the page
+    if (res == page_length) return 0;
+    return res < 0 ? res : -EIO;
+  } else if (deviceHandle->version.major >= 2) {
+    // Firmware rev.2 uses individual set up packets to transfer data
+    res = micronucleus_controlMsg(deviceHandle->device, USB_ENDPOINT_OUT| USB_TYPE_VENDOR | USB_RECIP_DEVICE, 1, page_length, address, NULL, 0);
+    if (res) return res;
+    int i;
+
+    for (i=0; i< page_length; i+=4)
+    {
+      int w1,w2;
+      w1=(page_buffer[i+1]<<8)+(page_buffer[i+0]<<0);
+      w2=(page_buffer[i+3]<<8)+(page_buffer[i+2]<<0);
+
+      res = micronucleus_controlMsg(deviceHandle->device, USB_ENDPOINT_OUT| USB_TYPE_VENDOR | USB_RECIP_DEVICE, 3, w1, w2, NULL, 0);
+      if (res) return res;
     }
+  }
+  return res;
+}
 
-  // call progress update callback if that's a thing
-  if (prog) prog(((float) address) / ((float) deviceHandle->flash_size));
+int micronucleus_writeFlash(micronucleus* deviceHandle, unsigned int program_size, unsigned char* program, micronucleus_callback prog) {
+  micronucleus_upload upload;
+  int res = micronucleus_uploadBegin(&upload, deviceHandle, program_size, program, 0);
+
+  while (res == MICRONUCLEUS_UPLOAD_BUSY) {
+    // give microcontroller enough time to write this page and come back online
+    delayUntil(upload.deadline);
+    res = micronucleus_uploadStep(&upload);
 
+    // call progress update callback if that's a thing
+    if (prog && res == MICRONUCLEUS_UPLOAD_BUSY) prog(micronucleus_uploadProgress(&upload));
   }
+  if (res != MICRONUCLEUS_UPLOAD_DONE) return res;
 
   // call progress update callback with completion status
   if (prog) prog(1.0);
@@ -334,9 +749,162 @@ int micronucleus_writeFlash(micronucleus* deviceHandle, unsigned int program_siz
   return 0;
 }
 
+int micronucleus_uploadBegin(micronucleus_upload* upload, micronucleus* deviceHandle, unsigned int program_size,
+                             unsigned char* program, int erase) {
+  memset(upload, 0, sizeof(*upload));
+  upload->device = deviceHandle;
+  upload->program_size = program_size;
+  upload->program = program;
+  upload->state = erase ? MICRONUCLEUS_STATE_ERASE : MICRONUCLEUS_STATE_WRITE;
+  upload->deadline = micros();
+  return MICRONUCLEUS_UPLOAD_BUSY;
+}
+
+int micronucleus_uploadStep(micronucleus_upload* upload) {
+  micronucleus* deviceHandle = upload->device;
+  int res;
+
+  if (upload->state == MICRONUCLEUS_STATE_DONE) return MICRONUCLEUS_UPLOAD_DONE;
+  if (upload->state == MICRONUCLEUS_STATE_FAILED) return upload->result;
+  if (micros() < upload->deadline) return MICRONUCLEUS_UPLOAD_BUSY; // called too early
+
+  if (upload->state == MICRONUCLEUS_STATE_ERASE) {
+    res = micronucleus_controlMsg(deviceHandle->device, USB_ENDPOINT_OUT| USB_TYPE_VENDOR | USB_RECIP_DEVICE, 2, 0, 0, NULL, 0);
+    res = micronucleus_eraseResult(deviceHandle, res);
+    if (res != 0) {
+      // a lost connection is reported as MICRONUCLEUS_UPLOAD_RECONNECT
+      upload->state = MICRONUCLEUS_STATE_FAILED;
+      upload->result = (res == 1) ? MICRONUCLEUS_UPLOAD_RECONNECT : res;
+      return upload->result;
+    }
+    // the microcontroller needs time to erase all writable pages and come back online
+    upload->state = MICRONUCLEUS_STATE_WRITE;
+    upload->deadline = micros() + deviceHandle->erase_sleep * 1000ULL;
+    return MICRONUCLEUS_UPLOAD_BUSY;
+  }
+
+  // pages without data are skipped, one page is written per step
+  while (upload->address < deviceHandle->flash_size) {
+    unsigned int address = upload->address;
+    int page_length = micronucleus_preparePage(deviceHandle, address, upload->program_size, upload->program,
+                                               upload->page_buffer, &upload->user_reset);
+    upload->address += deviceHandle->page_size;
+    if (page_length == 0) continue;
+
+    res = (page_length < 0) ? page_length : micronucleus_sendPage(deviceHandle, address, upload->page_buffer, page_length);
+    if (res != 0) {
+      upload->state = MICRONUCLEUS_STATE_FAILED;
+      upload->result = res;
+      return res;
+    }
+    // give microcontroller enough time to write this page and come back online
+    // the deadline is taken when the last request of the page completed, when the device starts programming
+    upload->deadline = micros() + deviceHandle->write_sleep * 1000ULL;
+    return MICRONUCLEUS_UPLOAD_BUSY;
+  }
+  upload->state = MICRONUCLEUS_STATE_DONE;
+  return MICRONUCLEUS_UPLOAD_DONE;
+}
+
+int micronucleus_uploadTimeout(const micronucleus_upload* upload) {
+  if (upload->state == MICRONUCLEUS_STATE_DONE || upload->state == MICRONUCLEUS_STATE_FAILED) return -1;
+
+  unsigned long long now = micros();
+  // rounded up, so a timer does not fire before the device is ready
+  return upload->deadline > now ? (int) ((upload->deadline - now + 999) / 1000) : 0;
+}
+
+float micronucleus_uploadProgress(const micronucleus_upload* upload) {
+  if (upload->state == MICRONUCLEUS_STATE_DONE) return 1.0f;
+  if (upload->state == MICRONUCLEUS_STATE_ERASE) return 0.0f;
+  return ((float) upload->address) / ((float) upload->device->flash_size);
+}
+
+int micronucleus_keepAlive(micronucleus* deviceHandle) {
+  return micronucleus_controlMsg(deviceHandle->device, USB_ENDPOINT_OUT| USB_TYPE_VENDOR | USB_RECIP_DEVICE, 5, 0, 0, NULL, 0);
+}
+
+int micronucleus_setSerial(micronucleus* deviceHandle, const char* serial) {
+  if (deviceHandle->serial_size == 0 || strlen(serial) > (deviceHandle->serial_size - 2) / 2) return -1;
+
+  strcpy(deviceHandle->serial_number, serial);
+  return 0;
+}
+
+int micronucleus_getHealth(micronucleus* deviceHandle, micronucleus_health* health) {
+  unsigned char buffer[8];
+  int res = micronucleus_controlMsg(deviceHandle->device, USB_ENDPOINT_IN| USB_TYPE_VENDOR | USB_RECIP_DEVICE, 0, MICRONUCLEUS_INFO_HEALTH, 0, (char *)buffer, 8);
+
+  if (res < 0) return res;
+  if (res != 8 || deviceHandle->version.major < 2) return 1;
+
+  health->resets = buffer[0] + (buffer[1] << 8);
+  health->packets = buffer[2] + (buffer[3] << 8);
+  health->resyncs = buffer[4] + (buffer[5] << 8);
+  health->dropped_setups = buffer[6] + (buffer[7] << 8);
+  return 0;
+}
+
+int micronucleus_getEeprom(micronucleus* deviceHandle, micronucleus_eeprom* eeprom) {
+  unsigned char buffer[6];
+  int res = micronucleus_controlMsg(deviceHandle->device, USB_ENDPOINT_IN| USB_TYPE_VENDOR | USB_RECIP_DEVICE, 0, MICRONUCLEUS_INFO_EEPROM, 0, (char *)buffer, 6);
+
+  if (res < 0) return res;
+  if (res != 3 || deviceHandle->version.major < 2) return 1;
+
+  eeprom->size = buffer[0] + (buffer[1] << 8);
+  eeprom->write_sleep = buffer[2];
+  return 0;
+}
+
+int micronucleus_writeEeprom(micronucleus* deviceHandle, const micronucleus_eeprom* eeprom, unsigned int address,
+                             unsigned int length, const unsigned char* data, micronucleus_callback progress) {
+  unsigned long long deadline = micros();
+  unsigned int i;
+
+  if (address > eeprom->size || length > eeprom->size - address) return -EINVAL;
+
+  for (i = 0; i < length; i += 2) {
+    int value = data[i];
+    int index = address + i;
+    int res;
+
+    if (i + 1 < length) {
+      value |= data[i + 1] << 8;
+    } else {
+      index |= MICRONUCLEUS_EEPROM_LOW_BYTE;
+    }
+    // the bootloader does not answer while the previous bytes are written
+    delayUntil(deadline);
+    res = micronucleus_controlMsg(deviceHandle->device, USB_ENDPOINT_OUT| USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+                                  MICRONUCLEUS_EEPROM_REQUEST, value, index, NULL, 0);
+    if (res) return res;
+    deadline = micros() + eeprom->write_sleep * 1000ULL;
+
+    if (progress) progress((float) i / length);
+  }
+  delayUntil(deadline);
+
+  if (progress) progress(1.0);
+  return 0;
+}
+
+int micronucleus_capture(const char *filename) {
+  if (filename == NULL) {
+    usbcapture_close();
+    return 0;
+  }
+  return usbcapture_open(filename);
+}
+
+int micronucleus_controlTransfer(micronucleus* deviceHandle, int requesttype, int request, int value, int index,
+                                 char *bytes, int size) {
+  return micronucleus_controlMsg(deviceHandle->device, requesttype, request, value, index, bytes, size);
+}
+
 int micronucleus_startApp(micronucleus* deviceHandle) {
   int res;
-  res = usb_control_msg(deviceHandle->device, USB_ENDPOINT_OUT| USB_TYPE_VENDOR | USB_RECIP_DEVICE, 4, 0, 0, NULL, 0, MICRONUCLEUS_USB_TIMEOUT);
+  res = micronucleus_controlMsg(deviceHandle->device, USB_ENDPOINT_OUT| USB_TYPE_VENDOR | USB_RECIP_DEVICE, 4, 0, 0, NULL, 0);
 
   if(res!=0)
     return res;
@@ -346,3 +914,12 @@ int micronucleus_startApp(micronucleus* deviceHandle) {
 
 
 
+
+void micronucleus_close(micronucleus* deviceHandle) {
+  if (deviceHandle->device) {
+    usb_release_interface(deviceHandle->device, 0);
+    usb_close(deviceHandle->device);
+  }
+  micronucleus_unlock(deviceHandle->lock_key);
+  free(deviceHandle);
+}
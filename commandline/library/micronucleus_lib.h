@@ -48,6 +48,16 @@
 #define MICRONUCLEUS_PRODUCT_ID  0x0753
 #define MICRONUCLEUS_USB_TIMEOUT 0x2800 // 10 seconds - timeout is in milliseconds. 65 seconds makes no sense for an individual USB transfer.
 #define MICRONUCLEUS_MAX_MAJOR_VERSION 2
+#define MICRONUCLEUS_REENTRY_REQUEST 0x6D // vendor request for an application to jump to a bootloader with ENABLE_APP_REENTRY
+#define MICRONUCLEUS_REENTRY_WAIT 20 // milliseconds for the application to jump to the bootloader
+#define MICRONUCLEUS_SERIAL_MAX 126 // maximum number of characters of a serial number, which fit into a 256 byte page
+#define MICRONUCLEUS_PATH_MAX 64 // maximum length of bus, device and port path names
+#define MICRONUCLEUS_MAX_CANDIDATES 32 // maximum number of devices listed or locked at once
+#define MICRONUCLEUS_LOCK_KEY_MAX (2 * MICRONUCLEUS_PATH_MAX) // lock file name of a device, see micronucleus_close()
+#define MICRONUCLEUS_INFO_HEALTH 1 // wValue of the device info request for the health counters
+#define MICRONUCLEUS_INFO_EEPROM 2 // wValue of the device info request for the EEPROM size
+#define MICRONUCLEUS_EEPROM_REQUEST 6 // vendor request of ENABLE_EEPROM_WRITE, writes 2 bytes
+#define MICRONUCLEUS_EEPROM_LOW_BYTE 0x8000 // flag in wIndex to write only the low byte of wValue
 
 /*******************************************************************************/
 
@@ -76,10 +86,79 @@ typedef struct _micronucleus {
   unsigned int erase_sleep; // milliseconds
   unsigned char signature1; // only used in protocol v2
   unsigned char signature2; // only used in protocol v2
+  unsigned int serial_size; // bytes reserved for the serial number descriptor, 0 if not supported
+  char serial_number[MICRONUCLEUS_SERIAL_MAX + 1]; // written again at upload, empty if not set
+  char port_path[MICRONUCLEUS_PATH_MAX]; // physical port like "1-1.4", empty if not available on this platform
+  char lock_key[MICRONUCLEUS_LOCK_KEY_MAX]; // claims the device against other processes
 } micronucleus;
 
+// one bootloader found on the bus, which is not opened
+typedef struct _micronucleus_candidate {
+  char bus[MICRONUCLEUS_PATH_MAX];       // bus name of libusb, like "001"
+  char device[MICRONUCLEUS_PATH_MAX];    // device name of libusb, like "005"
+  unsigned int address;                  // USB device address
+  char port_path[MICRONUCLEUS_PATH_MAX]; // physical port like "1-1.4", empty if not available on this platform
+  micronucleus_version version;
+  int claimed;                           // 1 if the device is used by another process
+  int responding;                        // 0 if the device could not be opened, the fields below are not valid then
+  unsigned int flash_size;
+  unsigned int page_size;
+  unsigned int pages;
+  unsigned char signature1;
+  unsigned char signature2;
+  char serial_number[MICRONUCLEUS_SERIAL_MAX + 1];
+} micronucleus_candidate;
+
+// criteria to select one of several devices, NULL fields match every device
+typedef struct _micronucleus_selector {
+  const char *bus;           // bus name or number
+  const char *device;        // device name or address
+  const char *port_path;     // physical port, only supported on Linux
+  const char *serial_number;
+} micronucleus_selector;
+
+// counters of a bootloader with ENABLE_HEALTH_COUNTERS since it was entered, they wrap around at 65536
+typedef struct _micronucleus_health {
+  unsigned int resets;         // host resets detected
+  unsigned int packets;        // USB packets received
+  unsigned int resyncs;        // packets which collided with the processing of the previous packet
+  unsigned int dropped_setups; // SETUP packets with a length other than 8
+} micronucleus_health;
+
+// EEPROM of a bootloader with ENABLE_EEPROM_WRITE
+typedef struct _micronucleus_eeprom {
+  unsigned int size;        // bytes
+  unsigned int write_sleep; // milliseconds to wait after each request
+} micronucleus_eeprom;
+
 typedef void (*micronucleus_callback)(float progress);
 
+#define MICRONUCLEUS_PAGE_MAX 256 // largest page size of a supported device
+
+// results of micronucleus_uploadStep(), errors are negative
+#define MICRONUCLEUS_UPLOAD_DONE 0
+#define MICRONUCLEUS_UPLOAD_BUSY 1       // call micronucleus_uploadStep() again after micronucleus_uploadTimeout()
+#define MICRONUCLEUS_UPLOAD_RECONNECT 2  // connection lost during erase, connect again and upload without erase
+
+// states of an upload session
+#define MICRONUCLEUS_STATE_ERASE 0
+#define MICRONUCLEUS_STATE_WRITE 1
+#define MICRONUCLEUS_STATE_DONE 2
+#define MICRONUCLEUS_STATE_FAILED 3
+
+// upload session, which is advanced by micronucleus_uploadStep() without sleeping
+typedef struct _micronucleus_upload {
+  micronucleus *device;
+  unsigned int program_size;
+  unsigned char *program;
+  int state;
+  int result;                  // error of a failed session
+  unsigned int address;        // next page to write
+  unsigned long long deadline; // micros() when the device is ready for the next step
+  unsigned int user_reset;     // user reset vector, saved from page 0 for the last page
+  unsigned char page_buffer[MICRONUCLEUS_PAGE_MAX];
+} micronucleus_upload;
+
 /*******************************************************************************/
 
 /********************************************************************************
@@ -89,6 +168,31 @@ typedef void (*micronucleus_callback)(float progress);
 micronucleus* micronucleus_connect(int fast_mode);
 /*******************************************************************************/
 
+/********************************************************************************
+* Try to connect to the first device matching all criteria of the selector.
+* A NULL selector matches every device, like micronucleus_connect().
+*     Returns: device handle for success, NULL for fail
+********************************************************************************/
+micronucleus* micronucleus_connectSelected(const micronucleus_selector *selector, int fast_mode);
+/*******************************************************************************/
+
+/********************************************************************************
+* List all connected bootloaders. Each one is opened shortly to read its
+* geometry, which resets its idle timeout.
+*     Returns: number of devices stored in candidates
+********************************************************************************/
+int micronucleus_listDevices(micronucleus_candidate *candidates, int max_candidates);
+/*******************************************************************************/
+
+/********************************************************************************
+* Ask a running application with the given USB IDs to jump to the bootloader
+* and connect to the bootloader without a new enumeration.
+* Requires ENABLE_APP_REENTRY in the bootloader and support in the application.
+*     Returns: device handle for success, NULL for fail
+********************************************************************************/
+micronucleus* micronucleus_reentry(int vendor_id, int product_id, int fast_mode);
+/*******************************************************************************/
+
 /********************************************************************************
 * Erase the flash memory
 ********************************************************************************/
@@ -102,10 +206,99 @@ int micronucleus_writeFlash(micronucleus* deviceHandle, unsigned int program_len
                             unsigned char* program, micronucleus_callback progress);
 /*******************************************************************************/
 
+/********************************************************************************
+* Non-blocking upload, to drive many devices from one event loop without threads.
+* micronucleus_uploadBegin() starts a session, optionally with the erase.
+* micronucleus_uploadStep() sends the next request if the device is ready and
+* returns at once, it never sleeps for write_sleep or erase_sleep. The time until
+* the next step is due is returned by micronucleus_uploadTimeout(), which is
+* -1 after the session ended. It can be used as timeout of poll() or epoll_wait().
+* libusb-0.1 has no file descriptors to wait on, so one step still blocks for
+* the control transfers of one page, which take a few milliseconds.
+*     Returns: MICRONUCLEUS_UPLOAD_DONE, MICRONUCLEUS_UPLOAD_BUSY,
+*              MICRONUCLEUS_UPLOAD_RECONNECT or a negative error
+********************************************************************************/
+int micronucleus_uploadBegin(micronucleus_upload* upload, micronucleus* deviceHandle, unsigned int program_length,
+                             unsigned char* program, int erase);
+int micronucleus_uploadStep(micronucleus_upload* upload);
+int micronucleus_uploadTimeout(const micronucleus_upload* upload);
+float micronucleus_uploadProgress(const micronucleus_upload* upload);
+/*******************************************************************************/
+
+/********************************************************************************
+* Keeps the bootloader from timing out while the host is busy otherwise.
+* Older firmware treats the request as nop, but resets its idle counter too.
+********************************************************************************/
+int micronucleus_keepAlive(micronucleus* deviceHandle);
+/*******************************************************************************/
+
+/********************************************************************************
+* Set the serial number, which is written with the next micronucleus_writeFlash()
+*     Returns: 0 for success, -1 if not supported by the device or too long
+********************************************************************************/
+int micronucleus_setSerial(micronucleus* deviceHandle, const char* serial);
+/*******************************************************************************/
+
+/********************************************************************************
+* Read the health counters of a bootloader built with ENABLE_HEALTH_COUNTERS.
+* Other firmware ignores wValue and sends the 6 byte device info, which is
+* detected by its length.
+*     Returns: 0 for success, 1 if not supported by the device, negative for USB errors
+********************************************************************************/
+int micronucleus_getHealth(micronucleus* deviceHandle, micronucleus_health* health);
+/*******************************************************************************/
+
+/********************************************************************************
+* Read the EEPROM size of a bootloader built with ENABLE_EEPROM_WRITE.
+* Other firmware sends the 6 byte device info, like for micronucleus_getHealth().
+*     Returns: 0 for success, 1 if not supported by the device, negative for USB errors
+********************************************************************************/
+int micronucleus_getEeprom(micronucleus* deviceHandle, micronucleus_eeprom* eeprom);
+/*******************************************************************************/
+
+/********************************************************************************
+* Write length bytes of data to the EEPROM at address, 2 bytes per request.
+* eeprom is the result of micronucleus_getEeprom(). The bootloader skips bytes
+* which are already equal, so writing the same data again is fast.
+*     Returns: 0 for success, -EINVAL if the data does not fit into the EEPROM,
+*              other negative values for USB errors
+********************************************************************************/
+int micronucleus_writeEeprom(micronucleus* deviceHandle, const micronucleus_eeprom* eeprom, unsigned int address,
+                             unsigned int length, const unsigned char* data, micronucleus_callback progress);
+/*******************************************************************************/
+
+/********************************************************************************
+* Log every control transfer of the library to a pcapng file with the Linux
+* usbmon link type, which Wireshark can read. A NULL filename stops logging.
+* Descriptor requests of libusb are not logged.
+*     Returns: 0 for success, -1 if the file could not be created
+********************************************************************************/
+int micronucleus_capture(const char *filename);
+/*******************************************************************************/
+
+/********************************************************************************
+* Send one control transfer like usb_control_msg(), for replaying a capture.
+* It is logged like the other transfers of the library.
+*     Returns: bytes transferred or negative error
+********************************************************************************/
+int micronucleus_controlTransfer(micronucleus* deviceHandle, int requesttype, int request, int value, int index,
+                                 char *bytes, int size);
+/*******************************************************************************/
+
 /********************************************************************************
 * Starts the user application
 ********************************************************************************/
 int micronucleus_startApp(micronucleus* deviceHandle);
 /*******************************************************************************/
 
+/********************************************************************************
+* Release the device for other processes and free the handle.
+* A device is claimed by the connect functions with an exclusive interface claim
+* and an advisory lock file "micronucleus-<port path>.lock" in $TMPDIR or /tmp.
+* Devices claimed by another process are skipped while connecting.
+* The lock is kept if the same device is connected again after a reset.
+********************************************************************************/
+void micronucleus_close(micronucleus* deviceHandle);
+/*******************************************************************************/
+
 #endif
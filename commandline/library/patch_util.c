@@ -0,0 +1,439 @@
+#include <patch_util.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#if defined _WIN32 || defined _WIN64
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+#endif
+
+#define PATCH_MAX_LINE 1024
+#define PATCH_ELF_MAX_SIZE 0x4000000  // larger files are taken as no ELF file of a microcontroller program
+#define PATCH_SHT_SYMTAB 2
+#define PATCH_PT_LOAD 1
+
+#if defined _WIN32 || defined _WIN64
+typedef HANDLE patch_lock_t;
+#define PATCH_NO_LOCK INVALID_HANDLE_VALUE
+#else
+typedef int patch_lock_t;
+#define PATCH_NO_LOCK -1
+#endif
+
+static unsigned int patch_get16(const unsigned char *p) {
+  return p[0] | (p[1] << 8);
+}
+
+static unsigned int patch_get32(const unsigned char *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
+/* Convert hex digits to bytes. Returns the number of bytes or -1 */
+static int patch_parseHex(const char *text, unsigned char *value, unsigned int size) {
+  unsigned int length = 0;
+
+  while (*text) {
+    unsigned int byte;
+    if (!isxdigit((unsigned char) text[0]) || !isxdigit((unsigned char) text[1]) || length >= size) return -1;
+    if (sscanf(text, "%2x", &byte) != 1) return -1;
+    value[length++] = byte;
+    text += 2;
+  }
+  return length;
+}
+
+/* Split an optional ":N" byte count from the end of the argument */
+static int patch_parseWidth(patch_spec *patch, unsigned int default_width) {
+  char *colon = strrchr(patch->argument, ':');
+  char *end;
+  unsigned long width;
+
+  patch->width = default_width;
+  if (colon == NULL) return 0;
+  width = strtoul(colon + 1, &end, 10);
+  if (colon[1] == 0 || *end != 0) return 0; // part of a file name like C:\counter.txt
+  if (width < 1 || width > 8) return -1;
+  patch->width = width;
+  *colon = 0;
+  return 0;
+}
+
+int patch_parse(patch_spec *patch, const char *text) {
+  const char *equals = strchr(text, '=');
+  const char *template;
+  size_t location_length;
+  char *end;
+
+  memset(patch, 0, sizeof(*patch));
+  if (equals == NULL || equals == text) {
+    fprintf(stderr, "Patch %s is not LOCATION=TEMPLATE\n", text);
+    return -1;
+  }
+  location_length = equals - text;
+  if (location_length >= sizeof(patch->location)) {
+    fprintf(stderr, "Patch location of %s is too long\n", text);
+    return -1;
+  }
+  memcpy(patch->location, text, location_length);
+  patch->address = strtoul(patch->location, &end, 0);
+  patch->is_symbol = !isdigit((unsigned char) patch->location[0]) || *end != 0;
+  template = equals + 1;
+
+  if (strncmp(template, "hex:", 4) == 0) {
+    patch->type = PATCH_HEX;
+  } else if (strncmp(template, "text:", 5) == 0) {
+    patch->type = PATCH_TEXT;
+  } else if (strncmp(template, "counter:", 8) == 0) {
+    patch->type = PATCH_COUNTER;
+  } else if (strncmp(template, "line:", 5) == 0) {
+    patch->type = PATCH_LINE;
+  } else if (strncmp(template, "hexline:", 8) == 0) {
+    patch->type = PATCH_HEXLINE;
+  } else if (strncmp(template, "time", 4) == 0 && (template[4] == 0 || template[4] == ':')) {
+    patch->type = PATCH_TIME;
+  } else {
+    fprintf(stderr, "Unknown patch template %s, use hex:, text:, counter:, line:, hexline: or time\n", template);
+    return -1;
+  }
+  template = strchr(template, ':') ? strchr(template, ':') + 1 : "";
+  if (strlen(template) >= sizeof(patch->argument)) {
+    fprintf(stderr, "Patch template of %s is too long\n", patch->location);
+    return -1;
+  }
+  strcpy(patch->argument, template);
+
+  if (patch->type == PATCH_HEX) {
+    int length = patch_parseHex(patch->argument, patch->value, sizeof(patch->value));
+    if (length <= 0) {
+      fprintf(stderr, "Patch %s needs an even number of hex digits\n", patch->location);
+      return -1;
+    }
+    patch->length = length;
+  } else if (patch->type == PATCH_TEXT) {
+    if (strlen(patch->argument) + 1 > sizeof(patch->value)) {
+      fprintf(stderr, "Patch text of %s is too long\n", patch->location);
+      return -1;
+    }
+    patch->length = strlen(patch->argument) + 1;
+    memcpy(patch->value, patch->argument, patch->length);
+  } else if (patch->type == PATCH_TIME) {
+    patch->width = patch->argument[0] ? strtoul(patch->argument, &end, 10) : 4;
+    if (patch->width < 1 || patch->width > 8 || (patch->argument[0] && *end != 0)) {
+      fprintf(stderr, "Patch %s can only have 1 to 8 bytes\n", patch->location);
+      return -1;
+    }
+  } else if (patch->type == PATCH_COUNTER && patch_parseWidth(patch, 2) != 0) {
+    fprintf(stderr, "Patch %s can only have 1 to 8 bytes\n", patch->location);
+    return -1;
+  }
+  if (patch->type != PATCH_TIME && patch->argument[0] == 0) {
+    fprintf(stderr, "Patch %s needs a value or file name\n", patch->location);
+    return -1;
+  }
+  return 0;
+}
+
+int patch_resolve(patch_spec *patch, const char *elf_file) {
+  unsigned char *elf;
+  long file_size;
+  unsigned int shoff, shentsize, shnum, phoff, phentsize, phnum, i;
+  int found = 0, res = -1;
+  FILE *file;
+
+  if (!patch->is_symbol) return 0;
+  if (elf_file == NULL) {
+    fprintf(stderr, "Patch %s needs the ELF file of the program for its symbol\n", patch->location);
+    return -1;
+  }
+  file = fopen(elf_file, "rb");
+  if (file == NULL) {
+    perror(elf_file);
+    return -1;
+  }
+  fseek(file, 0, SEEK_END);
+  file_size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  elf = file_size > 52 && file_size < PATCH_ELF_MAX_SIZE ? malloc(file_size) : NULL;
+  if (elf == NULL || fread(elf, 1, file_size, file) != (size_t) file_size
+      || memcmp(elf, "\177ELF", 4) != 0 || elf[4] != 1 || elf[5] != 1) {
+    fprintf(stderr, "%s is no 32 bit little endian ELF file\n", elf_file);
+    goto end;
+  }
+
+  phoff = patch_get32(elf + 0x1C);
+  shoff = patch_get32(elf + 0x20);
+  phentsize = patch_get16(elf + 0x2A);
+  phnum = patch_get16(elf + 0x2C);
+  shentsize = patch_get16(elf + 0x2E);
+  shnum = patch_get16(elf + 0x30);
+  if (shentsize < 40 || phentsize < 32 || shoff + (unsigned long) shnum * shentsize > (unsigned long) file_size
+      || phoff + (unsigned long) phnum * phentsize > (unsigned long) file_size) {
+    fprintf(stderr, "%s has corrupt section or program headers\n", elf_file);
+    goto end;
+  }
+
+  // the symbol table links to its string table
+  for (i = 0; i < shnum && !found; i++) {
+    const unsigned char *section = elf + shoff + i * shentsize;
+    unsigned int offset, size, link, strings, strings_size, symbol;
+
+    if (patch_get32(section + 4) != PATCH_SHT_SYMTAB) continue;
+    offset = patch_get32(section + 16);
+    size = patch_get32(section + 20);
+    link = patch_get32(section + 24);
+    if (link >= shnum || offset + (unsigned long) size > (unsigned long) file_size) continue;
+    strings = patch_get32(elf + shoff + link * shentsize + 16);
+    strings_size = patch_get32(elf + shoff + link * shentsize + 20);
+    if (strings + (unsigned long) strings_size > (unsigned long) file_size) continue;
+
+    for (symbol = offset; symbol + 16 <= offset + size; symbol += 16) {
+      unsigned int name = patch_get32(elf + symbol);
+      if (name >= strings_size || patch_get16(elf + symbol + 14) == 0) continue; // undefined
+      if (strncmp((const char *) elf + strings + name, patch->location, strings_size - name) == 0) {
+        patch->address = patch_get32(elf + symbol + 4);
+        patch->size = patch_get32(elf + symbol + 8);
+        found = 1;
+        break;
+      }
+    }
+  }
+  if (!found) {
+    fprintf(stderr, "Symbol %s not found in %s\n", patch->location, elf_file);
+    goto end;
+  }
+
+  // map the virtual address to its load address in flash, which differs for initialized RAM variables
+  for (i = 0; i < phnum; i++) {
+    const unsigned char *segment = elf + phoff + i * phentsize;
+    unsigned int vaddr = patch_get32(segment + 8);
+    unsigned int paddr = patch_get32(segment + 12);
+    unsigned int filesz = patch_get32(segment + 16);
+
+    if (patch_get32(segment) == PATCH_PT_LOAD && patch->address >= vaddr && patch->address - vaddr < filesz) {
+      patch->address = patch->address - vaddr + paddr;
+      res = 0;
+      break;
+    }
+  }
+  if (res != 0) {
+    fprintf(stderr, "Symbol %s has no initial value in flash\n", patch->location);
+  }
+
+end:
+  free(elf);
+  fclose(file);
+  return res;
+}
+
+/* Read a whole line without the line end into line, up to size - 1 characters.
+   Returns the length, -1 at the end of the file or -2 if the line is too long */
+static int patch_readLine(FILE *file, char *line, unsigned int size) {
+  unsigned int length = 0;
+  int c, too_long = 0;
+
+  while ((c = getc(file)) != EOF && c != '\n') {
+    if (length + 1 < size) {
+      line[length++] = c;
+    } else {
+      too_long = 1;
+    }
+  }
+  if (c == EOF && length == 0 && !too_long) return -1;
+  if (length > 0 && line[length - 1] == '\r') length--;
+  line[length] = 0;
+  return too_long ? -2 : (int) length;
+}
+
+static void patch_setNumber(patch_spec *patch, unsigned long long number) {
+  unsigned int i;
+
+  for (i = 0; i < patch->width; i++) patch->value[i] = number >> (8 * i);
+  patch->length = patch->width;
+}
+
+/* Read the counter or the first unused line of the file into value. Returns 0 for success, -1 for errors */
+static int patch_readFile(patch_spec *patch) {
+  char line[PATCH_MAX_LINE];
+  FILE *file;
+  int length;
+
+  if (patch->type == PATCH_COUNTER) {
+    file = fopen(patch->argument, "r");
+    if (file == NULL) {
+      perror(patch->argument);
+      return -1;
+    }
+    if (fscanf(file, "%llu", &patch->counter) != 1) {
+      fprintf(stderr, "%s does not start with a decimal number\n", patch->argument);
+      fclose(file);
+      return -1;
+    }
+    fclose(file);
+    if (patch->width < 8 && patch->counter >> (8 * patch->width)) {
+      fprintf(stderr, "Counter %llu of %s does not fit into %u bytes\n", patch->counter, patch->argument, patch->width);
+      return -1;
+    }
+    patch_setNumber(patch, patch->counter);
+    return 0;
+  }
+
+  file = fopen(patch->argument, "r");
+  if (file == NULL) {
+    perror(patch->argument);
+    return -1;
+  }
+  patch->line_number = 0;
+  while ((length = patch_readLine(file, line, sizeof(line))) != -1) {
+    if (length != 0 && line[0] != '#') break;
+    patch->line_number++;
+  }
+  fclose(file);
+  if (length == -1) {
+    fprintf(stderr, "All lines of %s are used\n", patch->argument);
+    return -1;
+  }
+  if (patch->type == PATCH_LINE) {
+    if (length < 0 || (unsigned int) length + 1 > sizeof(patch->value)) {
+      fprintf(stderr, "Line %ld of %s is too long\n", patch->line_number + 1, patch->argument);
+      return -1;
+    }
+    patch->length = length + 1;
+    memcpy(patch->value, line, patch->length);
+  } else {
+    length = length < 0 ? -1 : patch_parseHex(line, patch->value, sizeof(patch->value));
+    if (length <= 0) {
+      fprintf(stderr, "Line %ld of %s is no sequence of hex bytes\n", patch->line_number + 1, patch->argument);
+      return -1;
+    }
+    patch->length = length;
+  }
+  return 0;
+}
+
+static int patch_checkSize(const patch_spec *patch) {
+  if (patch->size && patch->length > patch->size) {
+    fprintf(stderr, "Patch of %u bytes does not fit into the %u bytes of %s\n", patch->length, patch->size, patch->location);
+    return -1;
+  }
+  return 0;
+}
+
+/* Lock FILE.lock, which waits while another process renders a patch from FILE */
+static patch_lock_t patch_lock(const char *filename) {
+  char path[PATCH_MAX_PATH + 8];
+
+  snprintf(path, sizeof(path), "%s.lock", filename);
+#if defined _WIN32 || defined _WIN64
+  OVERLAPPED overlapped;
+  HANDLE lock = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                            OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (lock != INVALID_HANDLE_VALUE) {
+    memset(&overlapped, 0, sizeof(overlapped));
+    if (!LockFileEx(lock, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &overlapped)) {
+      CloseHandle(lock);
+      lock = INVALID_HANDLE_VALUE;
+    }
+  }
+#else
+  int lock = open(path, O_RDWR | O_CREAT, 0666);
+  if (lock >= 0 && flock(lock, LOCK_EX) != 0) {
+    close(lock);
+    lock = -1;
+  }
+#endif
+  if (lock == PATCH_NO_LOCK) {
+    fprintf(stderr, "Could not lock %s\n", path);
+  }
+  return lock;
+}
+
+static void patch_unlock(patch_lock_t lock) {
+#if defined _WIN32 || defined _WIN64
+  CloseHandle(lock); // releases the lock
+#else
+  close(lock); // releases the flock
+#endif
+}
+
+static int patch_advance(const patch_spec *patch);
+
+int patch_render(patch_spec *patch) {
+  patch_lock_t lock;
+  int res;
+
+  if (patch->type == PATCH_TIME) {
+    patch_setNumber(patch, (unsigned long long) time(NULL));
+  }
+  if (patch->type != PATCH_COUNTER && patch->type != PATCH_LINE && patch->type != PATCH_HEXLINE) {
+    return patch_checkSize(patch);
+  }
+
+  // the value is reserved under the lock, so parallel uploads never get the same one
+  lock = patch_lock(patch->argument);
+  if (lock == PATCH_NO_LOCK) return -1;
+  res = patch_readFile(patch);
+  if (res == 0) res = patch_checkSize(patch);
+  if (res == 0) res = patch_advance(patch);
+  patch_unlock(lock);
+  return res;
+}
+
+/* Write the temporary file over the original, which rename() does not do on Windows */
+static int patch_replace(const char *temporary, const char *filename) {
+  #if defined _WIN32 || defined _WIN64
+    remove(filename);
+  #endif
+  if (rename(temporary, filename) != 0) {
+    perror(filename);
+    return -1;
+  }
+  return 0;
+}
+
+/* Increment the counter or comment out the used line. Returns 0 for success, -1 for errors */
+static int patch_advance(const patch_spec *patch) {
+  char temporary[PATCH_MAX_PATH + 8];
+  FILE *input, *output;
+  long line_number = 0;
+  int c, line_start = 1, res = 0;
+
+  snprintf(temporary, sizeof(temporary), "%s.tmp", patch->argument);
+  output = fopen(temporary, "w");
+  if (output == NULL) {
+    perror(temporary);
+    return -1;
+  }
+  if (patch->type == PATCH_COUNTER) {
+    fprintf(output, "%llu\n", patch->counter + 1);
+  } else {
+    // copy the file and comment out the used line
+    input = fopen(patch->argument, "r");
+    if (input == NULL) {
+      perror(patch->argument);
+      fclose(output);
+      remove(temporary);
+      return -1;
+    }
+    while ((c = getc(input)) != EOF) {
+      if (line_start && line_number == patch->line_number) putc('#', output);
+      putc(c, output);
+      line_start = c == '\n';
+      if (line_start) line_number++;
+    }
+    fclose(input);
+  }
+  if (ferror(output)) res = -1;
+  if (fclose(output) != 0) res = -1;
+  if (res != 0) {
+    perror(temporary);
+    remove(temporary);
+    return -1;
+  }
+  return patch_replace(temporary, patch->argument);
+}
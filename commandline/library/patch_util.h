@@ -0,0 +1,64 @@
+#ifndef PATCH_UTIL_H
+#define PATCH_UTIL_H
+
+/*
+  Per unit data for --patch of micronucleus, written into the program before
+  the upload, so every board gets its own serial number, key or calibration
+  constant from the same build.
+  A patch is LOCATION=TEMPLATE. LOCATION is a flash address like 0x1F00 or the
+  name of a symbol in the ELF file of the program. Symbols of initialized RAM
+  variables are mapped to their initial value in flash with the program headers.
+  TEMPLATE is one of
+    hex:0A0B0C         these bytes
+    text:STRING        the characters and a terminating 0
+    counter:FILE[:N]   the decimal number in FILE as N byte little endian value,
+                       default 2. FILE is incremented when the value is read
+    line:FILE          the first line of FILE, which does not start with '#', as
+                       text with a terminating 0. The line is commented out with
+                       '#' when it is read, so it is used only once
+    hexline:FILE       like line, with the line as hex bytes
+    time[:N]           seconds since 1970 as N byte little endian value, default 4
+  Counters and lines are read and advanced while FILE.lock is locked, so parallel
+  uploads never get the same value. A value is used up even if the upload fails
+  later, so a number is skipped or a line is left unused then.
+  Errors are printed to stderr.
+*/
+
+#define PATCH_MAX_LOCATION 128
+#define PATCH_MAX_PATH 512
+#define PATCH_MAX_VALUE 256
+
+#define PATCH_HEX 1
+#define PATCH_TEXT 2
+#define PATCH_COUNTER 3
+#define PATCH_LINE 4
+#define PATCH_HEXLINE 5
+#define PATCH_TIME 6
+
+typedef struct _patch_spec {
+  char location[PATCH_MAX_LOCATION]; // symbol name or address as given
+  int is_symbol;
+  unsigned int address;     // flash address, of symbols after patch_resolve()
+  unsigned int size;        // size of the symbol, 0 for addresses
+  int type;                 // PATCH_HEX ... PATCH_TIME
+  char argument[PATCH_MAX_PATH]; // hex digits, text or file name
+  unsigned int width;       // bytes of counter and time
+  unsigned char value[PATCH_MAX_VALUE]; // bytes to write, after patch_render()
+  unsigned int length;
+  unsigned long long counter; // value read from the counter file
+  long line_number;         // line of FILE which was used, counting from 0
+} patch_spec;
+
+/* Parse LOCATION=TEMPLATE. Returns 0 for success, -1 for errors */
+int patch_parse(patch_spec *patch, const char *text);
+
+/* Look up the address and size of a symbol in a 32 bit ELF file, addresses are kept.
+   Returns 0 for success, -1 for errors */
+int patch_resolve(patch_spec *patch, const char *elf_file);
+
+/* Read the counter, line or time into value and advance the counter or line file.
+   Returns 0 for success, -1 for errors */
+int patch_render(patch_spec *patch);
+
+// end PATCH_UTIL_H section:
+#endif
@@ -0,0 +1,323 @@
+#include <usbcapture_util.h>
+#include <littleWire_util.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if !(defined _WIN32 || defined _WIN64)
+#include <sys/time.h>
+#endif
+
+#define USBCAPTURE_SECTION_HEADER 0x0A0D0D0A
+#define USBCAPTURE_INTERFACE_DESCRIPTION 1
+#define USBCAPTURE_ENHANCED_PACKET 6
+#define USBCAPTURE_BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define USBCAPTURE_MAX_BLOCK 0x1000000 // larger blocks are taken as a corrupt file
+#define USBCAPTURE_HEADER 48           // usbmon header of USBCAPTURE_LINKTYPE_USB_LINUX
+#define USBCAPTURE_HEADER_MMAPPED 64
+#define USBCAPTURE_CONTROL 2           // usbmon transfer type
+#define USBCAPTURE_EINPROGRESS 115     // status of a submission is -EINPROGRESS of Linux
+
+static FILE *usbcapture_file = NULL;
+static unsigned long long usbcapture_offset = 0; // usbcapture_now() - micros()
+static unsigned long long usbcapture_id = 0;     // URB id of the last transfer
+static int usbcapture_atexit = 0;
+
+/* Write a block with its length before and after the body, which is padded to 32 bits */
+static void usbcapture_writeBlock(unsigned int type, const void *body, unsigned int length) {
+  static const unsigned char padding[3] = { 0, 0, 0 };
+  unsigned int total = 12 + ((length + 3) & ~3);
+
+  fwrite(&type, 4, 1, usbcapture_file);
+  fwrite(&total, 4, 1, usbcapture_file);
+  fwrite(body, length, 1, usbcapture_file);
+  fwrite(padding, total - 12 - length, 1, usbcapture_file);
+  fwrite(&total, 4, 1, usbcapture_file);
+}
+
+int usbcapture_open(const char *filename) {
+  unsigned char section[16], interface[8];
+  unsigned int magic = USBCAPTURE_BYTE_ORDER_MAGIC;
+  unsigned short version[2] = { 1, 0 };
+  long long section_length = -1; // not known before the end
+  unsigned short linktype[2] = { USBCAPTURE_LINKTYPE_USB_LINUX, 0 };
+  unsigned int snaplen = 0; // no limit
+
+  usbcapture_close();
+  usbcapture_file = fopen(filename, "wb");
+  if (usbcapture_file == NULL) return -1;
+  if (!usbcapture_atexit) {
+    atexit(usbcapture_close);
+    usbcapture_atexit = 1;
+  }
+
+  // all fields in host byte order, the byte order magic tells the readers which one it is
+  memcpy(section, &magic, 4);
+  memcpy(section + 4, version, 4);
+  memcpy(section + 8, &section_length, 8);
+  usbcapture_writeBlock(USBCAPTURE_SECTION_HEADER, section, sizeof(section));
+
+  // microsecond timestamps are the default resolution, so no options are needed
+  memcpy(interface, linktype, 4);
+  memcpy(interface + 4, &snaplen, 4);
+  usbcapture_writeBlock(USBCAPTURE_INTERFACE_DESCRIPTION, interface, sizeof(interface));
+  fflush(usbcapture_file);
+  return 0;
+}
+
+void usbcapture_close(void) {
+  if (usbcapture_file) fclose(usbcapture_file);
+  usbcapture_file = NULL;
+}
+
+int usbcapture_isOpen(void) {
+  return usbcapture_file != NULL;
+}
+
+unsigned long long usbcapture_now(void) {
+  if (usbcapture_offset == 0) {
+    #if defined _WIN32 || defined _WIN64
+      unsigned long long wall = time(NULL) * 1000000ULL;
+    #else
+      struct timeval now;
+      gettimeofday(&now, NULL);
+      unsigned long long wall = now.tv_sec * 1000000ULL + now.tv_usec;
+    #endif
+    // the wall clock is read once, so durations are not changed by clock adjustments
+    usbcapture_offset = wall - micros();
+  }
+  return usbcapture_offset + micros();
+}
+
+/* Write one usbmon event of a transfer as enhanced packet block */
+static void usbcapture_writeEvent(const usbcapture_transfer *transfer, char type, unsigned long long time, int status,
+                                  unsigned int length, const unsigned char *data, unsigned int data_length, char data_flag) {
+  unsigned char packet[20 + USBCAPTURE_HEADER + USBCAPTURE_MAX_DATA];
+  unsigned char *header = packet + 20;
+  unsigned int interface_id = 0, packet_length = USBCAPTURE_HEADER + data_length;
+  unsigned int time_high = time >> 32, time_low = time;
+  long long seconds = time / 1000000;
+  int microseconds = time % 1000000;
+  unsigned short bus = transfer->bus;
+
+  memcpy(packet, &interface_id, 4);
+  memcpy(packet + 4, &time_high, 4);
+  memcpy(packet + 8, &time_low, 4);
+  memcpy(packet + 12, &packet_length, 4);
+  memcpy(packet + 16, &packet_length, 4);
+
+  memset(header, 0, USBCAPTURE_HEADER);
+  memcpy(header, &usbcapture_id, 8);
+  header[8] = type;
+  header[9] = USBCAPTURE_CONTROL;
+  header[10] = transfer->setup[0] & 0x80; // endpoint 0 with the direction of the transfer
+  header[11] = transfer->address;
+  memcpy(header + 12, &bus, 2);
+  header[14] = (type == 'S') ? 0 : '-';   // 0 if the setup field is valid
+  header[15] = data_flag;                 // 0 if data is present
+  memcpy(header + 16, &seconds, 8);
+  memcpy(header + 24, &microseconds, 4);
+  memcpy(header + 28, &status, 4);
+  memcpy(header + 32, &length, 4);
+  memcpy(header + 36, &data_length, 4);
+  if (type == 'S') memcpy(header + 40, transfer->setup, 8);
+  memcpy(header + USBCAPTURE_HEADER, data, data_length);
+
+  usbcapture_writeBlock(USBCAPTURE_ENHANCED_PACKET, packet, 20 + packet_length);
+}
+
+void usbcapture_write(const usbcapture_transfer *transfer) {
+  int in = transfer->setup[0] & 0x80;
+  unsigned int length = transfer->setup[6] | (transfer->setup[7] << 8);
+  unsigned int data_length = transfer->data_length;
+
+  if (usbcapture_file == NULL) return;
+  if (data_length > USBCAPTURE_MAX_DATA) data_length = USBCAPTURE_MAX_DATA;
+
+  usbcapture_id++;
+  if (in) {
+    usbcapture_writeEvent(transfer, 'S', transfer->start, -USBCAPTURE_EINPROGRESS, length, NULL, 0, '<');
+    if (transfer->result < 0) data_length = 0;
+    usbcapture_writeEvent(transfer, 'C', transfer->end, transfer->result < 0 ? transfer->result : 0,
+                          transfer->result < 0 ? 0 : transfer->result, transfer->data, data_length, 0);
+  } else {
+    usbcapture_writeEvent(transfer, 'S', transfer->start, -USBCAPTURE_EINPROGRESS, length, transfer->data, data_length, 0);
+    usbcapture_writeEvent(transfer, 'C', transfer->end, transfer->result < 0 ? transfer->result : 0,
+                          transfer->result < 0 ? 0 : transfer->result, NULL, 0, '>');
+  }
+  fflush(usbcapture_file);
+}
+
+/* Fields of the file in the byte order of its section */
+static unsigned int usbcapture_get16(const usbcapture_reader *reader, const unsigned char *p) {
+  return reader->swap ? (p[0] << 8) | p[1] : p[0] | (p[1] << 8);
+}
+
+static unsigned int usbcapture_get32(const usbcapture_reader *reader, const unsigned char *p) {
+  unsigned int value;
+
+  memcpy(&value, p, 4);
+  if (reader->swap) {
+    value = (value >> 24) | ((value >> 8) & 0xFF00) | ((value << 8) & 0xFF0000) | (value << 24);
+  }
+  return value;
+}
+
+static unsigned long long usbcapture_get64(const usbcapture_reader *reader, const unsigned char *p) {
+  unsigned long long first = usbcapture_get32(reader, p), second = usbcapture_get32(reader, p + 4);
+  unsigned int one = 1;
+  int little_endian = *(unsigned char *) &one;
+
+  // the halves are in the order of the section, which is the host order unless swapped
+  return (little_endian != reader->swap) ? (second << 32) | first : (first << 32) | second;
+}
+
+/* Read the next block into reader->block. Returns 1 for a block, 0 at the end of the file, -1 for errors */
+static int usbcapture_readBlock(usbcapture_reader *reader, unsigned int *type) {
+  unsigned char head[8];
+  unsigned int length;
+
+  if (fread(head, 8, 1, reader->file) != 1) return 0;
+  memcpy(type, head, 4);
+  if (*type == USBCAPTURE_SECTION_HEADER) {
+    // the byte order of a section is given by its magic, which follows the length
+    unsigned int magic;
+    if (fread(&magic, 4, 1, reader->file) != 1) return -1;
+    if (magic == USBCAPTURE_BYTE_ORDER_MAGIC) reader->swap = 0;
+    else if (magic == 0x4D3C2B1A) reader->swap = 1;
+    else return -1;
+    fseek(reader->file, -4, SEEK_CUR);
+    reader->interfaces = 0;
+  } else {
+    *type = usbcapture_get32(reader, head);
+  }
+  length = usbcapture_get32(reader, head + 4);
+  if (length < 12 || length % 4 != 0 || length > USBCAPTURE_MAX_BLOCK) return -1;
+
+  if (length - 8 > reader->block_size) {
+    unsigned char *block = realloc(reader->block, length - 8);
+    if (block == NULL) return -1;
+    reader->block = block;
+    reader->block_size = length - 8;
+  }
+  // the body is followed by the length again
+  if (fread(reader->block, length - 8, 1, reader->file) != 1) return -1;
+  reader->block_length = length - 8;
+  return 1;
+}
+
+int usbcapture_openReader(usbcapture_reader *reader, const char *filename) {
+  unsigned int type;
+  memset(reader, 0, sizeof(*reader));
+
+  reader->file = fopen(filename, "rb");
+  if (reader->file == NULL) return -1;
+  if (fread(&type, 4, 1, reader->file) != 1 || type != USBCAPTURE_SECTION_HEADER) {
+    usbcapture_closeReader(reader);
+    return -1;
+  }
+  rewind(reader->file);
+  return 0;
+}
+
+void usbcapture_closeReader(usbcapture_reader *reader) {
+  if (reader->file) fclose(reader->file);
+  free(reader->block);
+  reader->file = NULL;
+  reader->block = NULL;
+  reader->block_length = 0;
+  reader->block_size = 0;
+}
+
+/* Store a submission. Returns nothing, a full table drops the oldest pending transfer */
+static void usbcapture_submit(usbcapture_reader *reader, unsigned long long id, const usbcapture_transfer *transfer) {
+  int i, slot = 0;
+
+  for (i = 0; i < USBCAPTURE_MAX_PENDING; i++) {
+    if (!reader->pending[i].used) {
+      slot = i;
+      break;
+    }
+    if (reader->pending[i].transfer.start < reader->pending[slot].transfer.start) slot = i;
+  }
+  reader->pending[slot].used = 1;
+  reader->pending[slot].id = id;
+  reader->pending[slot].transfer = *transfer;
+}
+
+/* Parse a usbmon event. Returns 1 if it completed a control transfer, which is stored in transfer */
+static int usbcapture_parseEvent(usbcapture_reader *reader, const unsigned char *header, unsigned int header_length,
+                                 unsigned int captured, usbcapture_transfer *transfer) {
+  unsigned long long id = usbcapture_get64(reader, header);
+  unsigned long long time = usbcapture_get64(reader, header + 16) * 1000000ULL + usbcapture_get32(reader, header + 24);
+  int status = (int) usbcapture_get32(reader, header + 28);
+  unsigned int length = usbcapture_get32(reader, header + 32);
+  unsigned int data_length = usbcapture_get32(reader, header + 36);
+  const unsigned char *data = header + header_length;
+  int i;
+
+  if (header[9] != USBCAPTURE_CONTROL) return 0;
+  if (data_length > captured - header_length) data_length = captured - header_length;
+  if (data_length > USBCAPTURE_MAX_DATA) data_length = USBCAPTURE_MAX_DATA;
+
+  if (header[8] == 'S') {
+    if (header[14] != 0) return 0; // no SETUP packet
+    memset(transfer, 0, sizeof(*transfer));
+    memcpy(transfer->setup, header + 40, 8);
+    transfer->start = time;
+    transfer->bus = usbcapture_get16(reader, header + 12);
+    transfer->address = header[11];
+    if (!(transfer->setup[0] & 0x80)) {
+      transfer->data_length = data_length;
+      memcpy(transfer->data, data, data_length);
+    }
+    usbcapture_submit(reader, id, transfer);
+    return 0;
+  }
+
+  // completion 'C' or submission error 'E'
+  for (i = 0; i < USBCAPTURE_MAX_PENDING; i++) {
+    if (reader->pending[i].used && reader->pending[i].id == id) break;
+  }
+  if (i == USBCAPTURE_MAX_PENDING) return 0;
+
+  *transfer = reader->pending[i].transfer;
+  reader->pending[i].used = 0;
+  transfer->end = time;
+  transfer->result = status < 0 ? status : (int) length;
+  if ((transfer->setup[0] & 0x80) && status >= 0) {
+    transfer->data_length = data_length;
+    memcpy(transfer->data, data, data_length);
+  }
+  return 1;
+}
+
+int usbcapture_read(usbcapture_reader *reader, usbcapture_transfer *transfer) {
+  unsigned int type;
+  int res;
+
+  while ((res = usbcapture_readBlock(reader, &type)) == 1) {
+    if (type == USBCAPTURE_INTERFACE_DESCRIPTION) {
+      if (reader->interfaces < USBCAPTURE_MAX_INTERFACES) {
+        reader->linktypes[reader->interfaces] = usbcapture_get16(reader, reader->block);
+      }
+      reader->interfaces++;
+    } else if (type == USBCAPTURE_ENHANCED_PACKET && reader->block_length >= 24) {
+      unsigned int interface_id = usbcapture_get32(reader, reader->block);
+      unsigned int captured = usbcapture_get32(reader, reader->block + 12);
+      unsigned int header_length;
+
+      if (interface_id >= (unsigned int) reader->interfaces || interface_id >= USBCAPTURE_MAX_INTERFACES) continue;
+      if (reader->linktypes[interface_id] == USBCAPTURE_LINKTYPE_USB_LINUX) {
+        header_length = USBCAPTURE_HEADER;
+      } else if (reader->linktypes[interface_id] == USBCAPTURE_LINKTYPE_USB_LINUX_MMAPPED) {
+        header_length = USBCAPTURE_HEADER_MMAPPED;
+      } else {
+        continue;
+      }
+      if (captured < header_length || captured > reader->block_length - 24) continue;
+      if (usbcapture_parseEvent(reader, reader->block + 20, header_length, captured, transfer)) return 1;
+    }
+  }
+  return res;
+}
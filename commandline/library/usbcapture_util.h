@@ -0,0 +1,74 @@
+#ifndef USBCAPTURE_UTIL_H
+#define USBCAPTURE_UTIL_H
+
+/*
+  Control transfers in pcapng files with the Linux usbmon link type, which
+  Wireshark decodes like a capture of the usbmon kernel module.
+  Each transfer is written as submission and completion event, so the time
+  between them is the duration of the transfer seen by the host.
+  The reader accepts files of micronucleus and of Wireshark on Linux with
+  the link types LINKTYPE_USB_LINUX and LINKTYPE_USB_LINUX_MMAPPED. Only
+  control transfers are returned, other transfer types are skipped.
+*/
+
+#include <stdio.h>
+
+#define USBCAPTURE_LINKTYPE_USB_LINUX 189          // 48 byte usbmon header, written by micronucleus
+#define USBCAPTURE_LINKTYPE_USB_LINUX_MMAPPED 220  // 64 byte usbmon header
+#define USBCAPTURE_MAX_DATA 1024    // longer data stages are truncated
+#define USBCAPTURE_MAX_INTERFACES 8 // interfaces of a section, later ones are ignored
+#define USBCAPTURE_MAX_PENDING 8    // submitted transfers, which wait for their completion while reading
+
+typedef struct _usbcapture_transfer {
+  unsigned char setup[8];   // SETUP packet as on the bus, wValue, wIndex and wLength are little endian
+  int result;               // bytes transferred or negative error, like usb_control_msg()
+  unsigned int data_length; // bytes in data, sent for OUT and received for IN transfers
+  unsigned char data[USBCAPTURE_MAX_DATA];
+  unsigned long long start; // microseconds since 1970, see usbcapture_now()
+  unsigned long long end;
+  unsigned int bus;
+  unsigned int address;
+} usbcapture_transfer;
+
+typedef struct _usbcapture_pending {
+  int used;
+  unsigned long long id; // URB id of the submission
+  usbcapture_transfer transfer;
+} usbcapture_pending;
+
+typedef struct _usbcapture_reader {
+  FILE *file;
+  int swap;                 // the section was written with the other byte order
+  int interfaces;
+  int linktypes[USBCAPTURE_MAX_INTERFACES];
+  unsigned char *block;     // body of the current block
+  unsigned int block_length; // of the body and the trailing length
+  unsigned int block_size;   // allocated
+  usbcapture_pending pending[USBCAPTURE_MAX_PENDING];
+} usbcapture_reader;
+
+/* Start writing transfers to a new file. Returns 0 for success, -1 if it could not be created */
+int usbcapture_open(const char *filename);
+
+/* Finish the file, which is done at exit too */
+void usbcapture_close(void);
+
+/* Returns 1 while a file is written */
+int usbcapture_isOpen(void);
+
+/* Microseconds since 1970 for the timestamps of a transfer, from the monotonic clock of micros() */
+unsigned long long usbcapture_now(void);
+
+/* Write a transfer, each block is flushed so the file is complete if the program crashes */
+void usbcapture_write(const usbcapture_transfer *transfer);
+
+/* Open a file for usbcapture_read(). Returns 0 for success, -1 if it is no pcapng file */
+int usbcapture_openReader(usbcapture_reader *reader, const char *filename);
+
+/* Read the next completed control transfer. Returns 1 for a transfer, 0 at the end of the file, -1 for errors */
+int usbcapture_read(usbcapture_reader *reader, usbcapture_transfer *transfer);
+
+void usbcapture_closeReader(usbcapture_reader *reader);
+
+// end USBCAPTURE_UTIL_H section:
+#endif
@@ -30,17 +30,33 @@ Created: September 2012
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
+#include <stdarg.h>
+#if defined(WIN)
+#include <io.h>
+#else
+#include <sys/select.h>
+#endif
 #include "micronucleus_lib.h"
 #include "littleWire_util.h"
+#include "jsonrpc_util.h"
+#include "usbcapture_util.h"
+#include "patch_util.h"
 
 #define FILE_TYPE_INTEL_HEX 1
 #define FILE_TYPE_RAW 2
 #define CONNECT_WAIT 250 /* milliseconds to wait after detecting device on usb bus - probably excessive */
+#define SERVER_KEEPALIVE_INTERVAL 1000 /* milliseconds between keep alive requests while the server is idle */
+#define SERVER_RECONNECT_ATTEMPTS 100 /* reconnect attempts every 100 ms after the connection was lost during erase */
+#define CATALOG_MAX_ROWS 256 /* rows of the firmware catalog of --auto-upgrade */
+#define CATALOG_MAX_PATH 512
+#define MAX_PATCHES 16 /* --patch options */
+#define REPLAY_REQUESTS 6 /* vendor requests 0 to 5 of the bootloader, which are reported separately by --replay */
 
 /******************************************************************************
 * Global definitions
 ******************************************************************************/
 unsigned char dataBuffer[65536 + 256];    /* buffer for file data */
+unsigned char eepromBuffer[65536 + 256];  /* buffer for the data of --eeprom */
 /*****************************************************************************/
 
 /******************************************************************************
@@ -50,6 +66,13 @@ static int parseRaw(char *hexfile, unsigned char *buffer, int *startAddr, int *e
 static int parseIntelHex(char *hexfile, unsigned char *buffer, int *startAddr, int *endAddr); /* taken from bootloadHID example from obdev */
 static int parseUntilColon(FILE *fp); /* taken from bootloadHID example from obdev */
 static int parseHex(FILE *fp, int numDigits); /* taken from bootloadHID example from obdev */
+static int listDevices(void);
+static int hasResetBranch(unsigned char *buffer);
+static const char* parseProgram(char *filename, int type, int *startAddress, int *endAddress);
+static int loadProgram(char *filename, int type, int *startAddress, int *endAddress);
+static void selectReconnect(micronucleus_selector *device_selector, micronucleus *lost_device);
+static int runServer(void);
+static int replayCapture(const char *capture);
 static void printProgress(float progress);
 static void setProgressData(char* friendly, int step);
 static int progress_step = 0; // current step
@@ -60,6 +83,36 @@ static int use_ansi = 0; // output ansi control character stuff
 static int erase_only = 0; // only erase, dont't write file
 static int fast_mode = 0; // normal mode adds 2ms to page writing times and waits longer for connect.
 static int timeout = 0;
+static int reentry_vid = -1; // USB IDs of a running application which can jump to the bootloader
+static int reentry_pid = -1;
+static char *new_serial = NULL; // serial number to write with the upload
+static micronucleus_selector selector; // binds to one of several devices
+static int list_devices = 0;
+static int server_mode = 0; // JSON-RPC on stdin and stdout
+static char *capture_file = NULL; // pcapng file for the control transfers
+static char *replay_file = NULL; // capture which is sent to the device again
+static char *catalog_file = NULL; // firmware catalog of --auto-upgrade
+static char *eeprom_file = NULL; // intel hex file written to the EEPROM after the upload
+static patch_spec patches[MAX_PATCHES]; // per unit data written into the program, see patch_util.h
+static int patch_count = 0;
+static char *elf_file = NULL; // symbols for --patch
+static int applyPatches(micronucleus *device, int *endAddress);
+
+// one row of the firmware catalog, see firmware/catalog.txt
+typedef struct _catalog_row {
+  unsigned int signature; // 0x1e9xxx
+  unsigned int flash_size;
+  unsigned int page_size;
+  int major;
+  int minor;
+  char config[64];
+  char release[CATALOG_MAX_PATH]; // paths relative to the catalog are completed while reading
+  char upgrade[CATALOG_MAX_PATH];
+} catalog_row;
+static catalog_row catalog[CATALOG_MAX_ROWS];
+static int catalog_rows = 0;
+static int readCatalog(const char *filename);
+static catalog_row* selectUpgrade(micronucleus *device);
 /*****************************************************************************/
 
 /******************************************************************************
@@ -75,12 +128,12 @@ int main(int argc, char **argv) {
   int file_type = FILE_TYPE_INTEL_HEX;
   int arg_pointer = 1;
   #if defined(WIN)
-  char* usage = "usage: micronucleus [--help] [--run] [--dump-progress] [--fast-mode] [--type intel-hex|raw] [--timeout integer] (--erase-only | filename)";
+  char* usage = "usage: micronucleus [--help] [--run] [--dump-progress] [--fast-mode] [--type intel-hex|raw] [--timeout integer] [--reentry VID:PID] [--set-serial string] [--device BUS:DEVICE] [--port-path path] [--serial string] [--capture file.pcapng] [--eeprom file.hex] [--patch location=template] [--elf file.elf] (--server | --replay file.pcapng | --list | --erase-only | --auto-upgrade catalog.txt | filename)";
   #else
-  char* usage = "usage: micronucleus [--help] [--run] [--dump-progress] [--fast-mode] [--type intel-hex|raw] [--timeout integer] [--no-ansi] (--erase-only | filename)";
+  char* usage = "usage: micronucleus [--help] [--run] [--dump-progress] [--fast-mode] [--type intel-hex|raw] [--timeout integer] [--reentry VID:PID] [--set-serial string] [--device BUS:DEVICE] [--port-path path] [--serial string] [--no-ansi] [--capture file.pcapng] [--eeprom file.hex] [--patch location=template] [--elf file.elf] (--server | --replay file.pcapng | --list | --erase-only | --auto-upgrade catalog.txt | filename)";
   #endif
   progress_step = 0;
-  progress_total_steps = 5; // steps: waiting, connecting, parsing, erasing, writing, (running)?
+  progress_total_steps = 5; // steps: parsing, waiting, connecting, erasing, writing, (eeprom)?, (running)?
   dump_progress = 0;
   erase_only = 0;
   fast_mode=0;
@@ -124,6 +177,37 @@ int main(int argc, char **argv) {
       puts("                --no-ansi: Don't use ANSI in terminal output");
       #endif
       puts("      --timeout [integer]: Timeout after waiting specified number of seconds");
+      puts("        --reentry VID:PID: Ask a running application with these hex USB IDs to jump");
+      puts("                           to the bootloader, instead of waiting for a reset");
+      puts("    --set-serial [string]: Write a new serial number with the upload. Requires");
+      puts("                           a bootloader built with ENABLE_SERIAL_NUMBER");
+      puts("                   --list: List all connected devices and exit");
+      puts("      --device BUS:DEVICE: Only use the device with this bus and device name or");
+      puts("                           number, as shown by --list");
+      puts("       --port-path [path]: Only use the device at this physical port like 1-1.4,");
+      puts("                           which stays the same after a reset (Linux only)");
+      puts("        --serial [string]: Only use the device with this serial number");
+      puts("  --capture [file.pcapng]: Log all control transfers to a pcapng file, which");
+      puts("                           Wireshark can read");
+      puts("   --replay [file.pcapng]: Send the transfers of a capture to the device again with");
+      puts("                           the same pauses and report the time of each request");
+      puts("      --eeprom [file.hex]: Write this intel hex file to the EEPROM after the upload,");
+      puts("                           in the same session. Gaps between the records are");
+      puts("                           written as 0xFF. Requires a bootloader built with");
+      puts("                           ENABLE_EEPROM_WRITE. Without a program file, only");
+      puts("                           the EEPROM is written and the flash is not erased");
+      puts("   --patch [loc=template]: Write per unit data into the program before the upload.");
+      puts("                           loc is an address or a symbol of --elf, template is");
+      puts("                           hex:0A0B, text:abc, counter:file[:bytes], line:file,");
+      puts("                           hexline:file or time[:bytes]. Counters and lines of");
+      puts("                           files are advanced when they are read, under a lock");
+      puts("         --elf [file.elf]: ELF file of the program with the symbols for --patch");
+      puts("                 --server: Read line delimited JSON-RPC requests from stdin and");
+      puts("                           keep the device open between them. Methods: list,");
+      puts("                           connect, erase, write, verify, run and disconnect");
+      puts(" --auto-upgrade [catalog]: Upgrade the bootloader with the upgrade of its configuration");
+      puts("                           in a catalog like firmware/catalog.txt and run it.");
+      puts("                           Devices with the newest version are not changed");
       puts("                 filename: Path to intel hex or raw data file to upload,");
       puts("                           or \"-\" to read from stdin");
       return EXIT_SUCCESS;
@@ -142,6 +226,97 @@ int main(int argc, char **argv) {
         printf("Did not understand --timeout value\n");
         return EXIT_FAILURE;
       }
+    } else if (strcmp(argv[arg_pointer], "--reentry") == 0) {
+      arg_pointer += 1;
+      if (arg_pointer >= argc || sscanf(argv[arg_pointer], "%x:%x", &reentry_vid, &reentry_pid) != 2) {
+        printf("Did not understand --reentry value\n");
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(argv[arg_pointer], "--set-serial") == 0) {
+      arg_pointer += 1;
+      if (arg_pointer >= argc) {
+        printf("Missing --set-serial value\n");
+        return EXIT_FAILURE;
+      }
+      new_serial = argv[arg_pointer];
+    } else if (strcmp(argv[arg_pointer], "--server") == 0) {
+      server_mode = 1;
+    } else if (strcmp(argv[arg_pointer], "--list") == 0) {
+      list_devices = 1;
+    } else if (strcmp(argv[arg_pointer], "--device") == 0) {
+      arg_pointer += 1;
+      char *separator = arg_pointer < argc ? strchr(argv[arg_pointer], ':') : NULL;
+      if (separator == NULL || separator == argv[arg_pointer] || separator[1] == 0) {
+        printf("Did not understand --device value\n");
+        return EXIT_FAILURE;
+      }
+      *separator = 0;
+      selector.bus = argv[arg_pointer];
+      selector.device = separator + 1;
+    } else if (strcmp(argv[arg_pointer], "--port-path") == 0) {
+      arg_pointer += 1;
+      if (arg_pointer >= argc) {
+        printf("Missing --port-path value\n");
+        return EXIT_FAILURE;
+      }
+      selector.port_path = argv[arg_pointer];
+    } else if (strcmp(argv[arg_pointer], "--serial") == 0) {
+      arg_pointer += 1;
+      if (arg_pointer >= argc) {
+        printf("Missing --serial value\n");
+        return EXIT_FAILURE;
+      }
+      selector.serial_number = argv[arg_pointer];
+    } else if (strcmp(argv[arg_pointer], "--auto-upgrade") == 0) {
+      arg_pointer += 1;
+      if (arg_pointer >= argc) {
+        printf("Missing --auto-upgrade value\n");
+        return EXIT_FAILURE;
+      }
+      catalog_file = argv[arg_pointer];
+    } else if (strcmp(argv[arg_pointer], "--eeprom") == 0) {
+      arg_pointer += 1;
+      if (arg_pointer >= argc) {
+        printf("Missing --eeprom value\n");
+        return EXIT_FAILURE;
+      }
+      eeprom_file = argv[arg_pointer];
+      progress_total_steps += 1;
+    } else if (strcmp(argv[arg_pointer], "--patch") == 0) {
+      arg_pointer += 1;
+      if (arg_pointer >= argc) {
+        printf("Missing --patch value\n");
+        return EXIT_FAILURE;
+      }
+      if (patch_count >= MAX_PATCHES) {
+        printf("Too many --patch options, maximum is %d\n", MAX_PATCHES);
+        return EXIT_FAILURE;
+      }
+      if (patch_parse(&patches[patch_count], argv[arg_pointer]) != 0) {
+        return EXIT_FAILURE;
+      }
+      patch_count++;
+    } else if (strcmp(argv[arg_pointer], "--elf") == 0) {
+      arg_pointer += 1;
+      if (arg_pointer >= argc) {
+        printf("Missing --elf value\n");
+        return EXIT_FAILURE;
+      }
+      elf_file = argv[arg_pointer];
+    } else if (strcmp(argv[arg_pointer], "--capture") == 0) {
+      arg_pointer += 1;
+      if (arg_pointer >= argc) {
+        printf("Missing --capture value\n");
+        return EXIT_FAILURE;
+      }
+      capture_file = argv[arg_pointer];
+    } else if (strcmp(argv[arg_pointer], "--replay") == 0) {
+      arg_pointer += 1;
+      if (arg_pointer >= argc) {
+        printf("Missing --replay value\n");
+        return EXIT_FAILURE;
+      }
+      replay_file = argv[arg_pointer];
     } else if (strlen(argv[arg_pointer]) > 1 && argv[arg_pointer][0] == '-') {
       fprintf(stderr, "Unrecognized option: %s\n", argv[arg_pointer]);
       return EXIT_FAILURE;
@@ -152,7 +327,35 @@ int main(int argc, char **argv) {
     arg_pointer += 1;
   }
 
-  if (file == NULL && erase_only == 0) {
+  if (capture_file != NULL && micronucleus_capture(capture_file) != 0) {
+    printf("> Could not create %s: %s\n", capture_file, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  if (server_mode) {
+    return runServer();
+  }
+
+  if (list_devices) {
+    return listDevices();
+  }
+
+  if (replay_file != NULL) {
+    return replayCapture(replay_file);
+  }
+
+  if (catalog_file != NULL && (file != NULL || erase_only || eeprom_file != NULL)) {
+    printf("> --auto-upgrade can not be combined with a file, --erase-only or --eeprom.\n");
+    return EXIT_FAILURE;
+  }
+
+  // only the EEPROM is written, the flash is neither erased nor written
+  int eeprom_only = file == NULL && erase_only == 0 && catalog_file == NULL && eeprom_file != NULL;
+  if (eeprom_only) {
+    progress_total_steps -= 2;
+  }
+
+  if (file == NULL && erase_only == 0 && catalog_file == NULL && eeprom_file == NULL) {
     // print version if we are called without any parameter
     printf(MICRONUCLEUS_COMMANDLINE_VERSION);
     printf("\nNeither filename nor --erase-only given!\n\n");
@@ -160,7 +363,57 @@ int main(int argc, char **argv) {
     return EXIT_FAILURE;
   }
 
-  setProgressData("waiting", 1);
+  // The file is checked before the device is plugged in. Only the size check needs the device.
+  int startAddress = 1, endAddress = 0;
+  int eepromStart = 1, eepromEnd = 0;
+
+  if (new_serial != NULL && (erase_only || eeprom_only)) {
+    printf("> The serial number can only be written with an upload.\n");
+    return EXIT_FAILURE;
+  }
+
+  if (patch_count > 0 && (file == NULL || erase_only)) {
+    printf("> --patch can only be used with the upload of a program file.\n");
+    return EXIT_FAILURE;
+  }
+  // symbols are looked up now, so a wrong name is reported before the device is plugged in
+  int i;
+  for (i = 0; i < patch_count; i++) {
+    if (patch_resolve(&patches[i], elf_file) != 0) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (catalog_file != NULL) {
+    setProgressData("parsing", 1);
+    printProgress(0.0);
+    if (readCatalog(catalog_file) != 0) {
+      return EXIT_FAILURE;
+    }
+    printProgress(1.0);
+  } else if (!erase_only && !eeprom_only) {
+    setProgressData("parsing", 1);
+    printProgress(0.0);
+    if (loadProgram(file, file_type, &startAddress, &endAddress) != 0) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (eeprom_file != NULL) {
+    setProgressData("parsing", 1);
+    memset(eepromBuffer, 0xFF, sizeof(eepromBuffer));
+    if (parseIntelHex(eeprom_file, eepromBuffer, &eepromStart, &eepromEnd)) {
+      printf("> Error loading or parsing EEPROM hex file.\n");
+      return EXIT_FAILURE;
+    }
+    if (eepromStart >= eepromEnd) {
+      printf("> No data in EEPROM file, exiting.\n");
+      return EXIT_FAILURE;
+    }
+    printProgress(1.0);
+  }
+
+  setProgressData("waiting", 2);
   if (dump_progress) printProgress(0.5);
   printf("> Please plug in the device");
   if (timeout > 0) printf(" (will time out in %d seconds)", timeout);
@@ -169,11 +422,16 @@ int main(int argc, char **argv) {
   fflush(stdout);
 
   time_t start_time, current_time;
+  int reentered = 0;
   time(&start_time);
 
   while (my_device == NULL) {
     delay(100);
-    my_device = micronucleus_connect(fast_mode);
+    my_device = micronucleus_connectSelected(&selector, fast_mode);
+    if (my_device == NULL && reentry_vid >= 0) {
+      my_device = micronucleus_reentry(reentry_vid, reentry_pid, fast_mode);
+      if (my_device) reentered = 1;
+    }
 
     time(&current_time);
     if (timeout && start_time + timeout < current_time) {
@@ -188,10 +446,10 @@ int main(int argc, char **argv) {
 
   printf("> Device is found!\n");
 
-  if (!fast_mode) {
+  if (!fast_mode && !reentered) {
     // wait for CONNECT_WAIT milliseconds with progress output
     float wait = 0.0f;
-    setProgressData("connecting", 2);
+    setProgressData("connecting", 3);
     while (wait < CONNECT_WAIT) {
       printProgress((wait / ((float) CONNECT_WAIT)) * 0.9f);
       wait += 50.0f;
@@ -206,90 +464,150 @@ int main(int argc, char **argv) {
   printf("> Suggested sleep time between sending pages: %ums\n", my_device->write_sleep);
   printf("> Whole page count: %d  page size: %d\n", my_device->pages,my_device->page_size);
   printf("> Erase function sleep duration: %dms\n", my_device->erase_sleep);
+  if (my_device->serial_number[0]) printf("> Device serial number: %s\n", my_device->serial_number);
+  if (my_device->port_path[0]) printf("> Device port path: %s\n", my_device->port_path);
   fflush(stdout);
 
-  int startAddress = 1, endAddress = 0;
-
-  if (!erase_only) {
-    setProgressData("parsing", 3);
-    printProgress(0.0);
-    memset(dataBuffer, 0xFF, sizeof(dataBuffer));
+  if (catalog_file != NULL) {
+    catalog_row *upgrade = selectUpgrade(my_device);
+    if (upgrade == NULL) {
+      return EXIT_FAILURE;
+    }
+    if (my_device->version.major > upgrade->major
+        || (my_device->version.major == upgrade->major && my_device->version.minor >= upgrade->minor)) {
+      printf("> Configuration %s is up to date with version %d.%d, nothing to upgrade.\n",
+             upgrade->config, my_device->version.major, my_device->version.minor);
+      if (run) micronucleus_startApp(my_device);
+      micronucleus_close(my_device);
+      return EXIT_SUCCESS;
+    }
+    printf("> Upgrading configuration %s to version %d.%d with %s\n",
+           upgrade->config, upgrade->major, upgrade->minor, upgrade->upgrade);
+    if (loadProgram(upgrade->upgrade, FILE_TYPE_INTEL_HEX, &startAddress, &endAddress) != 0) {
+      return EXIT_FAILURE;
+    }
+    // the upgrade is a user program, which writes the new bootloader when it runs
+    if (!run) {
+      run = 1;
+      progress_total_steps += 1;
+    }
+  }
 
-    if (file_type == FILE_TYPE_INTEL_HEX) {
-      if (parseIntelHex(file, dataBuffer, &startAddress, &endAddress)) {
-        printf("> Error loading or parsing hex file.\n");
-        return EXIT_FAILURE;
-      }
-    } else if (file_type == FILE_TYPE_RAW) {
-      if (parseRaw(file, dataBuffer, &startAddress, &endAddress)) {
-        printf("> Error loading raw file.\n");
-        return EXIT_FAILURE;
+  if (new_serial != NULL) {
+    if (micronucleus_setSerial(my_device, new_serial) != 0) {
+      if (my_device->serial_size == 0) {
+        printf("> Device does not support a serial number.\n");
+      } else {
+        printf("> Serial number is too long, maximum is %d characters.\n", (my_device->serial_size - 2) / 2);
       }
+      return EXIT_FAILURE;
     }
+  }
 
-    printProgress(1.0);
+  if (!erase_only && endAddress > (int) my_device->flash_size) {
+    printf("> Program file is %d bytes too big for the bootloader!\n", endAddress - my_device->flash_size);
+    return EXIT_FAILURE;
+  }
 
-    if (startAddress >= endAddress) {
-      printf("> No data in input file, exiting.\n");
-      return EXIT_FAILURE;
-    }
+  // rendered after connecting, so a time is the time of the upload
+  if (applyPatches(my_device, &endAddress) != 0) {
+    return EXIT_FAILURE;
+  }
 
-    if (endAddress > my_device->flash_size) {
-      printf("> Program file is %d bytes too big for the bootloader!\n", endAddress - my_device->flash_size);
+  // checked before the erase, so the device keeps its program if the EEPROM can not be written
+  micronucleus_eeprom eeprom;
+  if (eeprom_file != NULL) {
+    res = micronucleus_getEeprom(my_device, &eeprom);
+    if (res < 0) {
+      printf(">> EEPROM info error: %s has occured ...\n", strerror(-res));
+      return EXIT_FAILURE;
+    } else if (res == 1) {
+      printf("> Device does not support writing the EEPROM.\n");
+      return EXIT_FAILURE;
+    } else if ((unsigned int) eepromEnd > eeprom.size) {
+      printf("> EEPROM file is %d bytes too big for the %u bytes EEPROM!\n", eepromEnd - eeprom.size, eeprom.size);
       return EXIT_FAILURE;
     }
+    printf("> EEPROM size: %u bytes, sleep time between writes: %ums\n", eeprom.size, eeprom.write_sleep);
   }
 
   printProgress(1.0);
 
-  setProgressData("erasing", 4);
-  printf("> Erasing the memory ...\n");
-  res = micronucleus_eraseFlash(my_device, printProgress);
-
-  if (res == 1) { // erase disconnection bug workaround
-    printf(">> Eep! Connection to device lost during erase! Not to worry\n");
-    printf(">> This happens on some computers - reconnecting...\n");
-    my_device = NULL;
+  if (!eeprom_only) {
+    setProgressData("erasing", 4);
+    printf("> Erasing the memory ...\n");
+    res = micronucleus_eraseFlash(my_device, printProgress);
+
+    if (res == 1) { // erase disconnection bug workaround
+      printf(">> Eep! Connection to device lost during erase! Not to worry\n");
+      printf(">> This happens on some computers - reconnecting...\n");
+      selectReconnect(&selector, my_device);
+      // the lost handle is closed after reconnecting, so its lock is kept meanwhile
+      micronucleus *lost_device = my_device;
+      my_device = NULL;
+
+      delay(CONNECT_WAIT);
+
+      int deciseconds_till_reconnect_notice = 50; // notice after 5 seconds
+      while (my_device == NULL) {
+        delay(100);
+        my_device = micronucleus_connectSelected(&selector, fast_mode);
+        deciseconds_till_reconnect_notice -= 1;
+
+        if (deciseconds_till_reconnect_notice == 0) {
+          printf(">> (!) Automatic reconnection not working. Unplug and reconnect\n");
+          printf("   device usb connector, or reset it some other way to continue.\n");
+        }
+      }
 
-    delay(CONNECT_WAIT);
+      // the new handle reads the serial number from the erased flash, it is written again with the last page
+      strcpy(my_device->serial_number, lost_device->serial_number);
+      micronucleus_close(lost_device);
+      printf(">> Reconnected! Continuing upload sequence...\n");
 
-    int deciseconds_till_reconnect_notice = 50; // notice after 5 seconds
-    while (my_device == NULL) {
-      delay(100);
-      my_device = micronucleus_connect(fast_mode);
-      deciseconds_till_reconnect_notice -= 1;
+    } else if (res != 0) {
+      printf(">> Flash erase error: %s  has occured ...\n", strerror(-res));
+      printf(">> Consider to use another USB port or to restore the bootloader with an ISP, if this continues to happen.\n");
+      printf(">> Please unplug the device and restart the program.\n");
+      return EXIT_FAILURE;
+    }
+    printProgress(1.0);
 
-      if (deciseconds_till_reconnect_notice == 0) {
-        printf(">> (!) Automatic reconnection not working. Unplug and reconnect\n");
-        printf("   device usb connector, or reset it some other way to continue.\n");
+    if (!erase_only) {
+      printf("> Starting to upload ...\n");
+      setProgressData("writing", 5);
+      res = micronucleus_writeFlash(my_device, endAddress, dataBuffer, printProgress);
+      if (res != 0) {
+        printf(">> Flash write error: %s has occured ...\n", strerror(-res));
+        printf(">> Consider to use another USB port or to restore the bootloader with an ISP, if this continues to happen.\n");
+        printf(">> Please unplug the device and restart the program.\n");
+        return EXIT_FAILURE;
       }
     }
-
-    printf(">> Reconnected! Continuing upload sequence...\n");
-
-  } else if (res != 0) {
-    printf(">> Flash erase error: %s  has occured ...\n", strerror(-res));
-    printf(">> Consider to use another USB port or to restore the bootloader with an ISP, if this continues to happen.\n");
-    printf(">> Please unplug the device and restart the program.\n");
-    return EXIT_FAILURE;
   }
-  printProgress(1.0);
 
-  if (!erase_only) {
-    printf("> Starting to upload ...\n");
-    setProgressData("writing", 5);
-    res = micronucleus_writeFlash(my_device, endAddress, dataBuffer, printProgress);
+  if (eeprom_file != NULL) {
+    printf("> Writing %d bytes to the EEPROM ...\n", eepromEnd - eepromStart);
+    setProgressData("eeprom", progress_total_steps - run);
+    res = micronucleus_writeEeprom(my_device, &eeprom, eepromStart, eepromEnd - eepromStart,
+                                   eepromBuffer + eepromStart, printProgress);
     if (res != 0) {
-      printf(">> Flash write error: %s has occured ...\n", strerror(-res));
-      printf(">> Consider to use another USB port or to restore the bootloader with an ISP, if this continues to happen.\n");
+      printf(">> EEPROM write error: %s has occured ...\n", strerror(-res));
       printf(">> Please unplug the device and restart the program.\n");
       return EXIT_FAILURE;
     }
   }
 
+  // only bootloaders with ENABLE_HEALTH_COUNTERS report them
+  micronucleus_health health;
+  if (micronucleus_getHealth(my_device, &health) == 0) {
+    printf("> Bootloader health: %u host resets, %u packets, %u resyncs, %u dropped SETUP packets\n",
+           health.resets, health.packets, health.resyncs, health.dropped_setups);
+  }
+
   if (run) {
     printf("> Starting the user app ...\n");
-    setProgressData("running", 6);
+    setProgressData("running", progress_total_steps);
     printProgress(0.0);
 
     res = micronucleus_startApp(my_device);
@@ -301,8 +619,12 @@ int main(int argc, char **argv) {
     }
 
     printProgress(1.0);
+    if (catalog_file != NULL) {
+      printf("> The upgrade writes the new bootloader now, do not unplug the device for a few seconds.\n");
+    }
   }
 
+  micronucleus_close(my_device);
   printf(">> Micronucleus done. Thank you!\n");
 
   return EXIT_SUCCESS;
@@ -310,6 +632,795 @@ int main(int argc, char **argv) {
 /******************************************************************************/
 
 /******************************************************************************/
+/*
+ * Parse the file into dataBuffer and check that the bootloader can be inserted, for the
+ * upload and the server. Only the size check is left for after connecting to the device.
+ * Returns NULL for success or the error message
+ */
+static const char* parseProgram(char *filename, int type, int *startAddress, int *endAddress) {
+  memset(dataBuffer, 0xFF, sizeof(dataBuffer));
+
+  if (type == FILE_TYPE_INTEL_HEX) {
+    if (parseIntelHex(filename, dataBuffer, startAddress, endAddress)) {
+      return "Error loading or parsing hex file.";
+    }
+  } else if (type == FILE_TYPE_RAW) {
+    if (parseRaw(filename, dataBuffer, startAddress, endAddress)) {
+      return "Error loading raw file.";
+    }
+  }
+
+  if (*startAddress >= *endAddress) {
+    return "No data in input file.";
+  }
+
+  // the bootloader moves the reset vector of the user program, otherwise the upload fails after the erase
+  if (!hasResetBranch(dataBuffer)) {
+    return "The reset vector of the user program does not contain a branch instruction, "
+           "therefore the bootloader can not be inserted. Please rearrange your code.";
+  }
+  return NULL;
+}
+
+/*
+ * parseProgram() with progress and error output of the command line.
+ * Returns 0 for success, -1 after printing the error
+ */
+static int loadProgram(char *filename, int type, int *startAddress, int *endAddress) {
+  const char *error = parseProgram(filename, type, startAddress, endAddress);
+
+  if (error != NULL) {
+    printf("> %s\n", error);
+    return -1;
+  }
+  printProgress(1.0);
+  return 0;
+}
+/******************************************************************************/
+
+/******************************************************************************/
+/*
+ * Render the --patch values and write them into dataBuffer. The pages of the program are
+ * prepared from dataBuffer, so only the pages with patched bytes differ from the base build.
+ * Returns 0 for success, -1 after printing the error
+ */
+static int applyPatches(micronucleus *device, int *endAddress) {
+  int i;
+  unsigned int j;
+
+  for (i = 0; i < patch_count; i++) {
+    patch_spec *patch = &patches[i];
+
+    if (patch_render(patch) != 0) {
+      return -1;
+    }
+    // the reset vector is replaced by the jump to the bootloader
+    if (patch->address < 4 || patch->address + patch->length > device->flash_size) {
+      printf("> Patch of %s at 0x%04X is outside of the user program memory.\n", patch->location, patch->address);
+      return -1;
+    }
+    memcpy(dataBuffer + patch->address, patch->value, patch->length);
+    if ((unsigned int) *endAddress < patch->address + patch->length) {
+      *endAddress = patch->address + patch->length;
+    }
+
+    printf("> Patch %s at 0x%04X:", patch->location, patch->address);
+    for (j = 0; j < patch->length && j < 16; j++) printf(" %02X", patch->value[j]);
+    printf("%s\n", patch->length > 16 ? " ..." : "");
+  }
+  return 0;
+}
+/******************************************************************************/
+
+/******************************************************************************/
+/*
+ * The first instruction of the user program must be a jmp or rjmp, which the bootloader moves
+ */
+static int hasResetBranch(unsigned char *buffer) {
+  unsigned int word0 = buffer[1] * 0x100 + buffer[0];
+  return word0 == 0x940c || (word0 & 0xf000) == 0xc000;
+}
+/******************************************************************************/
+
+/******************************************************************************/
+static int listDevices(void) {
+  micronucleus_candidate candidates[MICRONUCLEUS_MAX_CANDIDATES];
+  int count = micronucleus_listDevices(candidates, MICRONUCLEUS_MAX_CANDIDATES);
+  int i;
+
+  if (count == 0) {
+    printf("> No device found\n");
+    return EXIT_FAILURE;
+  }
+  for (i = 0; i < count; i++) {
+    micronucleus_candidate *candidate = &candidates[i];
+    printf("bus %s device %s", candidate->bus, candidate->device);
+    if (candidate->port_path[0]) printf(" port %s", candidate->port_path);
+    printf(": firmware version %d.%d", candidate->version.major, candidate->version.minor);
+    if (candidate->responding) {
+      printf(", %d bytes, %d pages of %d bytes", candidate->flash_size, candidate->pages, candidate->page_size);
+      if (candidate->signature1) printf(", signature 0x1e%02x%02x", (int)candidate->signature1, (int)candidate->signature2);
+      if (candidate->serial_number[0]) printf(", serial number %s", candidate->serial_number);
+    } else if (candidate->claimed) {
+      printf(", used by another process");
+    } else {
+      printf(", not responding");
+    }
+    printf("\n");
+  }
+  return EXIT_SUCCESS;
+}
+/******************************************************************************/
+
+/******************************************************************************/
+/*
+ * The device gets a new address when it enumerates again after the erase,
+ * so it is found again by its port if that is known. The serial number was
+ * erased with the flash, so it can not be used to find the device again.
+ */
+static void selectReconnect(micronucleus_selector *device_selector, micronucleus *lost_device) {
+  static char port_path[MICRONUCLEUS_PATH_MAX];
+
+  strcpy(port_path, lost_device->port_path);
+  if (port_path[0]) {
+    device_selector->bus = NULL;
+    device_selector->device = NULL;
+    device_selector->port_path = port_path;
+  } else {
+    device_selector->device = NULL;
+  }
+  device_selector->serial_number = NULL;
+}
+/******************************************************************************/
+
+/******************************************************************************
+* Firmware catalog of --auto-upgrade, see firmware/catalog.txt and firmware/Catalog.py
+******************************************************************************/
+static void catalogPath(char *path, const char *catalog_name, const char *file_name) {
+  const char *separator = strrchr(catalog_name, '/');
+  #if defined(WIN)
+  if (strrchr(catalog_name, '\\') > separator) separator = strrchr(catalog_name, '\\');
+  #endif
+  if (file_name[0] == '/' || file_name[0] == '\\' || (file_name[0] && file_name[1] == ':') || separator == NULL) {
+    snprintf(path, CATALOG_MAX_PATH, "%s", file_name);
+  } else {
+    snprintf(path, CATALOG_MAX_PATH, "%.*s%s", (int) (separator + 1 - catalog_name), catalog_name, file_name);
+  }
+}
+
+static int readCatalog(const char *filename) {
+  char line[3 * CATALOG_MAX_PATH], release[CATALOG_MAX_PATH], upgrade[CATALOG_MAX_PATH];
+  int line_number = 0;
+  FILE *file = fopen(filename, "r");
+
+  if (file == NULL) {
+    printf("> Error opening catalog %s: %s\n", filename, strerror(errno));
+    return -1;
+  }
+  while (fgets(line, sizeof(line), file)) {
+    catalog_row *row = &catalog[catalog_rows];
+    char *text = line;
+
+    line_number++;
+    while (*text == ' ' || *text == '\t') text++;
+    if (*text == '#' || *text == '\n' || *text == '\r' || *text == 0) continue;
+    if (catalog_rows == CATALOG_MAX_ROWS) {
+      printf("> The catalog has more than %d rows\n", CATALOG_MAX_ROWS);
+      fclose(file);
+      return -1;
+    }
+    if (sscanf(text, "%x %u %u %d.%d %63s %511s %511s", &row->signature, &row->flash_size, &row->page_size,
+               &row->major, &row->minor, row->config, release, upgrade) != 8) {
+      printf("> Line %d of catalog %s is not: signature flash page version configuration release upgrade\n",
+             line_number, filename);
+      fclose(file);
+      return -1;
+    }
+    catalogPath(row->release, filename, release);
+    catalogPath(row->upgrade, filename, upgrade);
+    catalog_rows++;
+  }
+  fclose(file);
+  if (catalog_rows == 0) {
+    printf("> The catalog %s is empty\n", filename);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Returns the only configuration with the signature and page size of the device, and with its user flash size
+ * if match_flash is set. Returns NULL if there is none, or if there are several and sets ambiguous then.
+ */
+static const char* catalogConfig(micronucleus *device, int match_flash, int *ambiguous) {
+  unsigned int signature = 0x1e0000 | (device->signature1 << 8) | device->signature2;
+  const char *config = NULL;
+  int i;
+
+  *ambiguous = 0;
+  for (i = 0; i < catalog_rows; i++) {
+    if (catalog[i].signature != signature || catalog[i].page_size != device->page_size) continue;
+    if (match_flash && catalog[i].flash_size != device->flash_size) continue;
+    if (config != NULL && strcmp(config, catalog[i].config) != 0) {
+      *ambiguous = 1;
+      return NULL;
+    }
+    config = catalog[i].config;
+  }
+  return config;
+}
+
+/*
+ * The configuration of the device is the one of the row which matches its device info exactly.
+ * Otherwise it is the only configuration with the signature, page size and user flash size of the device,
+ * which does not change between most versions, or the only one with the signature and page size.
+ * Returns the row of the newest version of the configuration, or NULL after printing why there is none.
+ */
+static catalog_row* selectUpgrade(micronucleus *device) {
+  unsigned int signature = 0x1e0000 | (device->signature1 << 8) | device->signature2;
+  const char *config = NULL;
+  catalog_row *newest = NULL;
+  int ambiguous = 0, i;
+
+  if (device->version.major < 2) {
+    printf("> Firmware version 1.x does not report its signature and can not be upgraded automatically.\n");
+    return NULL;
+  }
+  for (i = 0; i < catalog_rows; i++) {
+    if (catalog[i].signature == signature && catalog[i].page_size == device->page_size
+        && catalog[i].flash_size == device->flash_size
+        && catalog[i].major == device->version.major && catalog[i].minor == device->version.minor) {
+      config = catalog[i].config;
+    }
+  }
+  if (config == NULL) config = catalogConfig(device, 1, &ambiguous);
+  if (config == NULL && !ambiguous) config = catalogConfig(device, 0, &ambiguous);
+  if (ambiguous) {
+    printf("> The device matches several configurations of the catalog:\n");
+    for (i = 0; i < catalog_rows; i++) {
+      if (catalog[i].signature != signature || catalog[i].page_size != device->page_size) continue;
+      printf(">   %s version %d.%d with %u bytes\n", catalog[i].config, catalog[i].major, catalog[i].minor,
+             catalog[i].flash_size);
+    }
+    printf("> Add a row of the version %d.%d with %u bytes, which the device runs, to the catalog.\n",
+           device->version.major, device->version.minor, device->flash_size);
+    return NULL;
+  }
+  if (config == NULL) {
+    printf("> The catalog has no configuration for signature 0x%06x with %u byte pages.\n", signature, device->page_size);
+    return NULL;
+  }
+
+  for (i = 0; i < catalog_rows; i++) {
+    if (strcmp(catalog[i].config, config) != 0) continue;
+    if (newest == NULL || catalog[i].major > newest->major
+        || (catalog[i].major == newest->major && catalog[i].minor > newest->minor)) {
+      newest = &catalog[i];
+    }
+  }
+  return newest;
+}
+/******************************************************************************/
+
+/******************************************************************************
+* Replay mode: the transfers of a capture are sent again with the same pauses
+* between them, so the transfer times of two hosts can be compared.
+******************************************************************************/
+typedef struct _replay_statistics {
+  int count;
+  int errors;
+  unsigned long long captured; // microseconds in transfers
+  unsigned long long replayed;
+  unsigned long long slowest;
+} replay_statistics;
+
+static const char *replay_names[REPLAY_REQUESTS + 1] = {
+  "device info", "transfer page", "erase", "write data", "exit", "keep alive", "other"
+};
+
+static void printReplayStatistics(const char *name, const replay_statistics *statistics) {
+  printf(">   %-14s %6d %12.1f %12.1f %11.1f %7d\n", name, statistics->count, statistics->captured / 1000.0,
+         statistics->replayed / 1000.0, statistics->slowest / 1000.0, statistics->errors);
+}
+
+static int replayCapture(const char *capture) {
+  usbcapture_reader reader;
+  usbcapture_transfer transfer, *transfers = NULL;
+  replay_statistics statistics[REPLAY_REQUESTS + 1], total;
+  micronucleus *device = NULL;
+  int count = 0, allocated = 0, skipped = 0, replayed, stopped = 0, address = -1, res, i;
+  unsigned long long captured_wait = 0, replayed_wait = 0, replay_start, previous_end;
+  time_t start_time, current_time;
+
+  if (usbcapture_openReader(&reader, capture) != 0) {
+    printf("> Could not read the capture %s\n", capture);
+    return EXIT_FAILURE;
+  }
+  // read the whole capture first, so reading the file does not add to the replayed time
+  while ((res = usbcapture_read(&reader, &transfer)) == 1) {
+    // standard requests come from libusb and the enumeration, the reentry request is sent to the application
+    if ((transfer.setup[0] & (0x03 << 5)) != USB_TYPE_VENDOR || transfer.setup[1] == MICRONUCLEUS_REENTRY_REQUEST) {
+      skipped++;
+      continue;
+    }
+    // a capture of Wireshark contains other devices of the bus
+    if (address < 0) address = transfer.address;
+    if (transfer.address != (unsigned int) address) {
+      skipped++;
+      continue;
+    }
+    if (count == allocated) {
+      allocated = allocated ? 2 * allocated : 256;
+      transfers = realloc(transfers, allocated * sizeof(usbcapture_transfer));
+      if (transfers == NULL) {
+        printf("> Not enough memory for the capture\n");
+        return EXIT_FAILURE;
+      }
+    }
+    transfers[count++] = transfer;
+  }
+  usbcapture_closeReader(&reader);
+  if (res < 0) {
+    printf("> The capture %s is corrupt, replaying the %d transfers before the error\n", capture, count);
+  }
+  if (count == 0) {
+    printf("> The capture contains no vendor requests of a bootloader\n");
+    return EXIT_FAILURE;
+  }
+
+  printf("> Replaying %d transfers, %d other transfers of the capture are skipped\n", count, skipped);
+  printf("> Please plug in the device");
+  if (timeout > 0) printf(" (will time out in %d seconds)", timeout);
+  printf(" ... \n");
+  fflush(stdout);
+
+  time(&start_time);
+  while (device == NULL) {
+    delay(100);
+    device = micronucleus_connectSelected(&selector, fast_mode);
+    time(&current_time);
+    if (timeout && start_time + timeout < current_time) {
+      printf("> Device search timed out!\n");
+      return EXIT_FAILURE;
+    }
+  }
+  if (!fast_mode) delay(CONNECT_WAIT);
+
+  memset(statistics, 0, sizeof(statistics));
+  replay_start = micros();
+  previous_end = replay_start;
+  for (replayed = 0; replayed < count; replayed++) {
+    usbcapture_transfer *captured = &transfers[replayed];
+    int type = captured->setup[1] < REPLAY_REQUESTS ? captured->setup[1] : REPLAY_REQUESTS;
+    int length = captured->setup[6] | (captured->setup[7] << 8);
+    char buffer[USBCAPTURE_MAX_DATA];
+    unsigned long long start, duration;
+
+    // the host paused as long as in the capture, for example while a page is written
+    if (replayed > 0 && captured->start > transfers[replayed - 1].end) {
+      captured_wait += captured->start - transfers[replayed - 1].end;
+      delayUntil(previous_end + captured->start - transfers[replayed - 1].end);
+    }
+    if (length > USBCAPTURE_MAX_DATA) length = USBCAPTURE_MAX_DATA;
+    memset(buffer, 0, sizeof(buffer));
+    if (!(captured->setup[0] & USB_ENDPOINT_IN)) memcpy(buffer, captured->data, captured->data_length);
+
+    start = micros();
+    replayed_wait += start - previous_end;
+    res = micronucleus_controlTransfer(device, captured->setup[0], captured->setup[1],
+                                       captured->setup[2] | (captured->setup[3] << 8),
+                                       captured->setup[4] | (captured->setup[5] << 8), buffer, length);
+    previous_end = micros();
+    duration = previous_end - start;
+
+    statistics[type].count++;
+    statistics[type].captured += captured->end - captured->start;
+    statistics[type].replayed += duration;
+    if (duration > statistics[type].slowest) statistics[type].slowest = duration;
+    if (res < 0) {
+      statistics[type].errors++;
+      // errors of the capture are expected again, like the lost connection after an erase on some hosts
+      if (captured->result >= 0) {
+        printf(">> Transfer %d (%s) failed with %s, replay stopped\n", replayed + 1, replay_names[type], strerror(-res));
+        replayed++;
+        stopped = 1;
+        break;
+      }
+    }
+  }
+
+  printf("> Replayed %d of %d transfers in %.1f ms, the capture took %.1f ms\n", replayed, count,
+         (previous_end - replay_start) / 1000.0, (transfers[replayed - 1].end - transfers[0].start) / 1000.0);
+  printf(">   request         count  captured ms  replayed ms  slowest ms  errors\n");
+  memset(&total, 0, sizeof(total));
+  for (i = 0; i <= REPLAY_REQUESTS; i++) {
+    if (statistics[i].count == 0) continue;
+    printReplayStatistics(replay_names[i], &statistics[i]);
+    total.count += statistics[i].count;
+    total.errors += statistics[i].errors;
+    total.captured += statistics[i].captured;
+    total.replayed += statistics[i].replayed;
+    if (statistics[i].slowest > total.slowest) total.slowest = statistics[i].slowest;
+  }
+  printReplayStatistics("all transfers", &total);
+  printf("> Pauses between the transfers: %.1f ms in the capture, %.1f ms replayed\n",
+         captured_wait / 1000.0, replayed_wait / 1000.0);
+
+  micronucleus_close(device);
+  free(transfers);
+  return stopped ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+/******************************************************************************/
+
+/******************************************************************************
+* Server mode: line delimited JSON-RPC on stdin and stdout
+* The device stays open between requests and is kept from timing out.
+******************************************************************************/
+static micronucleus *server_device = NULL;
+static micronucleus_selector server_selector;
+static int server_fast_mode = 0;
+static int server_erased = 0; // the flash must be erased before a write
+static char *server_step = "";
+static int server_percent = -1;
+
+static void appendText(char *buffer, size_t size, const char *format, ...) {
+  size_t length = strlen(buffer);
+  va_list arguments;
+
+  if (length >= size) return;
+  va_start(arguments, format);
+  vsnprintf(buffer + length, size - length, format, arguments);
+  va_end(arguments);
+}
+
+static void serverSetStep(char *step) {
+  server_step = step;
+  server_percent = -1;
+}
+
+static void serverProgress(float progress) {
+  char params[100];
+  int percent = (int) (progress * 100.0f);
+
+  if (percent == server_percent) return; // one notification per percent is enough for a GUI
+  server_percent = percent;
+  snprintf(params, sizeof(params), "{\"step\":\"%s\",\"progress\":%.2f}", server_step, progress);
+  jsonrpc_sendNotification("progress", params);
+}
+
+static void formatDevice(char *buffer, size_t size, micronucleus *device) {
+  char serial_number[2 * MICRONUCLEUS_SERIAL_MAX + 3];
+  char port_path[2 * MICRONUCLEUS_PATH_MAX + 3];
+
+  jsonrpc_quote(serial_number, sizeof(serial_number), device->serial_number);
+  jsonrpc_quote(port_path, sizeof(port_path), device->port_path);
+  buffer[0] = 0;
+  appendText(buffer, size, "{\"version\":\"%d.%d\",\"flash_size\":%u,\"page_size\":%u,\"pages\":%u,"
+             "\"write_sleep\":%u,\"erase_sleep\":%u,\"serial_number\":%s,\"port_path\":%s",
+             device->version.major, device->version.minor, device->flash_size, device->page_size, device->pages,
+             device->write_sleep, device->erase_sleep, serial_number, port_path);
+  if (device->signature1) appendText(buffer, size, ",\"signature\":\"0x1e%02x%02x\"", (int)device->signature1, (int)device->signature2);
+  appendText(buffer, size, "}");
+}
+
+static int serverRequireDevice(const jsonrpc_request *request) {
+  if (server_device == NULL) {
+    jsonrpc_sendError(request, JSONRPC_SERVER_ERROR, "Not connected");
+    return 0;
+  }
+  return 1;
+}
+
+static int isTrue(const char *value) {
+  return value && (strcmp(value, "true") == 0 || strcmp(value, "1") == 0);
+}
+
+static void serveList(const jsonrpc_request *request) {
+  static char result[MICRONUCLEUS_MAX_CANDIDATES * 512];
+  micronucleus_candidate candidates[MICRONUCLEUS_MAX_CANDIDATES];
+  int count = micronucleus_listDevices(candidates, MICRONUCLEUS_MAX_CANDIDATES);
+  int i;
+
+  strcpy(result, "[");
+  for (i = 0; i < count; i++) {
+    micronucleus_candidate *candidate = &candidates[i];
+    char bus[2 * MICRONUCLEUS_PATH_MAX + 3];
+    char device[2 * MICRONUCLEUS_PATH_MAX + 3];
+    char port_path[2 * MICRONUCLEUS_PATH_MAX + 3];
+    char serial_number[2 * MICRONUCLEUS_SERIAL_MAX + 3];
+
+    jsonrpc_quote(bus, sizeof(bus), candidate->bus);
+    jsonrpc_quote(device, sizeof(device), candidate->device);
+    jsonrpc_quote(port_path, sizeof(port_path), candidate->port_path);
+    jsonrpc_quote(serial_number, sizeof(serial_number), candidate->serial_number);
+    appendText(result, sizeof(result), "%s{\"bus\":%s,\"device\":%s,\"address\":%u,\"port_path\":%s,\"version\":\"%d.%d\","
+               "\"claimed\":%s,\"responding\":%s",
+               i ? "," : "", bus, device, candidate->address, port_path, candidate->version.major, candidate->version.minor,
+               candidate->claimed ? "true" : "false", candidate->responding ? "true" : "false");
+    if (candidate->responding) {
+      appendText(result, sizeof(result), ",\"flash_size\":%u,\"page_size\":%u,\"pages\":%u,\"serial_number\":%s",
+                 candidate->flash_size, candidate->page_size, candidate->pages, serial_number);
+    }
+    appendText(result, sizeof(result), "}");
+  }
+  appendText(result, sizeof(result), "]");
+  jsonrpc_sendResult(request, result);
+}
+
+static void serveConnect(const jsonrpc_request *request) {
+  static char bus[MICRONUCLEUS_PATH_MAX], device[MICRONUCLEUS_PATH_MAX], port_path[MICRONUCLEUS_PATH_MAX];
+  static char serial_number[MICRONUCLEUS_SERIAL_MAX + 1];
+  char result[1024];
+  const char *value;
+  int waited;
+
+  memset(&server_selector, 0, sizeof(server_selector));
+  if ((value = jsonrpc_getParam(request, "bus")) != NULL) {
+    server_selector.bus = bus;
+    snprintf(bus, sizeof(bus), "%s", value);
+  }
+  if ((value = jsonrpc_getParam(request, "device")) != NULL) {
+    server_selector.device = device;
+    snprintf(device, sizeof(device), "%s", value);
+  }
+  if ((value = jsonrpc_getParam(request, "port_path")) != NULL) {
+    server_selector.port_path = port_path;
+    snprintf(port_path, sizeof(port_path), "%s", value);
+  }
+  if ((value = jsonrpc_getParam(request, "serial_number")) != NULL) {
+    server_selector.serial_number = serial_number;
+    snprintf(serial_number, sizeof(serial_number), "%s", value);
+  }
+  server_fast_mode = isTrue(jsonrpc_getParam(request, "fast_mode"));
+  value = jsonrpc_getParam(request, "timeout"); // milliseconds to wait for the device to be plugged in
+  int timeout_ms = value ? atoi(value) : 0;
+
+  if (server_device) {
+    micronucleus_close(server_device);
+    server_device = NULL;
+  }
+  for (waited = 0; ; waited += 100) {
+    server_device = micronucleus_connectSelected(&server_selector, server_fast_mode);
+    if (server_device != NULL || waited >= timeout_ms) break;
+    delay(100);
+  }
+  if (server_device == NULL) {
+    jsonrpc_sendError(request, JSONRPC_SERVER_ERROR, "Device not found");
+    return;
+  }
+
+  if (!server_fast_mode) delay(CONNECT_WAIT);
+  micronucleus_keepAlive(server_device);
+  server_erased = 0;
+  formatDevice(result, sizeof(result), server_device);
+  jsonrpc_sendResult(request, result);
+}
+
+static void serveErase(const jsonrpc_request *request) {
+  if (!serverRequireDevice(request)) return;
+
+  serverSetStep("erasing");
+  int res = micronucleus_eraseFlash(server_device, serverProgress);
+
+  if (res == 1) { // erase disconnection bug workaround, see main()
+    micronucleus *lost_device = server_device;
+    int attempts;
+
+    selectReconnect(&server_selector, lost_device);
+    server_device = NULL;
+    delay(CONNECT_WAIT);
+    for (attempts = 0; attempts < SERVER_RECONNECT_ATTEMPTS && server_device == NULL; attempts++) {
+      delay(100);
+      server_device = micronucleus_connectSelected(&server_selector, server_fast_mode);
+    }
+    if (server_device != NULL) strcpy(server_device->serial_number, lost_device->serial_number);
+    micronucleus_close(lost_device);
+    if (server_device == NULL) {
+      jsonrpc_sendError(request, JSONRPC_SERVER_ERROR, "Connection to device lost during erase");
+      return;
+    }
+  } else if (res != 0) {
+    jsonrpc_sendError(request, JSONRPC_SERVER_ERROR, strerror(-res));
+    return;
+  }
+  server_erased = 1;
+  jsonrpc_sendResult(request, "true");
+}
+
+/*
+ * Parse the file given by the params into dataBuffer and check that it fits into the device
+ * Returns the end address, or 0 after an error was sent
+ */
+static int serverLoadImage(const jsonrpc_request *request) {
+  const char *file = jsonrpc_getParam(request, "file");
+  const char *type = jsonrpc_getParam(request, "type");
+  char path[JSONRPC_MAX_VALUE];
+  char message[100];
+  int startAddress = 1, endAddress = 0;
+  const char *error;
+
+  if (file == NULL || file[0] == 0 || strcmp(file, "-") == 0) { // stdin is used for requests
+    jsonrpc_sendError(request, JSONRPC_INVALID_PARAMS, "A file name is required");
+    return 0;
+  }
+  snprintf(path, sizeof(path), "%s", file);
+
+  if (type == NULL || strcmp(type, "intel-hex") == 0) {
+    error = parseProgram(path, FILE_TYPE_INTEL_HEX, &startAddress, &endAddress);
+  } else if (strcmp(type, "raw") == 0) {
+    error = parseProgram(path, FILE_TYPE_RAW, &startAddress, &endAddress);
+  } else {
+    jsonrpc_sendError(request, JSONRPC_INVALID_PARAMS, "Unknown file type");
+    return 0;
+  }
+
+  if (error != NULL) {
+    jsonrpc_sendError(request, JSONRPC_SERVER_ERROR, error);
+    return 0;
+  }
+  if (endAddress > (int) server_device->flash_size) {
+    snprintf(message, sizeof(message), "Program file is %d bytes too big for the bootloader", endAddress - server_device->flash_size);
+    jsonrpc_sendError(request, JSONRPC_SERVER_ERROR, message);
+    return 0;
+  }
+  return endAddress;
+}
+
+static void serveWrite(const jsonrpc_request *request) {
+  char result[100];
+  const char *serial_number = jsonrpc_getParam(request, "serial_number");
+
+  if (!serverRequireDevice(request)) return;
+  int endAddress = serverLoadImage(request);
+  if (endAddress == 0) return;
+
+  if (!server_erased) {
+    jsonrpc_sendError(request, JSONRPC_SERVER_ERROR, "The device must be erased before writing");
+    return;
+  }
+  if (serial_number && micronucleus_setSerial(server_device, serial_number) != 0) {
+    jsonrpc_sendError(request, JSONRPC_INVALID_PARAMS, "Serial number not supported by the device or too long");
+    return;
+  }
+
+  serverSetStep("writing");
+  int res = micronucleus_writeFlash(server_device, endAddress, dataBuffer, serverProgress);
+  server_erased = 0;
+  if (res != 0) {
+    jsonrpc_sendError(request, JSONRPC_SERVER_ERROR, strerror(-res));
+    return;
+  }
+  snprintf(result, sizeof(result), "{\"bytes\":%d}", endAddress);
+  jsonrpc_sendResult(request, result);
+}
+
+/*
+ * The bootloader can not read back the flash, so the file is only checked against the device
+ */
+static void serveVerify(const jsonrpc_request *request) {
+  char result[100];
+
+  if (!serverRequireDevice(request)) return;
+  int endAddress = serverLoadImage(request);
+  if (endAddress == 0) return;
+
+  snprintf(result, sizeof(result), "{\"bytes\":%d,\"free\":%d}", endAddress, server_device->flash_size - endAddress);
+  jsonrpc_sendResult(request, result);
+}
+
+static void serveRun(const jsonrpc_request *request) {
+  if (!serverRequireDevice(request)) return;
+
+  int res = micronucleus_startApp(server_device);
+  micronucleus_close(server_device);
+  server_device = NULL;
+  if (res != 0) {
+    jsonrpc_sendError(request, JSONRPC_SERVER_ERROR, strerror(-res));
+    return;
+  }
+  jsonrpc_sendResult(request, "true");
+}
+
+static void serveHealth(const jsonrpc_request *request) {
+  micronucleus_health health;
+  char result[120];
+
+  if (!serverRequireDevice(request)) return;
+  int res = micronucleus_getHealth(server_device, &health);
+  if (res < 0) {
+    jsonrpc_sendError(request, JSONRPC_SERVER_ERROR, strerror(-res));
+    return;
+  }
+  if (res > 0) {
+    jsonrpc_sendResult(request, "null"); // bootloader without ENABLE_HEALTH_COUNTERS
+    return;
+  }
+  snprintf(result, sizeof(result), "{\"resets\":%u,\"packets\":%u,\"resyncs\":%u,\"dropped_setups\":%u}",
+           health.resets, health.packets, health.resyncs, health.dropped_setups);
+  jsonrpc_sendResult(request, result);
+}
+
+static void serveDisconnect(const jsonrpc_request *request) {
+  if (server_device) {
+    micronucleus_close(server_device);
+    server_device = NULL;
+  }
+  jsonrpc_sendResult(request, "true");
+}
+
+/*
+ * Returns 1 if a request can be read, 0 if nothing arrived within the given time
+ */
+static int serverWaitForInput(int milliseconds) {
+#if defined(WIN)
+  // select() does not work on pipes, so the keep alive is only sent with requests
+  (void) milliseconds;
+  return 1;
+#else
+  fd_set fds;
+  struct timeval wait;
+
+  FD_ZERO(&fds);
+  FD_SET(STDIN_FILENO, &fds);
+  wait.tv_sec = milliseconds / 1000;
+  wait.tv_usec = (milliseconds % 1000) * 1000;
+  return select(STDIN_FILENO + 1, &fds, NULL, NULL, &wait) != 0; // errors are reported by the following read
+#endif
+}
+
+static int runServer(void) {
+  char line[JSONRPC_MAX_LINE];
+  jsonrpc_request request;
+  int res;
+
+  // stdout is reserved for JSON, all other output goes to stderr
+  jsonrpc_setOutput(fdopen(dup(fileno(stdout)), "w"));
+  dup2(fileno(stderr), fileno(stdout));
+  // select() only sees input which is not buffered by stdio yet
+  setvbuf(stdin, NULL, _IONBF, 0);
+
+  for (;;) {
+    if (!serverWaitForInput(SERVER_KEEPALIVE_INTERVAL)) {
+      if (server_device && micronucleus_keepAlive(server_device) < 0) {
+        micronucleus_close(server_device);
+        server_device = NULL;
+        jsonrpc_sendNotification("disconnected", "{}");
+      }
+      continue;
+    }
+    if (fgets(line, sizeof(line), stdin) == NULL) break;
+    if (strspn(line, " \t\r\n") == strlen(line)) continue;
+
+    res = jsonrpc_parseRequest(line, &request);
+    if (res == JSONRPC_PARSE_ERROR) {
+      jsonrpc_sendError(NULL, res, "Parse error");
+    } else if (res != 0) {
+      jsonrpc_sendError(&request, res, "Invalid request");
+    } else if (strcmp(request.method, "list") == 0) {
+      serveList(&request);
+    } else if (strcmp(request.method, "connect") == 0) {
+      serveConnect(&request);
+    } else if (strcmp(request.method, "erase") == 0) {
+      serveErase(&request);
+    } else if (strcmp(request.method, "write") == 0) {
+      serveWrite(&request);
+    } else if (strcmp(request.method, "verify") == 0) {
+      serveVerify(&request);
+    } else if (strcmp(request.method, "run") == 0) {
+      serveRun(&request);
+    } else if (strcmp(request.method, "health") == 0) {
+      serveHealth(&request);
+    } else if (strcmp(request.method, "disconnect") == 0) {
+      serveDisconnect(&request);
+    } else {
+      jsonrpc_sendError(&request, JSONRPC_METHOD_NOT_FOUND, "Method not found");
+    }
+  }
+
+  if (server_device) micronucleus_close(server_device);
+  return EXIT_SUCCESS;
+}
+
 static void printProgress(float progress) {
   static int last_step;
   static int last_integer_total_progress;
@@ -1,15 +1,54 @@
 # calculate bootloader location and free userspace
+#
+# Usage: python CalculateSize.py [--address] [DEVICE [BOOTLOADER_ADDRESS]] <size.txt
+# size.txt is the output of "avr-size -A -t main.hex".
+# With DEVICE, the lowest bootloader address is calculated from the flash size, page size and erase granularity
+# of the device, and compared with the configured BOOTLOADER_ADDRESS.
+# With --address only the lowest address is printed in the hex format of Makefile.inc, for "make auto-address".
 
 import sys
 import math
 
+POSTSCRIPT_SIZE = 6 # at most, without serial number
+
+# flash size, page size, pages erased at once, size of the largest boot section of the ATmegas
+DEVICES = {
+    'attiny45':   (4096,  64,  1, 0),
+    'attiny85':   (8192,  64,  1, 0),
+    'attiny44':   (4096,  64,  1, 0),
+    'attiny84':   (8192,  64,  1, 0),
+    'attiny441':  (4096,  16,  4, 0),
+    'attiny841':  (8192,  16,  4, 0),
+    'attiny1634': (16384, 32,  4, 0),
+    'attiny88':   (8192,  64,  1, 0),
+    'attiny167':  (16384, 128, 1, 0),
+    'attiny4313': (4096,  64,  1, 0),
+    'atmega88p':  (8192,  64,  1, 2048),
+    'atmega168p': (16384, 128, 1, 2048),
+    'atmega328p': (32768, 128, 1, 4096),
+}
+
 def printmnsize(codesize,pagesize=64,memsize=8192):
     pages=math.ceil(codesize/pagesize)
-    freespace=memsize-pages*pagesize-6 # 6 is POSTSCRIPT_SIZE
+    freespace=memsize-pages*pagesize-POSTSCRIPT_SIZE
     bootstart=memsize-pages*pagesize
 
     print('Codesize: {:04d} bytes, BOOTLOADER_ADDRESS: 0x{:04X}, Free user memory {:04d} bytes.'.format(codesize,bootstart,freespace))
 
+def lowestaddress(codesize,device):
+    memsize,pagesize,erasepages,bootsection=DEVICES[device]
+    erasesize=pagesize*erasepages # the bootloader must start at an erase unit, see eraseApplication() in main.c
+    bootstart=memsize-math.ceil(codesize/erasesize)*erasesize
+    if bootsection and bootstart < memsize-bootsection:
+        print('Codesize {:d} bytes does not fit into the boot section of the {:s}!'.format(codesize,device))
+        exit(1)
+    return bootstart
+
+arguments=[argument for argument in sys.argv[1:] if argument != '--address']
+addressonly='--address' in sys.argv
+device=arguments[0].lower() if len(arguments) > 0 else None
+configured=int(arguments[1],16) if len(arguments) > 1 else None
+
 codesize=0
 
 for currentline in sys.stdin.readlines():
@@ -22,9 +61,27 @@ for currentline in sys.stdin.readlines():
 
 if (codesize == 0):
     print("Codesize could not be found!")
+    exit(1 if addressonly else 0)
+
+if device not in DEVICES:
+    if device:
+        print('Device {:s} is unknown, add it to DEVICES in CalculateSize.py'.format(device))
+        if addressonly:
+            exit(1)
+    print('8K  Device -- ',end='')
+    printmnsize(codesize,pagesize=64,memsize=8192)
+    print('16K Device -- ',end='')
+    printmnsize(codesize,pagesize=128,memsize=16384)
+    exit()
+
+bootstart=lowestaddress(codesize,device)
+if addressonly:
+    print('{:04X}'.format(bootstart))
     exit()
 
-print('8K  Device -- ',end='')
-printmnsize(codesize,pagesize=64,memsize=8192)
-print('16K Device -- ',end='')
-printmnsize(codesize,pagesize=128,memsize=16384)
+print('{:s} -- Codesize: {:04d} bytes, BOOTLOADER_ADDRESS: 0x{:04X}, Free user memory {:04d} bytes.'.format(device,codesize,bootstart,bootstart-POSTSCRIPT_SIZE))
+if configured is not None and configured < bootstart:
+    print('BOOTLOADER_ADDRESS 0x{:04X} wastes {:d} bytes of user memory, build with "make auto-address" to use 0x{:04X}.'.format(configured,bootstart-configured,bootstart))
+if configured is not None and configured > bootstart:
+    print('BOOTLOADER_ADDRESS 0x{:04X} is too high, the bootloader does not fit below the end of flash!'.format(configured))
+    exit(1)
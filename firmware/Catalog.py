@@ -0,0 +1,95 @@
+# Firmware catalog for "micronucleus --auto-upgrade", see catalog.txt
+#
+# Usage: avr-nm main.bin | python Catalog.py entry CONFIG main.hex >catalog.txt
+#        python Catalog.py merge catalog.txt ENTRY...
+#
+# entry prints the catalog row of a configuration. Signature, user flash size and page size are read from
+# the configurationReply of main.hex, which the device sends as device info, and the version from main.c.
+# merge adds the rows of the entries to the catalog. A row of the same configuration and version is replaced,
+# rows of older versions are kept, so boards which still run them are recognized.
+
+import sys
+import os
+import re
+
+HEADER = '''# Firmware catalog of micronucleus, updated by "make release". See "micronucleus --auto-upgrade".
+# A board is recognized by the device info of its bootloader: signature, user flash size, page size and version.
+# It is upgraded with the upgrade of the newest version of the same configuration. Rows of older versions only
+# recognize boards, keep them when releasing a new version. Paths are relative to this file.
+#
+# signature flash page version configuration release upgrade
+'''
+
+def readhex(filename):
+    memory = {}
+    base = 0
+    for line in open(filename):
+        line = line.strip()
+        if not line.startswith(':'):
+            continue
+        data = bytes.fromhex(line[1:])
+        length, address, kind = data[0], (data[1] << 8) | data[2], data[3]
+        if kind == 0:
+            for i in range(length):
+                memory[base + address + i] = data[4 + i]
+        elif kind == 2:
+            base = ((data[4] << 8) | data[5]) << 4
+        elif kind == 4:
+            base = ((data[4] << 8) | data[5]) << 16
+        elif kind == 1:
+            break
+    return memory
+
+def version():
+    source = open(os.path.join(os.path.dirname(os.path.abspath(__file__)), 'main.c')).read()
+    major = re.search(r'#define\s+MICRONUCLEUS_VERSION_MAJOR\s+(\d+)', source).group(1)
+    minor = re.search(r'#define\s+MICRONUCLEUS_VERSION_MINOR\s+(\d+)', source).group(1)
+    return major + '.' + minor
+
+def entry(config, hexfile):
+    address = None
+    for line in sys.stdin:
+        fields = line.split()
+        if len(fields) == 3 and fields[2] == 'configurationReply':
+            address = int(fields[0], 16)
+    if address is None:
+        print('configurationReply not found in the symbols of {:s}'.format(config), file=sys.stderr)
+        exit(1)
+    memory = readhex(hexfile)
+    try:
+        reply = [memory[address + i] for i in range(6)]
+    except KeyError:
+        print('configurationReply is not in {:s}'.format(hexfile), file=sys.stderr)
+        exit(1)
+    print('1e{:02x}{:02x} {:d} {:d} {:s} {:s} releases/{:s}.hex upgrades/upgrade-{:s}.hex'.format(
+        reply[4], reply[5], (reply[0] << 8) | reply[1], reply[2], version(), config, config, config))
+
+def versionkey(text):
+    return tuple(int(part) for part in text.split('.'))
+
+def merge(catalog, entries):
+    rows = {}
+    if os.path.exists(catalog):
+        for line in open(catalog):
+            fields = line.split()
+            if len(fields) == 7 and not line.startswith('#'):
+                rows[(fields[4], fields[3])] = fields
+    for filename in entries:
+        for line in open(filename):
+            fields = line.split()
+            if len(fields) == 7:
+                rows[(fields[4], fields[3])] = fields
+    with open(catalog + '.tmp', 'w') as output:
+        output.write(HEADER)
+        for key in sorted(rows, key=lambda key: (key[0], versionkey(key[1]))):
+            output.write(' '.join(rows[key]) + '\n')
+    os.replace(catalog + '.tmp', catalog)
+
+if len(sys.argv) == 4 and sys.argv[1] == 'entry':
+    entry(sys.argv[2], sys.argv[3])
+elif len(sys.argv) >= 3 and sys.argv[1] == 'merge':
+    merge(sys.argv[2], sys.argv[3:])
+else:
+    print('Usage: avr-nm main.bin | python Catalog.py entry CONFIG main.hex', file=sys.stderr)
+    print('       python Catalog.py merge catalog.txt ENTRY...', file=sys.stderr)
+    exit(2)
@@ -0,0 +1,323 @@
+# Static cycle budget check of the USB polling loop of micronucleus
+#
+# Usage: python CycleBudget.py F_CPU [--loop-bound N] <main.lss
+#
+# main.lss is the output of "avr-objdump -d -S main.bin", which is generated with main.bin.
+# The bootloader has no USB interrupt, so the V-USB timing depends on the cycles of the main loop:
+# - poll:    one iteration of the 5 ms wait loop without host reset or USB packet.
+#            t5msTimeoutCounter in main.c assumes 15 cycles.
+# - resync:  one iteration of the inline assembler loop which waits for 8.8 us bus idle. main.c assumes 5 cycles.
+# - process: worst case from the return of USB_handler() until the wait loop is entered again.
+#            This contains usbProcessRx() and usbFunctionSetup(), if they are inlined.
+#            It must be shorter than one USB frame (1 ms), otherwise the retry of a missed packet is missed too.
+#            Erasing and writing the flash blocks by design and is not counted.
+# Loops in the processing path are counted with --loop-bound iterations (default 8 for the 8 byte USB data packets).
+# Functions which are not inlined get their own worst case line.
+#
+# The exit code is 1 if a budget is exceeded. If a loop can not be found in the disassembly,
+# a warning is printed, since the compiler may have arranged the code in an unexpected way.
+
+import sys
+import re
+
+BLOCKING_FUNCTIONS = ('eraseApplication', 'writeFlashPage', 'tuneOsccal', 'leaveBootloader', 'USB_handler', 'main')
+REPORTED_FUNCTIONS = ('usbFunctionSetup', 'usbProcessRx', 'usbBuildTxBlock', 'usbCrc16Append')
+
+# cycles of the AVR instructions with 16 bit program counter, which are not 1 cycle
+CYCLES = {
+    'adiw': 2, 'sbiw': 2, 'mul': 2, 'muls': 2, 'mulsu': 2, 'fmul': 2, 'fmuls': 2, 'fmulsu': 2,
+    'ld': 2, 'ldd': 2, 'st': 2, 'std': 2, 'lds': 2, 'sts': 2, 'push': 2, 'pop': 2,
+    'cbi': 2, 'sbi': 2, 'lpm': 3, 'elpm': 3,
+    'rjmp': 2, 'ijmp': 2, 'jmp': 3, 'rcall': 3, 'icall': 3, 'call': 4, 'ret': 4, 'reti': 4,
+}
+SKIPS = ('sbrs', 'sbrc', 'sbis', 'sbic', 'cpse')
+
+INSTRUCTION = re.compile(r'^\s*([0-9a-f]+):\t((?:[0-9a-f]{2} )+)\s*\t([.\w]+)\s*([^;]*?)\s*(?:;\s*(.*))?$')
+LABEL = re.compile(r'^([0-9a-f]+) <([^>]+)>:$')
+TARGET = re.compile(r'0x([0-9a-f]+)\s*<([^>+]+)')
+
+
+class Instruction:
+    def __init__(self, address, size, mnemonic, operands, comment, function):
+        self.address = address
+        self.size = size
+        self.mnemonic = mnemonic
+        self.operands = operands
+        self.function = function
+        self.target = None
+        self.target_symbol = None
+        match = TARGET.search(comment or '')
+        if match:
+            self.target = int(match.group(1), 16)
+            self.target_symbol = match.group(2)
+        elif mnemonic in ('jmp', 'call') and operands.startswith('0x'):
+            self.target = int(operands, 16)
+
+    def end(self):
+        return self.address + self.size
+
+    def is_branch(self):
+        return self.mnemonic.startswith('br') and self.mnemonic not in ('break',)
+
+    def is_call(self):
+        return self.mnemonic in ('rcall', 'call', 'icall')
+
+
+def read_listing(lines):
+    code = {}
+    functions = {}
+    function = None
+    for line in lines:
+        line = line.rstrip('\n')
+        match = LABEL.match(line)
+        if match:
+            function = match.group(2)
+            functions[function] = int(match.group(1), 16)
+            continue
+        match = INSTRUCTION.match(line)
+        if match:
+            address = int(match.group(1), 16)
+            size = len(match.group(2).split())
+            code[address] = Instruction(address, size, match.group(3), match.group(4), match.group(5), function)
+    return code, functions
+
+
+def successors(code, instruction):
+    """Returns the list of (address, cycles) of the instruction, an empty list for ret and unknown jumps"""
+    mnemonic = instruction.mnemonic
+    if mnemonic.startswith('.'):
+        return []  # data
+    if instruction.is_branch():
+        return [(instruction.end(), 1), (instruction.target, 2)]
+    if mnemonic in SKIPS:
+        following = code.get(instruction.end())
+        skipped = following.end() if following else instruction.end() + 2
+        return [(instruction.end(), 1), (skipped, 3 if following and following.size == 4 else 2)]
+    if mnemonic in ('rjmp', 'jmp'):
+        return [(instruction.target, CYCLES[mnemonic])] if instruction.target is not None else []
+    if mnemonic in ('ret', 'reti', 'ijmp'):
+        return []
+    return [(instruction.end(), CYCLES.get(mnemonic, 1))]
+
+
+def find_loops(code, function):
+    """Returns the (header, back edge address) of every loop, found by its backward branch or jump"""
+    loops = []
+    for instruction in code.values():
+        if instruction.function != function or instruction.target is None or instruction.is_call():
+            continue
+        if instruction.target <= instruction.address and code.get(instruction.target) \
+                and code[instruction.target].function == function:
+            loops.append((instruction.target, instruction.address))
+    return loops
+
+
+def is_counter_zero_edge(code, instruction, target):
+    """The edge taken when an 8 bit down counter reaches 0, like the host reset detection"""
+    previous = code.get(instruction.address - 2)
+    if previous is None or instruction.mnemonic not in ('brne', 'breq'):
+        return False
+    if not (previous.mnemonic == 'dec' or (previous.mnemonic == 'subi' and previous.operands.endswith('0x01'))):
+        return False
+    taken = target == instruction.target and target != instruction.end()
+    return taken if instruction.mnemonic == 'breq' else not taken
+
+
+def loop_iteration(code, header, back_edge, skip_rare=False, skip_calls=False):
+    """Longest and shortest path from the header to the back edge, only forward edges inside the loop"""
+    memo = {}
+
+    def walk(address):
+        if address in memo:
+            return memo[address]
+        memo[address] = None  # in progress
+        instruction = code.get(address)
+        result = None
+        if instruction is not None and header <= address <= back_edge \
+                and not (skip_calls and instruction.is_call()):
+            for target, cycles in successors(code, instruction):
+                if skip_rare and is_counter_zero_edge(code, instruction, target):
+                    continue
+                if address == back_edge and target == header:
+                    path = (cycles, cycles)
+                elif target is not None and address < target <= back_edge:
+                    rest = walk(target)
+                    if rest is None:
+                        continue
+                    path = (rest[0] + cycles, rest[1] + cycles)
+                else:
+                    continue
+                result = path if result is None else (max(result[0], path[0]), min(result[1], path[1]))
+        memo[address] = result
+        return result
+
+    return walk(header)
+
+
+class WorstCase:
+    """Longest path through code with bounded loops. Calls add the worst case of the callee."""
+
+    def __init__(self, code, functions, loop_bound, single_loops):
+        self.code = code
+        self.functions = functions
+        self.loop_bound = loop_bound
+        self.single_loops = single_loops  # waiting loops by design, counted once
+        self.excluded = set()
+        self.unknown = set()
+        self.function_cost = {}
+        self.loops = {}
+        for function in functions:
+            for header, back_edge in find_loops(code, function):
+                self.loops.setdefault(header, []).append(back_edge)
+
+    def loop_cost(self, header, entry):
+        """Additional cycles for the remaining iterations of loops starting at header, entered from entry"""
+        extra = 0
+        for back_edge in self.loops.get(header, []):
+            if header <= entry <= back_edge:
+                continue  # not entered from outside
+            iteration = loop_iteration(self.code, header, back_edge)
+            if iteration and header not in self.single_loops:
+                extra += (self.loop_bound - 1) * iteration[0]
+        return extra
+
+    def call_cost(self, instruction):
+        if instruction.mnemonic == 'icall' or instruction.target_symbol is None:
+            self.unknown.add('indirect call at 0x%04x' % instruction.address)
+            return 0
+        if instruction.target_symbol in BLOCKING_FUNCTIONS:
+            self.excluded.add(instruction.target_symbol)
+            return 0
+        return self.function(instruction.target_symbol)
+
+    def function(self, name):
+        if name not in self.function_cost:
+            self.function_cost[name] = 0  # recursion
+            self.function_cost[name] = self.path(self.functions[name], None) or 0
+        return self.function_cost[name]
+
+    def path(self, start, stop):
+        """Longest path from start to stop, or to a return if stop is None"""
+        memo = {}
+
+        def walk(address, previous):
+            if address == stop:
+                return 0
+            if address in memo:
+                return memo[address]
+            memo[address] = None  # in progress, a loop back edge
+            instruction = self.code.get(address)
+            result = None
+            if instruction is not None:
+                if instruction.mnemonic in ('ret', 'reti'):
+                    result = CYCLES[instruction.mnemonic] if stop is None else None
+                for target, cycles in successors(self.code, instruction):
+                    if target is None:
+                        continue
+                    if instruction.is_call():
+                        cycles += self.call_cost(instruction)
+                    rest = walk(target, address)
+                    if rest is None:
+                        continue
+                    rest += cycles
+                    if target != stop:
+                        rest += self.loop_cost(target, address)
+                    result = rest if result is None else max(result, rest)
+            memo[address] = result
+            return result
+
+        return walk(start, None)
+
+
+def main():
+    if len(sys.argv) < 2:
+        print('Usage: python CycleBudget.py F_CPU [--loop-bound N] <main.lss')
+        sys.exit(2)
+    f_cpu = float(sys.argv[1])
+    loop_bound = 8
+    if '--loop-bound' in sys.argv:
+        loop_bound = int(sys.argv[sys.argv.index('--loop-bound') + 1])
+
+    code, functions = read_listing(sys.stdin.readlines())
+    if 'main' not in functions:
+        print('CycleBudget: main() not found in the disassembly')
+        sys.exit(2)
+
+    failed = False
+    lines = []
+
+    def report(name, cycles, budget, exact=False):
+        status = 'ok'
+        if cycles > budget:
+            status = 'EXCEEDED'
+        elif exact and cycles < budget:
+            status = 'shorter than assumed, timing in main.c is off'
+        lines.append('  {:<18}{:6d} cycles {:8.1f} us   budget {:6d}   {}'.format(
+            name, cycles, cycles * 1e6 / f_cpu, budget, status))
+        return cycles > budget
+
+    # the wait loop is the loop with the conditional which leads to the call of USB_handler()
+    handler_calls = [i for i in code.values() if i.function == 'main' and i.is_call() and i.target_symbol == 'USB_handler']
+    loops = sorted(find_loops(code, 'main'), key=lambda loop: loop[1] - loop[0])
+    poll_loop = None
+    for header, back_edge in loops:
+        for address in range(header, back_edge + 2, 2):
+            instruction = code.get(address)
+            if instruction is None or not (instruction.is_branch() or instruction.mnemonic in SKIPS):
+                continue
+            for target, _ in successors(code, instruction):
+                for call in handler_calls:
+                    # the call follows within a few instructions or a jump
+                    step = code.get(target)
+                    for _ in range(4):
+                        if step is None:
+                            break
+                        if step is call:
+                            poll_loop = (header, back_edge)
+                        step = code.get(step.target if step.mnemonic == 'rjmp' else step.end())
+            if poll_loop:
+                break
+        if poll_loop:
+            break
+
+    if poll_loop is None:
+        print('CycleBudget: warning, the USB wait loop was not found, no budgets checked')
+        sys.exit(0)
+    iteration = loop_iteration(code, poll_loop[0], poll_loop[1], skip_rare=True, skip_calls=True)
+    failed |= report('poll loop', iteration[0], 15, exact=True)
+
+    # the resync loop is "sbis, ldi, subi, brne" of the inline assembler in main.c
+    resync_loops = []
+    for header, back_edge in loops:
+        mnemonics = [code[a].mnemonic for a in range(header, back_edge + 2, 2) if a in code]
+        if mnemonics == ['sbis', 'ldi', 'subi', 'brne']:
+            resync_loops.append(header)
+            resync = loop_iteration(code, header, back_edge)
+            failed |= report('resync loop', resync[0], 5, exact=True)
+    if not resync_loops:
+        lines.append('  resync loop not found')
+
+    # from the return of USB_handler() until the wait loop is entered again
+    worst = WorstCase(code, functions, loop_bound, resync_loops)
+    frame = int(f_cpu / 1000)
+    for call in handler_calls:
+        cycles = worst.path(call.end(), poll_loop[0])
+        if cycles is not None:
+            failed |= report('processing', cycles, frame)
+    for name in REPORTED_FUNCTIONS:
+        if name in functions:
+            failed |= report(name + '()', worst.function(name), frame)
+
+    print('Cycle budget at {:.1f} MHz, loops in the processing path counted {} times:'.format(f_cpu / 1e6, loop_bound))
+    for line in lines:
+        print(line)
+    if worst.excluded:
+        print('  not counted, blocking by design: ' + ', '.join(sorted(worst.excluded)))
+    for unknown in sorted(worst.unknown):
+        print('  warning, not counted: ' + unknown)
+    if failed:
+        print('CycleBudget: cycle budget exceeded, V-USB timing of this configuration is broken!')
+        sys.exit(1)
+
+
+main()
@@ -0,0 +1,218 @@
+# Explore the code size of configuration options of micronucleus
+#
+# Usage: python ExploreConfig.py CONFIG [--only NAME,NAME...] [--jobs N] [--csv FILE]
+#
+# Builds every combination of the options below, which the configuration supports, with "make auto-address"
+# and records code size, the lowest BOOTLOADER_ADDRESS and the free user flash.
+# The variants are built in build/explore/CONFIG/<number> with a modified copy of the configuration directory.
+# A variant which does not compile, does not fit or breaks the cycle budget of CycleBudget.py is reported as failed.
+#
+# The result is the Pareto front: the variants for which no other variant has at least the same free flash
+# and all of its features. Features are the option values other than the first one in OPTIONS.
+# Entry modes are alternatives and not features, so there is a front for each entry mode.
+
+import sys
+import os
+import re
+import shutil
+import itertools
+import subprocess
+from concurrent.futures import ThreadPoolExecutor
+
+# name, values with the value without feature first, where the option is set
+OPTIONS = [
+    ('ENABLE_UNSAFE_OPTIMIZATIONS', ['1', '0'], 'cflags'),
+    ('SAVE_MCUSR', ['0', '1'], 'flag'),
+    ('OSCCAL_SAVE_CALIB', ['0', '1'], 'value'),
+    ('OSCCAL_RESTORE_DEFAULT', ['0', '1'], 'value'),
+    ('FAST_EXIT_NO_USB_MS', ['0', '300'], 'value'),
+    ('LED_MODE', ['NONE', 'ACTIVE_HIGH'], 'value'),
+]
+CHOICES = [
+    ('ENTRYMODE', ['ENTRY_ALWAYS', 'ENTRY_WATCHDOG', 'ENTRY_EXT_RESET', 'ENTRY_JUMPER', 'ENTRY_POWER_ON',
+                   'ENTRY_D_MINUS_PULLUP_ACTIVATED_AND_ENTRY_POWER_ON',
+                   'ENTRY_D_MINUS_PULLUP_ACTIVATED_AND_ENTRY_EXT_RESET'], 'value'),
+]
+
+UNSAFE_CFLAGS = 'CFLAGS += -DENABLE_UNSAFE_OPTIMIZATIONS'
+
+
+def define_pattern(name):
+    return re.compile(r'^([ \t]*#[ \t]*define[ \t]+' + name + r'[ \t]+)(\S+)', re.MULTILINE)
+
+
+def flag_pattern(name, commented):
+    return re.compile(r'^[ \t]*' + (r'//[ \t]*' if commented else '') + r'#[ \t]*define[ \t]+' + name + r'[ \t]*$', re.MULTILINE)
+
+
+def current_value(option, header, makefile):
+    """Returns the value of the option in the configuration, or None if the configuration has not this option"""
+    name, values, kind = option
+    if kind == 'cflags':
+        return '1' if re.search(r'^[ \t]*' + re.escape(UNSAFE_CFLAGS), makefile, re.MULTILINE) else '0'
+    if kind == 'flag':
+        return '1' if flag_pattern(name, False).search(header) else '0'
+    match = define_pattern(name).search(header)
+    if match is None:
+        return None
+    if match.group(2) not in values:
+        values.append(match.group(2))
+    return match.group(2)
+
+
+def apply_value(option, value, header, makefile):
+    name, values, kind = option
+    if kind == 'cflags':
+        makefile = re.sub(r'^([ \t]*)(' + re.escape(UNSAFE_CFLAGS) + ')', r'\1#\2', makefile, flags=re.MULTILINE)
+        if value == '1':
+            makefile += '\n' + UNSAFE_CFLAGS + '\n'
+    elif kind == 'flag':
+        header = flag_pattern(name, False).sub('// #define ' + name, header)
+        if value == '1':
+            header += '\n#define ' + name + '\n'
+    else:
+        header = define_pattern(name).sub(lambda match: match.group(1) + value, header)
+    return header, makefile
+
+
+def read_config(path):
+    with open(os.path.join(path, 'bootloaderconfig.h')) as file:
+        header = file.read()
+    with open(os.path.join(path, 'Makefile.inc')) as file:
+        makefile = file.read()
+    return header, makefile
+
+
+def postscript_size(header):
+    """POSTSCRIPT_SIZE of main.c, the bytes below BOOTLOADER_ADDRESS which are not available for the user program"""
+    def value(name):
+        match = define_pattern(name).search(header)
+        return match.group(2) if match else '0'
+    if value('ENABLE_SERIAL_NUMBER') == '1':
+        return 6 + 2 + 2 * int(value('SERIAL_NUMBER_LEN'))
+    return 6 if value('OSCCAL_SAVE_CALIB') == '1' else 4
+
+
+def build(config, directory, header, makefile, start_address):
+    """Builds a variant, returns (code size, bootloader address) or None if the build failed"""
+    configpath = os.path.join(directory, 'config')
+    builddir = os.path.join(directory, 'build')
+    shutil.rmtree(directory, ignore_errors=True)
+    shutil.copytree(os.path.join('configuration', config), configpath)
+    with open(os.path.join(configpath, 'bootloaderconfig.h'), 'w') as file:
+        file.write(header)
+    with open(os.path.join(configpath, 'Makefile.inc'), 'w') as file:
+        file.write(makefile)
+
+    with open(os.path.join(directory, 'build.log'), 'w') as log:
+        result = subprocess.call(['make', '--no-print-directory', 'auto-address', 'CONFIG=' + config,
+                                  'CONFIGPATH=' + configpath, 'BUILDDIR=' + builddir,
+                                  'BOOTLOADER_ADDRESS={:X}'.format(start_address)],
+                                 stdout=log, stderr=subprocess.STDOUT)
+    if result != 0:
+        return None
+    size = subprocess.check_output(['avr-size', '-A', '-t', os.path.join(builddir, 'main.hex')]).decode()
+    codesize = int(re.search(r'^Total\s+(\d+)', size, re.MULTILINE).group(1))
+    with open(os.path.join(builddir, 'bootloader.h')) as file:
+        address = int(re.search(r'bootloader_address\s+0x([0-9a-fA-F]+)', file.read()).group(1), 16)
+    return codesize, address
+
+
+def dominates(a, b):
+    return a['free'] >= b['free'] and a['features'] >= b['features'] and \
+        (a['free'] > b['free'] or a['features'] > b['features'])
+
+
+def main():
+    arguments = sys.argv[1:]
+    if not arguments or arguments[0].startswith('-'):
+        print('Usage: python ExploreConfig.py CONFIG [--only NAME,NAME...] [--jobs N] [--csv FILE]')
+        sys.exit(2)
+    config = arguments[0]
+    only = None
+    jobs = os.cpu_count() or 1
+    csvfile = None
+    for index, argument in enumerate(arguments):
+        if argument == '--only':
+            only = arguments[index + 1].split(',')
+        elif argument == '--jobs':
+            jobs = int(arguments[index + 1])
+        elif argument == '--csv':
+            csvfile = arguments[index + 1]
+
+    header, makefile = read_config(os.path.join('configuration', config))
+    configured = int(re.search(r'^BOOTLOADER_ADDRESS\s*=\s*([0-9a-fA-F]+)', makefile, re.MULTILINE).group(1), 16)
+    # the first link is 1 KB lower, so variants with more features fit in the flash
+    start_address = max(configured - 0x400, 0)
+
+    options = []
+    current = {}
+    for option in OPTIONS + CHOICES:
+        value = current_value(option, header, makefile)
+        if value is None:
+            continue
+        current[option[0]] = value
+        if only is None or option[0] in only:
+            options.append(option)
+    names = [option[0] for option in options]
+
+    variants = []
+    for index, values in enumerate(itertools.product(*[option[1] for option in options])):
+        variant_header, variant_makefile = header, makefile
+        for option, value in zip(options, values):
+            variant_header, variant_makefile = apply_value(option, value, variant_header, variant_makefile)
+        variants.append({
+            'index': index,
+            'values': dict(zip(names, values)),
+            'features': frozenset((option[0], value) for option, value in zip(options, values)
+                                  if option in OPTIONS and value != option[1][0]),
+            'choice': tuple((option[0], value) for option, value in zip(options, values) if option in CHOICES),
+            'header': variant_header,
+            'makefile': variant_makefile,
+        })
+
+    print('Building {} variants of {} with {} jobs, varying {}'.format(len(variants), config, jobs, ', '.join(names)))
+
+    def run(variant):
+        directory = os.path.join('build', 'explore', config, str(variant['index']))
+        variant['result'] = build(config, directory, variant['header'], variant['makefile'], start_address)
+        if variant['result']:
+            variant['free'] = variant['result'][1] - postscript_size(variant['header'])
+        return variant
+
+    with ThreadPoolExecutor(max_workers=jobs) as executor:
+        list(executor.map(run, variants))
+    built = [variant for variant in variants if variant['result']]
+    print('{} variants built, {} failed, see build/explore/{}/<number>/build.log'.format(
+        len(built), len(variants) - len(built), config))
+
+    if csvfile:
+        with open(csvfile, 'w') as file:
+            file.write(','.join(['variant', 'codesize', 'address', 'free'] + names) + '\n')
+            for variant in variants:
+                result = variant['result']
+                columns = [str(variant['index'])]
+                columns += ['{}'.format(result[0]), '0x{:04X}'.format(result[1]), str(variant['free'])] if result \
+                    else ['failed', '', '']
+                file.write(','.join(columns + [variant['values'][name] for name in names]) + '\n')
+
+    choices = []
+    for variant in built:
+        if variant['choice'] not in choices:
+            choices.append(variant['choice'])
+    for choice in choices:
+        group = [variant for variant in built if variant['choice'] == choice]
+        front = [variant for variant in group if not any(dominates(other, variant) for other in group)]
+        front.sort(key=lambda variant: -variant['free'])
+        print()
+        print('Pareto front' + (' for ' + ' '.join('{}={}'.format(*item) for item in choice) if choice else '') + ':')
+        print('   free  address  codesize  features')
+        for variant in front:
+            is_current = all(current[name] == value for name, value in variant['values'].items())
+            print('  {:5d}   0x{:04X}     {:5d}  {}{}'.format(
+                variant['free'], variant['result'][1], variant['result'][0],
+                ' '.join('{}={}'.format(*item) for item in sorted(variant['features'])) or '-',
+                '  (current)' if is_current else ''))
+
+
+main()
@@ -206,6 +206,73 @@
 
 #define SAVE_MCUSR
 
+/*
+ *  Define application re-entry here.
+ *
+ *  ENABLE_APP_REENTRY  Set to 1 to allow a running V-USB application to enter the bootloader without reset.
+ *                      The bootloader then skips the 300 ms reconnect and the OSCCAL calibration and keeps the
+ *                      USB address of the application, so the host does not need to enumerate the device again.
+ *                      The application must use the same USB pins and must be calibrated. It enters the bootloader with:
+ *                      "cli(); GPIOR1 = usbDeviceAddr; GPIOR0 = 0x6D; asm volatile ("jmp <BOOTLOADER_ADDRESS>");"
+ *                      (rjmp for devices with 8 kByte flash or less). The micronucleus tool option --reentry VID:PID
+ *                      sends vendor request 0x6D to the application for this, which should then jump after the status
+ *                      stage is sent i.e. one or two milliseconds later from its main loop.
+ *                      Adds around 30 bytes.
+ */
+#define ENABLE_APP_REENTRY 0
+
+/*
+ *  ENABLE_SPM_SERVICE  Set to 1 to let the user program write its flash with the self programming code of the bootloader.
+ *                      The bootloader contains a jump to its service function at BOOTLOADER_ADDRESS + 2
+ *                      (+ 4 for devices with more than 8 kByte flash) with the prototype:
+ *                      void spmService(uint8_t aCommand, uint16_t aAddress, uint16_t aData);
+ *                      Commands are 0 = fill word of page buffer, 1 = erase page, 2 = write page.
+ *                      Addresses at or above BOOTLOADER_ADDRESS are not erased or written and the reset vector is always
+ *                      patched to the bootloader. Interrupts are disabled during the call. Usage from the user program:
+ *                      "((void (*)(uint8_t, uint16_t, uint16_t)) ((BOOTLOADER_ADDRESS + 2) / 2))(0, address, word);"
+ *                      Adds around 50 bytes.
+ */
+#define ENABLE_SPM_SERVICE 0
+
+/*
+ *  ENABLE_SHARED_USB_DRIVER  Set to 1 to let the user program use the low level V-USB driver of the bootloader
+ *                      instead of linking its own usbdrvasm.S. The bootloader contains jumps to USB_handler and
+ *                      usbCrc16Append at BOOTLOADER_ADDRESS + 4 and + 6 (+ 8 and + 12 for devices with jmp),
+ *                      followed by the ABI word USB_SHARED_ABI. The driver state is kept in the last 40 bytes
+ *                      of the RAM, the stack starts below it. See usbdrv/usbdrvshared.h for the fixed interface
+ *                      and usbdrv/usbdrvshared.c for the user program side. "make shared-usb-symbols" generates
+ *                      build/<configuration>/usbdrv_shared.ld with the addresses of the entries.
+ *                      Adds 6 bytes (10 bytes for devices with jmp), plus 2 (4) bytes if ENABLE_SPM_SERVICE is 0.
+ */
+#define ENABLE_SHARED_USB_DRIVER 0
+
+/*
+ *  ENABLE_SERIAL_NUMBER  Set to 1 to report a serial number string, which is written by the micronucleus tool
+ *                      with --set-serial and kept at every following upload. The string descriptor is stored in
+ *                      the postscript in front of OSCCAL and the user reset vector and reduces the size available
+ *                      for the user program by 2 + 2 * SERIAL_NUMBER_LEN bytes, plus 2 bytes if OSCCAL_SAVE_CALIB is 0.
+ *                      The postscript must fit into one flash page. An erase without upload clears the serial number.
+ *                      Adds around 30 bytes.
+ */
+#define ENABLE_SERIAL_NUMBER 0
+#define SERIAL_NUMBER_LEN    8 // characters
+
+/*
+ *  ENABLE_HEALTH_COUNTERS  Set to 1 to count host resets, received packets, resynchronisations after a packet
+ *                      collided with the main loop and dropped SETUP packets. The micronucleus tool reads them with
+ *                      the device info request with wValue 1 and prints them after the upload.
+ *                      Uses 8 bytes of RAM. Adds around 50 bytes.
+ */
+#define ENABLE_HEALTH_COUNTERS 0
+
+/*
+ *  ENABLE_EEPROM_WRITE  Set to 1 to write the EEPROM with the request cmd_write_eeprom, 2 bytes per request.
+ *                      The micronucleus tool reads the EEPROM size with the device info request with wValue 2 and
+ *                      writes the EEPROM with --eeprom after the upload in the same session.
+ *                      Adds around 70 bytes.
+ */
+#define ENABLE_EEPROM_WRITE 0
+
 /*
  * Define bootloader timeout value.
  *
@@ -219,6 +286,26 @@
  *  AUTO_EXIT_MS               The bootloader will exit after this delay if no USB communication from the host tool was received.
  *                             Set to 0 to disable -> never leave the bootloader except on receiving an exit command by USB.
  *
+ *  AUTO_EXIT_NO_SESSION_MS    The bootloader will exit after this delay if a USB host is connected, but no micronucleus host tool
+ *                             has sent a request since the last USB reset. Any request of the host tool, e.g. the keepalive
+ *                             sent while it waits, extends the timeout to AUTO_EXIT_MS again.
+ *                             This allows a short start delay for devices which are always plugged in.
+ *                             Set to 0 to disable. Must be smaller than AUTO_EXIT_MS and at least 1000, since the first
+ *                             request of the host tool may come 940 ms after the USB reset on slow hosts. The request which
+ *                             reads the device info at connect extends the timeout, so all versions of the host tool are
+ *                             supported. It is disabled in all shipped configurations, to keep the upload window of slow
+ *                             hosts and the size of the released hex files.
+ *                             Adds 8 bytes.
+ *
+ *  FAST_EXIT_NO_HOST          Set to 1 to check for a USB host before the initial 300 ms disconnect and connect.
+ *                             If no host is detected, the user program is started within a few microseconds.
+ *                             If no user program is loaded, the bootloader is always entered.
+ *                             The board must sense VBUS of the host on a pin and define usbHostPresent(), e.g.
+ *                             #define usbHostPresent() (PINB & _BV(PB0))
+ *                             There is no default check with the D+ line. The internal pullup against the 15k pulldown
+ *                             of the host gives a level which the AVR may read either way, and a wrong read would
+ *                             skip the bootloader while a host is connected.
+ *
  *  All values are approx. in milliseconds
  */
 
@@ -226,6 +313,8 @@
 // On my old HP laptop I have different timing: First reset is 220 ms after initial connecting to USB lasting 300 ms and the second is missing.
 #define FAST_EXIT_NO_USB_MS       0 // Values below 120 are ignored. Effective timeout is 300 + FAST_EXIT_NO_USB_MS.
 #define AUTO_EXIT_MS           6000
+#define AUTO_EXIT_NO_SESSION_MS   0 // e.g. 1500 for a short start delay if no host tool is running
+#define FAST_EXIT_NO_HOST         0
 
 /* ----------------------- Optional Timeout Config ------------------------ */
 
@@ -243,6 +332,13 @@
  *                            that this is only true if the ambient temperature does not change.
  *                            Adds ~38 bytes.
  *
+ *  OSCCAL_NEAR_SEARCH        Set this to '1' to search only the neighbourhood of the stored OSCCAL value after a USB reset,
+ *                            if the frame length measured with it is within +/-2 steps of the goal. Up to 2 steps towards
+ *                            the goal are tried and the best value is kept. Larger errors run the full tuning.
+ *                            Requires OSCCAL_SAVE_CALIB. Off in the shipped configurations, which keeps the release sizes.
+ *                            Adds 46 bytes (52 bytes if OSCCAL is not in the lower I/O space), counted from the
+ *                            instruction sizes.
+ *
  *  OSCCAL_HAVE_XTAL          Set this to '1' if you have an external crystal oscillator. In this case no attempt
  *                            will be made to calibrate the oscillator. You should deactivate both options above
  *                            if you use this to avoid redundant code.
@@ -260,6 +356,7 @@
 
 #define OSCCAL_RESTORE_DEFAULT 0
 #define OSCCAL_SAVE_CALIB 1
+#define OSCCAL_NEAR_SEARCH 0
 #define OSCCAL_HAVE_XTAL 0
 
 /*
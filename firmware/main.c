@@ -36,9 +36,40 @@
 #include <avr/pgmspace.h>
 #include <avr/wdt.h>
 #include <avr/boot.h>
+#include <avr/interrupt.h>
 #include <util/delay.h>
 
 #include "bootloaderconfig.h"
+
+#if ENABLE_EEPROM_WRITE
+#include <avr/eeprom.h>
+#endif
+
+#if ENABLE_HEALTH_COUNTERS
+// Health counters reply for cmd_device_info with wValue 1
+// Length: 8 bytes, 16 bit counters, low byte first, wrapping around
+//   Byte 0, 1: Host resets detected
+//   Byte 2, 3: USB packets received
+//   Byte 4, 5: Resynchronisations, because a packet collided with the processing in the main loop
+//   Byte 6, 7: SETUP packets dropped, because their length was not 8
+struct {
+    uint16_t resets;
+    uint16_t packets;
+    uint16_t resyncs;
+    uint16_t droppedSetups;
+} healthCounters;
+
+// usbMsgPtr values up to RAMEND are read from RAM, flash replies are all above the bootloader address
+#define USB_MSGPTR_RAM_END RAMEND
+#define USB_RX_USER_HOOK(data, len) if (usbRxToken == (uchar) USBPID_SETUP && len != 8) healthCounters.droppedSetups++;
+#  if BOOTLOADER_ADDRESS <= RAMEND
+#error "ENABLE_HEALTH_COUNTERS requires a BOOTLOADER_ADDRESS above RAMEND"
+#  endif
+#define HEALTH_COUNT(counter) healthCounters.counter++
+#else
+#define HEALTH_COUNT(counter)
+#endif
+
 #include "usbdrv/usbdrv.c"
 
 // Microcontroller vector table entries in the flash
@@ -51,8 +82,11 @@
 #endif
 
 // Postscript are the few bytes at the end of programmable memory which store user program reset vector and optionally OSCCAL calibration
+// and the serial number descriptor. With serial number, the OSCCAL bytes are always reserved to keep the layout fixed for the host tool.
 #ifndef POSTSCRIPT_SIZE
-#  if OSCCAL_SAVE_CALIB
+#  if ENABLE_SERIAL_NUMBER
+#define POSTSCRIPT_SIZE (BOOTLOADER_ADDRESS - USB_CFG_SERIAL_NUMBER_ADDRESS)
+#  elif OSCCAL_SAVE_CALIB
 #define POSTSCRIPT_SIZE TINYVECTOR_OSCCAL_OFFSET
 #  else
 #define POSTSCRIPT_SIZE TINYVECTOR_RESET_OFFSET
@@ -75,6 +109,14 @@
 #error "Micronucleus only supports pagesizes up to 256 bytes"
 #endif
 
+#if POSTSCRIPT_SIZE > SPM_PAGESIZE
+#error "The postscript must fit into the last page, reduce SERIAL_NUMBER_LEN"
+#endif
+
+#if (OSCCAL_NEAR_SEARCH && !OSCCAL_SAVE_CALIB)
+#error "OSCCAL_NEAR_SEARCH requires OSCCAL_SAVE_CALIB"
+#endif
+
 #if ((AUTO_EXIT_MS>0) && (AUTO_EXIT_MS<1000))
 #error "Do not set AUTO_EXIT_MS to below 1s to allow Micronucleus to function properly"
 #endif
@@ -83,6 +125,31 @@
 #warning "Values below 120 ms are not possible for FAST_EXIT_NO_USB_MS"
 #endif
 
+#if ((AUTO_EXIT_NO_SESSION_MS > 0) && (AUTO_EXIT_NO_SESSION_MS < 1000))
+#error "Do not set AUTO_EXIT_NO_SESSION_MS to below 1s, the host tool may need 940 ms after the USB reset to send its first request"
+#endif
+
+#if ((AUTO_EXIT_NO_SESSION_MS > 0) && ((AUTO_EXIT_MS == 0) || (AUTO_EXIT_NO_SESSION_MS >= AUTO_EXIT_MS)))
+#error "AUTO_EXIT_NO_SESSION_MS must be smaller than AUTO_EXIT_MS"
+#endif
+
+#if FAST_EXIT_NO_HOST
+#  if !defined(usbHostPresent)
+#error "FAST_EXIT_NO_HOST requires a usbHostPresent() in bootloaderconfig.h which senses VBUS of the host"
+#  endif
+#define bootLoaderHostCondition() usbHostPresent()
+#else
+#define bootLoaderHostCondition() 1
+#endif
+
+#if ENABLE_APP_REENTRY
+#  if !defined(GPIOR1)
+#error "ENABLE_APP_REENTRY requires the GPIOR0 and GPIOR1 registers"
+#  endif
+// Value in GPIOR0 which signals a jump from an enumerated and calibrated application, GPIOR1 contains the USB address
+#define APP_REENTRY_MAGIC 0x6D // not a possible MCUSR content, which may be stored in GPIOR0 by SAVE_MCUSR
+#endif
+
 // Device configuration reply
 // Length: 6 bytes
 //   Byte 0:  User program memory size, high byte
@@ -103,17 +170,41 @@ PROGMEM const uint8_t configurationReply[6] = {
   SIGNATURE_2
 };
 
+#if ENABLE_EEPROM_WRITE
+// EEPROM reply for cmd_device_info with wValue 2
+// Length: 3 bytes
+//   Byte 0:  EEPROM size, low byte
+//   Byte 1:  EEPROM size, high byte
+//   Byte 2:  Time in ms to wait after a cmd_write_eeprom, which writes up to 2 bytes
+#define EEPROM_WRITE_SLEEP 8
+
+PROGMEM const uint8_t eepromReply[3] = {
+  (E2END + 1) & 0xff,
+  (E2END + 1) >> 8,
+  EEPROM_WRITE_SLEEP
+};
+#endif
+
 typedef union {
     uint16_t w;
     uint8_t b[2];
 } uint16_union_t;
 
+#ifdef MICRONUCLEUS_NATIVE
+// The host build against the flash model of native/ has no register variables and no SPM instruction
+#define REGISTER_VARIABLE(type, name, reg) static type name __attribute__((unused))
+#define spmInstruction() flashModelSpm(currentAddress.w, 0)
+#else
+#define REGISTER_VARIABLE(type, name, reg) register type name asm(reg)
+#define spmInstruction() asm volatile("spm")
+#endif
+
 #if OSCCAL_RESTORE_DEFAULT
-  register uint8_t      osccal_default  asm("r2");
+  REGISTER_VARIABLE(uint8_t, osccal_default, "r2");
 #endif
 
-register uint16_union_t currentAddress asm("r4");  // r4/r5 current progmem address, used for erasing and writing
-register uint16_union_t idlePolls asm("r6");  // r6/r7 idle counter - each tick is 5 milliseconds
+REGISTER_VARIABLE(uint16_union_t, currentAddress, "r4");  // r4/r5 current progmem address, used for erasing and writing
+REGISTER_VARIABLE(uint16_union_t, idlePolls, "r6");  // r6/r7 idle counter - each tick is 5 milliseconds
 
 // command used to trigger functions to run in the main loop
 enum {
@@ -123,14 +214,25 @@ enum {
     cmd_erase_application = 2,
     cmd_write_data = 3,
     cmd_exit = 4,
+    cmd_keepalive = 5, // only resets the idle counter, which is done for every vendor request
+    cmd_write_eeprom = 6,
     cmd_write_page = 64  // internal commands start at 64
 };
-register uint8_t command asm("r3");  // bind command to r3
+REGISTER_VARIABLE(uint8_t, command, "r3");  // bind command to r3
+
+#if ENABLE_EEPROM_WRITE
+// wIndex and wValue of the last cmd_write_eeprom for the main loop
+static uint16_union_t eepromAddress;
+static uint16_union_t eepromData;
+#endif
 
 /* ------------------------------------------------------------------------ */
 static inline void eraseApplication(void);
 static void writeFlashPage(void);
 static void writeWordToPageBuffer(uint16_t data);
+#if ENABLE_EEPROM_WRITE
+static void writeEeprom(void);
+#endif
 static uint8_t usbFunctionSetup(uint8_t data[8]);
 static inline void leaveBootloader(void);
 void blinkLED(uint8_t aBlinkCount);
@@ -224,6 +326,64 @@ static void writeWordToPageBuffer(uint16_t data) {
     currentAddress.w += 2;
 }
 
+#if ENABLE_EEPROM_WRITE
+/*
+ * Write the low byte of eepromData to eepromAddress and the high byte to the next address.
+ * Bit 15 of the address requests only the low byte, for files of odd length.
+ * Bytes which are already equal are not written, to save time and EEPROM cycles.
+ * SPM is not possible while the EEPROM is written, so wait for the end of the write.
+ */
+static inline void writeEeprom(void) {
+    uint8_t *address = (uint8_t *) (uintptr_t) (eepromAddress.w & E2END);
+
+    eeprom_update_byte(address, eepromData.b[0]);
+    if (!(eepromAddress.b[1] & 0x80)) {
+        eeprom_update_byte(address + 1, eepromData.b[1]);
+    }
+    eeprom_busy_wait();
+}
+#endif
+
+#if ENABLE_SPM_SERVICE
+// Commands of the self programming service for the user program
+enum {
+    spm_fill_word = 0,
+    spm_erase_page = 1,
+    spm_write_page = 2
+};
+
+/*
+ * Self programming service for the user program, called by the XJMP at BOOTLOADER_ADDRESS + 2 or + 4 (see crt1.S).
+ * Uses the same functions as the bootloader itself, so the reset vector and OSCCAL are patched and
+ * the bootloader can not be erased or overwritten.
+ * currentAddress is in call saved registers of the user program, so it must be restored.
+ */
+void spmService(uint8_t aCommand, uint16_t aAddress, uint16_t aData) __attribute__((used));
+void spmService(uint8_t aCommand, uint16_t aAddress, uint16_t aData) {
+    uint16_t tSavedAddress = currentAddress.w;
+    uint8_t tSREG = SREG;
+    cli();
+    currentAddress.w = aAddress;
+    if (aCommand == spm_fill_word) {
+        writeWordToPageBuffer(aData);
+    } else if (aAddress < BOOTLOADER_ADDRESS) {
+        if (aCommand == spm_erase_page) {
+            boot_page_erase(aAddress);
+        } else if (aCommand == spm_write_page) {
+            currentAddress.w += 2;
+            writeFlashPage();
+        }
+#if (defined __AVR_ATmega328P__)||(defined __AVR_ATmega168P__)||(defined __AVR_ATmega88P__)||(defined __AVR_ATtiny828__)
+        // Enable the RWW section again, since the user program runs from there
+        boot_spm_busy_wait();
+        boot_rww_enable();
+#endif
+    }
+    currentAddress.w = tSavedAddress;
+    SREG = tSREG;
+}
+#endif
+
 /*
  * This function is called when the driver receives a SETUP transaction from
  * the host which is not answered by the driver itself (in practice: class and
@@ -249,6 +409,18 @@ static uint8_t usbFunctionSetup(uint8_t data[8]) {
 
     idlePolls.b[1] = 0; // reset high byte of idle counter when we get usb class or vendor requests to start a new timeout
     if (rq->bRequest == cmd_device_info) { // get device info
+#if ENABLE_HEALTH_COUNTERS
+        if (rq->wValue.bytes[0] == 1) {
+            usbMsgPtr = (usbMsgPtr_t) &healthCounters;
+            return sizeof(healthCounters);
+        }
+#endif
+#if ENABLE_EEPROM_WRITE
+        if (rq->wValue.bytes[0] == 2) {
+            usbMsgPtr = (usbMsgPtr_t) eepromReply;
+            return sizeof(eepromReply);
+        }
+#endif
         usbMsgPtr = (usbMsgPtr_t) configurationReply;
         return sizeof(configurationReply);
     } else if (rq->bRequest == cmd_transfer_page) {
@@ -269,7 +441,7 @@ static uint8_t usbFunctionSetup(uint8_t data[8]) {
             __SPM_REG=_BV(__SPM_ENABLE);
   #endif
 #endif
-            asm volatile("spm");
+            spmInstruction();
 
         }
     } else if (rq->bRequest == cmd_write_data) { // Write data
@@ -278,8 +450,15 @@ static uint8_t usbFunctionSetup(uint8_t data[8]) {
         if ((currentAddress.b[0] % SPM_PAGESIZE) == 0) {
             command = cmd_write_page; // ask main loop to write our page
         }
+#if ENABLE_EEPROM_WRITE
+    } else if (rq->bRequest == cmd_write_eeprom) {
+        // The EEPROM write takes too long for the SETUP packet, the main loop does it after the status stage
+        eepromAddress.w = rq->wIndex.word;
+        eepromData.w = rq->wValue.word;
+        command = cmd_write_eeprom;
+#endif
     } else {
-        // Handle cmd_erase_application and cmd_exit
+        // Handle cmd_erase_application, cmd_exit and cmd_keepalive
         command = rq->bRequest & 0x3f;
     }
     return 0;
@@ -325,6 +504,7 @@ static void reconnectAndInitUSB(void) {
     usbInit();    // Initialize interrupt settings after reconnect but let the global interrupt be disabled
 }
 
+#ifndef MICRONUCLEUS_NATIVE // the main loop polls the USB pins and is not part of the host build
 /* ------------------------------------------------------------------------ */
 // reset system to a normal state and launch user program
 __attribute__((__noreturn__)) static inline void leaveBootloader(void) {
@@ -361,6 +541,12 @@ int main(void) {
     // bootLoaderInit() is a Macro defined in bootloaderconfig.h and mainly empty except for ENTRY_JUMPER, where it sets the pullup and waits 1 ms.
     bootLoaderInit();
 
+#if ENABLE_APP_REENTRY
+    // Read and clear the flag, so a following reset will not use the stale application state
+    uint8_t tAppReentry = (GPIOR0 == APP_REENTRY_MAGIC);
+    GPIOR0 = 0;
+#endif
+
     /* save default OSCCAL calibration  */
 #if OSCCAL_RESTORE_DEFAULT
   osccal_default = OSCCAL;
@@ -369,20 +555,39 @@ int main(void) {
 #if OSCCAL_SAVE_CALIB
     // Adjust clock to previous calibration value, so bootloader AND User program starts with proper clock calibration, even when not connected to USB
     unsigned char stored_osc_calibration = pgm_read_byte(BOOTLOADER_ADDRESS - TINYVECTOR_OSCCAL_OFFSET);
+#  if ENABLE_APP_REENTRY
+    if (stored_osc_calibration != 0xFF && !tAppReentry) { // the application is already calibrated by USB
+#  else
     if (stored_osc_calibration != 0xFF) {
+#  endif
         OSCCAL = stored_osc_calibration;
         // we changed clock so "wait" for one cycle
         asm volatile("nop");
     }
 #endif
     // bootLoaderStartCondition() is a Macro defined in bootloaderconfig.h and mainly is set to true or checks a bit in MCUSR
-    if (bootLoaderStartCondition() || (pgm_read_byte(BOOTLOADER_ADDRESS - TINYVECTOR_RESET_OFFSET + 1) == 0xff)) {
+    // bootLoaderHostCondition() is only evaluated for FAST_EXIT_NO_HOST and skips the 300 ms reconnect if no USB host is connected
+#if ENABLE_APP_REENTRY
+    if (tAppReentry || (bootLoaderStartCondition() && bootLoaderHostCondition())
+#else
+    if ((bootLoaderStartCondition() && bootLoaderHostCondition())
+#endif
+            || (pgm_read_byte(BOOTLOADER_ADDRESS - TINYVECTOR_RESET_OFFSET + 1) == 0xff)) {
         /*
          * Here boot condition matches or vector table is empty / no program loaded
          */
 
         inactivateWatchdog(); // Sets at least watchdog timeout to 2 seconds.
 
+#if ENABLE_APP_REENTRY
+        if (tAppReentry) {
+            // The host still sees the enumerated application, so keep its address and skip the 300 ms reconnect
+            usbInit();
+            usbRxLen = 0;
+            usbDeviceAddr = GPIOR1;
+            usbNewDeviceAddr = GPIOR1;
+        } else
+#endif
         reconnectAndInitUSB(); // USB disconnect by disabling pullup resistor by pull down D-, wait 300ms and reconnect, and enable USB interrupts
 
         LED_INIT(); // Set LED pin to output, if LED exists
@@ -435,6 +640,7 @@ int main(void) {
                     // init 2 V-USB variables as done before in reset handling of usbpoll()
                     usbNewDeviceAddr = 0;
                     usbDeviceAddr = 0;
+                    HEALTH_COUNT(resets);
 
 #if (OSCCAL_HAVE_XTAL == 0)
                     /*
@@ -444,7 +650,10 @@ int main(void) {
                      */
                     tuneOsccal();
 #endif
-#if (FAST_EXIT_NO_USB_MS > 0)
+#if (AUTO_EXIT_NO_SESSION_MS > 0)
+                    // Exit after AUTO_EXIT_NO_SESSION_MS if no micronucleus host tool sends a request or keepalive
+                    idlePolls.w = ((AUTO_EXIT_MS - AUTO_EXIT_NO_SESSION_MS) / 5);
+#elif (FAST_EXIT_NO_USB_MS > 0)
                     // I measured 350 ms (940 ms on my old Linux laptop) from here to the configurationReply request
                     idlePolls.w = ((AUTO_EXIT_MS - 1200) / 5); // Allow another 1200 ms for micronucleus to request configurationReply
 #endif
@@ -453,6 +662,7 @@ int main(void) {
                 if (USB_INTR_PENDING & (_BV(USB_INTR_PENDING_BIT))) {
                     USB_handler(); // call V-USB driver for USB receiving
                     USB_INTR_PENDING = _BV(USB_INTR_PENDING_BIT); // Clear int pending, in case timeout occurred during SYNC
+                    HEALTH_COUNT(packets);
                     /*
                      * readme for 2.04 says: If you activate it, idlepolls is only reset when traffic to the current endpoint is detected.
                      * This will let micronucleus timeout also when traffic from other USB devices is present on the bus,
@@ -480,6 +690,11 @@ int main(void) {
             if (command == cmd_write_page) {
                 writeFlashPage();
             }
+#if ENABLE_EEPROM_WRITE
+            if (command == cmd_write_eeprom) {
+                writeEeprom();
+            }
+#endif
 #if OSCCAL_SLOW_PROGRAMMING
             OSCCAL      = osccal_tmp;
 #endif
@@ -549,6 +764,7 @@ int main(void) {
                         : "M" ((uint8_t)(8.8f*(F_CPU/1.0e6f)/5.0f+0.5)), "I" (_SFR_IO_ADDR(USBIN)), "M" (USB_CFG_DMINUS_BIT)
                 );
                 USB_INTR_PENDING = _BV(USB_INTR_PENDING_BIT);
+                HEALTH_COUNT(resyncs);
             }
         } while (1);
 
@@ -586,6 +802,7 @@ int main(void) {
 
     leaveBootloader();
 }
+#endif
 
 /*
  * For debugging purposes
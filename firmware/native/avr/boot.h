@@ -0,0 +1,31 @@
+/* Name: boot.h
+ * Project: Micronucleus
+ * License: GNU GPL v2 (see License.txt)
+ *
+ * Replacement of <avr/boot.h> for the host build of main.c, see native/Readme.md.
+ * Like avr-libc, the macros write the command to SPMCSR and execute SPM, which is
+ * flashModelSpm() of the flash model.
+ */
+
+#ifndef __native_avr_boot_h_included__
+#define __native_avr_boot_h_included__
+
+#include <avr/io.h>
+#include "flashmodel.h"
+
+#define __SPM_REG SPMCSR
+#define __SPM_ENABLE SPMEN
+#define SELFPRGEN SPMEN
+
+#define boot_page_fill(address, data) (__SPM_REG = _BV(SPMEN), flashModelSpm((address), (data)))
+#define boot_page_erase(address) (__SPM_REG = _BV(PGERS) | _BV(SPMEN), flashModelSpm((address), 0))
+#define boot_page_write(address) (__SPM_REG = _BV(PGWRT) | _BV(SPMEN), flashModelSpm((address), 0))
+#ifdef RWWSRE
+#define boot_rww_enable() (__SPM_REG = _BV(RWWSRE) | _BV(SPMEN), flashModelSpm(0, 0))
+#endif
+
+// the flash model completes an operation at once and only adds its time to the statistics
+#define boot_spm_busy() 0
+#define boot_spm_busy_wait()
+
+#endif /* __native_avr_boot_h_included__ */
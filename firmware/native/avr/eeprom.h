@@ -0,0 +1,20 @@
+/* Name: eeprom.h
+ * Project: Micronucleus
+ * License: GNU GPL v2 (see License.txt)
+ *
+ * Replacement of <avr/eeprom.h> for the host build of main.c, see native/Readme.md.
+ * Writes go to the EEPROM of the flash model.
+ */
+
+#ifndef __native_avr_eeprom_h_included__
+#define __native_avr_eeprom_h_included__
+
+#include <avr/io.h>
+#include "flashmodel.h"
+
+#define eeprom_update_byte(address, value) flashModelEepromUpdate((uintptr_t) (address), (value))
+
+// the flash model completes a write at once and only adds its time to the statistics
+#define eeprom_busy_wait()
+
+#endif /* __native_avr_eeprom_h_included__ */
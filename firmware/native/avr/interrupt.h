@@ -0,0 +1,16 @@
+/* Name: interrupt.h
+ * Project: Micronucleus
+ * License: GNU GPL v2 (see License.txt)
+ *
+ * Replacement of <avr/interrupt.h> for the host build of main.c, see native/Readme.md.
+ */
+
+#ifndef __native_avr_interrupt_h_included__
+#define __native_avr_interrupt_h_included__
+
+#include <avr/io.h>
+
+#define cli() (SREG &= 0x7F)
+#define sei() (SREG |= 0x80)
+
+#endif /* __native_avr_interrupt_h_included__ */
@@ -0,0 +1,221 @@
+/* Name: io.h
+ * Project: Micronucleus
+ * License: GNU GPL v2 (see License.txt)
+ *
+ * Replacement of <avr/io.h> for the host build of main.c, see native/Readme.md.
+ * The I/O registers are variables. The register set is the union of the registers used by the
+ * configurations, only registers which main.c tests with #ifdef are defined for their devices alone.
+ * The device is selected by -DNATIVE_DEVICE_<DEVICE of Makefile.inc>.
+ */
+
+#ifndef __native_avr_io_h_included__
+#define __native_avr_io_h_included__
+
+#include <stdint.h>
+
+#if defined(NATIVE_DEVICE_attiny85)
+#define __AVR_ATtiny85__
+#define FLASHEND 0x1FFF
+#define RAMEND 0x25F
+#define E2END 0x1FF
+#define SPM_PAGESIZE 64
+#define SIGNATURE_1 0x93
+#define SIGNATURE_2 0x0B
+#elif defined(NATIVE_DEVICE_attiny45)
+#define __AVR_ATtiny45__
+#define FLASHEND 0x0FFF
+#define RAMEND 0x15F
+#define E2END 0xFF
+#define SPM_PAGESIZE 64
+#define SIGNATURE_1 0x92
+#define SIGNATURE_2 0x06
+#elif defined(NATIVE_DEVICE_attiny84)
+#define __AVR_ATtiny84__
+#define FLASHEND 0x1FFF
+#define RAMEND 0x25F
+#define E2END 0x1FF
+#define SPM_PAGESIZE 64
+#define SIGNATURE_1 0x93
+#define SIGNATURE_2 0x0C
+#elif defined(NATIVE_DEVICE_attiny841)
+#define __AVR_ATtiny841__
+#define FLASHEND 0x1FFF
+#define RAMEND 0x2FF
+#define E2END 0x1FF
+#define SPM_PAGESIZE 16
+#define SIGNATURE_1 0x93
+#define SIGNATURE_2 0x15
+#elif defined(NATIVE_DEVICE_attiny167)
+#define __AVR_ATtiny167__
+#define FLASHEND 0x3FFF
+#define RAMEND 0x2FF
+#define E2END 0x1FF
+#define SPM_PAGESIZE 128
+#define SIGNATURE_1 0x94
+#define SIGNATURE_2 0x87
+#elif defined(NATIVE_DEVICE_attiny4313)
+#define __AVR_ATtiny4313__
+#define FLASHEND 0x0FFF
+#define RAMEND 0x15F
+#define E2END 0xFF
+#define SPM_PAGESIZE 64
+#define SIGNATURE_1 0x92
+#define SIGNATURE_2 0x0D
+#elif defined(NATIVE_DEVICE_attiny88)
+#define __AVR_ATtiny88__
+#define FLASHEND 0x1FFF
+#define RAMEND 0x2FF
+#define E2END 0x3F
+#define SPM_PAGESIZE 64
+#define SIGNATURE_1 0x93
+#define SIGNATURE_2 0x11
+#elif defined(NATIVE_DEVICE_atmega168p)
+#define __AVR_ATmega168P__
+#define FLASHEND 0x3FFF
+#define RAMEND 0x4FF
+#define E2END 0x1FF
+#define SPM_PAGESIZE 128
+#define SIGNATURE_1 0x94
+#define SIGNATURE_2 0x0B
+#elif defined(NATIVE_DEVICE_atmega328p)
+#define __AVR_ATmega328P__
+#define FLASHEND 0x7FFF
+#define RAMEND 0x8FF
+#define E2END 0x3FF
+#define SPM_PAGESIZE 128
+#define SIGNATURE_1 0x95
+#define SIGNATURE_2 0x0F
+#else
+#error "Unknown device, add it to native/avr/io.h"
+#endif
+
+#define SIGNATURE_0 0x1E
+
+#define _BV(bit) (1 << (bit))
+#define _SFR_IO_ADDR(sfr) 0 // only used for inline assembler, which is not compiled natively
+
+// Registers
+#define NATIVE_REGISTERS(X) \
+    X(PINA) X(PORTA) X(DDRA) X(PINB) X(PORTB) X(DDRB) X(PINC) X(PORTC) X(DDRC) X(PIND) X(PORTD) X(DDRD) \
+    X(GIMSK) X(GIFR) X(PCICR) X(PCIFR) X(PCMSK) X(PCMSK0) X(PCMSK1) X(PCMSK2) \
+    X(EIMSK) X(EIFR) X(EICRA) X(GICR) X(MCUCR) X(MCUSR) X(OSCCAL) X(OSCCAL0) X(SREG) X(SPMCSR) \
+    X(GPIOR0) X(GPIOR1) X(GPIOR2) X(WDTCR) X(WDTCSR) X(CCP)
+
+#define NATIVE_DECLARE_REGISTER(name) extern volatile uint8_t native##name;
+NATIVE_REGISTERS(NATIVE_DECLARE_REGISTER)
+
+#define PINA native##PINA
+#define PORTA native##PORTA
+#define DDRA native##DDRA
+#define PINB native##PINB
+#define PORTB native##PORTB
+#define DDRB native##DDRB
+#define PINC native##PINC
+#define PORTC native##PORTC
+#define DDRC native##DDRC
+#define PIND native##PIND
+#define PORTD native##PORTD
+#define DDRD native##DDRD
+#define GIMSK native##GIMSK
+#define GIFR native##GIFR
+#define PCICR native##PCICR
+#define PCIFR native##PCIFR
+#define PCMSK native##PCMSK
+#define PCMSK0 native##PCMSK0
+#define PCMSK1 native##PCMSK1
+#define PCMSK2 native##PCMSK2
+#define EIMSK native##EIMSK
+#define EIFR native##EIFR
+#define EICRA native##EICRA
+#define GICR native##GICR
+#define MCUCR native##MCUCR
+#define MCUSR native##MCUSR
+#define OSCCAL native##OSCCAL
+#define OSCCAL0 native##OSCCAL0
+#define SREG native##SREG
+#define SPMCSR native##SPMCSR
+#define GPIOR0 native##GPIOR0
+#define GPIOR1 native##GPIOR1
+#define GPIOR2 native##GPIOR2
+
+// main.c selects the watchdog unlock sequence by these registers
+#if defined(__AVR_ATtiny841__)
+#define CCP native##CCP
+#define WDTCSR native##WDTCSR
+#elif defined(__AVR_ATtiny85__) || defined(__AVR_ATtiny45__)
+#define WDTCR native##WDTCR
+#else
+#define WDTCSR native##WDTCSR
+#endif
+
+// Bits
+#define PA0 0
+#define PA1 1
+#define PA2 2
+#define PA3 3
+#define PA4 4
+#define PA5 5
+#define PA6 6
+#define PA7 7
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PB6 6
+#define PB7 7
+#define PC0 0
+#define PC1 1
+#define PC2 2
+#define PC3 3
+#define PC4 4
+#define PC5 5
+#define PC6 6
+#define PC7 7
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PD6 6
+#define PD7 7
+
+#define PCIE 5
+#define PCIE0 0
+#define PCIE1 1
+#define PCIE2 2
+#define PCIF 5
+#define PCIF0 0
+#define PCIF1 1
+#define PCIF2 2
+#define INT0 6
+#define INTF0 6
+#define ISC00 0
+#define ISC01 1
+
+#define PORF 0
+#define EXTRF 1
+#define BORF 2
+#define WDRF 3
+
+#define WDP0 0
+#define WDP1 1
+#define WDP2 2
+#define WDE 3
+#define WDCE 4
+#define WDP3 5
+#define WDIE 6
+
+#define SPMEN 0
+#define PGERS 1
+#define PGWRT 2
+#define RFLB 3
+#if defined(__AVR_ATmega168P__) || defined(__AVR_ATmega328P__)
+#define RWWSRE 4
+#else
+#define CTPB 4
+#endif
+
+#endif /* __native_avr_io_h_included__ */
@@ -0,0 +1,23 @@
+/* Name: pgmspace.h
+ * Project: Micronucleus
+ * License: GNU GPL v2 (see License.txt)
+ *
+ * Replacement of <avr/pgmspace.h> for the host build of main.c, see native/Readme.md.
+ * PROGMEM data stays in host memory, so pgm_read_byte() gets flash addresses like
+ * BOOTLOADER_ADDRESS - TINYVECTOR_RESET_OFFSET and host pointers to PROGMEM variables.
+ * flashModelRead() tells them apart, since Linux maps nothing below 64 KB.
+ */
+
+#ifndef __native_avr_pgmspace_h_included__
+#define __native_avr_pgmspace_h_included__
+
+#include <stdint.h>
+#include "flashmodel.h"
+
+#define PROGMEM
+#define PSTR(s) (s)
+
+#define pgm_read_byte(address) flashModelRead((uintptr_t) (address))
+#define pgm_read_word(address) (pgm_read_byte(address) | (pgm_read_byte((uintptr_t) (address) + 1) << 8))
+
+#endif /* __native_avr_pgmspace_h_included__ */
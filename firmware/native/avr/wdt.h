@@ -0,0 +1,14 @@
+/* Name: wdt.h
+ * Project: Micronucleus
+ * License: GNU GPL v2 (see License.txt)
+ *
+ * Replacement of <avr/wdt.h> for the host build of main.c, see native/Readme.md.
+ */
+
+#ifndef __native_avr_wdt_h_included__
+#define __native_avr_wdt_h_included__
+
+#define wdt_reset()
+#define wdt_disable()
+
+#endif /* __native_avr_wdt_h_included__ */
@@ -0,0 +1,153 @@
+/* Name: flashmodel.c
+ * Project: Micronucleus
+ * License: GNU GPL v2 (see License.txt)
+ *
+ * Model of the self programming flash for the host build of main.c, see native/Readme.md.
+ */
+
+#include <string.h>
+#include "flashmodel.h"
+
+#define NATIVE_DEFINE_REGISTER(name) volatile uint8_t native##name;
+NATIVE_REGISTERS(NATIVE_DEFINE_REGISTER)
+
+flashModel_t flashModel;
+
+static void clearPageBuffer(void) {
+    memset(flashModel.pageBuffer, 0xFF, sizeof(flashModel.pageBuffer));
+    memset(flashModel.filled, 0, sizeof(flashModel.filled));
+    flashModel.bufferPage = -1;
+}
+
+void flashModelReset(void) {
+    memset(&flashModel, 0, sizeof(flashModel));
+    memset(flashModel.flash, 0xFF, sizeof(flashModel.flash));
+    memset(flashModel.eeprom, 0xFF, sizeof(flashModel.eeprom));
+    clearPageBuffer();
+}
+
+static void erasePage(uint16_t address) {
+    uint16_t eraseSize = SPM_PAGESIZE * FLASHMODEL_ERASE_PAGES;
+    uint16_t start = address & ~(eraseSize - 1);
+    uint16_t page;
+
+    if (address != start) {
+        flashModel.unalignedErases++;
+    }
+    if ((uint32_t) start + eraseSize > BOOTLOADER_ADDRESS) {
+        flashModel.bootloaderWrites++;
+    }
+    memset(&flashModel.flash[start], 0xFF, eraseSize);
+    for (page = start / SPM_PAGESIZE; page < (start + eraseSize) / SPM_PAGESIZE; page++) {
+        flashModel.eraseCycles[page]++;
+    }
+    flashModel.pageErases++;
+    flashModel.programmingMicros += FLASHMODEL_SPM_US;
+}
+
+static void writePage(uint16_t address) {
+    uint16_t start = address & ~(SPM_PAGESIZE - 1);
+    uint16_t i;
+
+    if (flashModel.bufferPage >= 0 && flashModel.bufferPage != start) {
+        flashModel.pageMismatches++;
+    }
+    if (start >= BOOTLOADER_ADDRESS) {
+        flashModel.bootloaderWrites++;
+    }
+    for (i = 0; i < SPM_PAGESIZE; i++) {
+        // programming only clears bits
+        if (flashModel.pageBuffer[i] & ~flashModel.flash[start + i]) {
+            flashModel.unerasedWrites++;
+            break;
+        }
+    }
+    for (i = 0; i < SPM_PAGESIZE; i++) {
+        flashModel.flash[start + i] &= flashModel.pageBuffer[i];
+    }
+    flashModel.pageWrites++;
+    flashModel.programmingMicros += FLASHMODEL_SPM_US;
+    clearPageBuffer(); // the buffer is cleared after a page write
+}
+
+static void fillWord(uint16_t address, uint16_t data) {
+    uint8_t word = (address % SPM_PAGESIZE) / 2;
+
+    if (flashModel.filled[word]) {
+        flashModel.doubleFills++;
+        return;
+    }
+    flashModel.filled[word] = 1;
+    flashModel.pageBuffer[word * 2] = data;
+    flashModel.pageBuffer[word * 2 + 1] = data >> 8;
+    flashModel.bufferPage = address & ~(SPM_PAGESIZE - 1);
+}
+
+void flashModelSpm(uint16_t address, uint16_t data) {
+    uint8_t command = SPMCSR;
+
+    SPMCSR = 0; // SPMEN is cleared when the operation is complete
+    if (!(command & _BV(SPMEN))) {
+        return;
+    }
+    if (command & _BV(PGERS)) {
+        erasePage(address);
+    } else if (command & _BV(PGWRT)) {
+        writePage(address);
+#ifdef CTPB
+    } else if (command & _BV(CTPB)) {
+#else
+    } else if (command & _BV(RWWSRE)) {
+#endif
+        clearPageBuffer();
+        flashModel.bufferClears++;
+    } else if (!(command & _BV(RFLB))) {
+        fillWord(address, data);
+    }
+}
+
+void flashModelEepromUpdate(uintptr_t address, uint8_t value) {
+    if (address > E2END) {
+        flashModel.eepromOverflows++;
+        address &= E2END;
+    }
+    if (flashModel.eeprom[address] != value) {
+        flashModel.eeprom[address] = value;
+        flashModel.eepromWrites++;
+        flashModel.eepromMicros += FLASHMODEL_EEPROM_US;
+    }
+}
+
+uint8_t flashModelRead(uintptr_t address) {
+    if (address <= FLASHEND) {
+        return flashModel.flash[address];
+    }
+    return *(const uint8_t *) address;
+}
+
+uint32_t flashModelMisuses(void) {
+    return flashModel.doubleFills + flashModel.pageMismatches + flashModel.unerasedWrites
+            + flashModel.bootloaderWrites + flashModel.unalignedErases + flashModel.eepromOverflows;
+}
+
+void flashModelPrintStatistics(FILE *file) {
+    uint32_t minimum = UINT32_MAX, maximum = 0;
+    uint16_t page;
+
+    for (page = 0; page < BOOTLOADER_ADDRESS / SPM_PAGESIZE; page++) {
+        if (flashModel.eraseCycles[page] < minimum) minimum = flashModel.eraseCycles[page];
+        if (flashModel.eraseCycles[page] > maximum) maximum = flashModel.eraseCycles[page];
+    }
+    fprintf(file, "Flash: %u page erases, %u page writes, %u buffer clears, %llu us programming time\n",
+            flashModel.pageErases, flashModel.pageWrites, flashModel.bufferClears,
+            (unsigned long long) flashModel.programmingMicros);
+    if (flashModel.eepromWrites || flashModel.eepromOverflows) {
+        fprintf(file, "EEPROM: %u bytes written, %llu us programming time, %u writes above E2END\n",
+                flashModel.eepromWrites, (unsigned long long) flashModel.eepromMicros, flashModel.eepromOverflows);
+    }
+    fprintf(file, "Erase cycles per application page: %u to %u\n", minimum, maximum);
+    fprintf(file, "Misuse: %u double fills, %u page mismatches, %u writes to unerased flash, "
+            "%u bootloader writes, %u unaligned erases\n",
+            flashModel.doubleFills, flashModel.pageMismatches, flashModel.unerasedWrites,
+            flashModel.bootloaderWrites, flashModel.unalignedErases);
+}
@@ -0,0 +1,71 @@
+/* Name: flashmodel.h
+ * Project: Micronucleus
+ * License: GNU GPL v2 (see License.txt)
+ *
+ * Model of the self programming flash for the host build of main.c, see native/Readme.md.
+ * Executes the SPM commands like the datasheets describe them and counts what they cost
+ * and what would go wrong on the device.
+ */
+
+#ifndef __flashmodel_h_included__
+#define __flashmodel_h_included__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <avr/io.h>
+
+#if defined(__AVR_ATtiny841__)
+#define FLASHMODEL_ERASE_PAGES 4 // the page erase erases 4 pages at once
+#else
+#define FLASHMODEL_ERASE_PAGES 1
+#endif
+#define FLASHMODEL_PAGES ((FLASHEND + 1) / SPM_PAGESIZE)
+#define FLASHMODEL_SPM_US 4500 // maximum page erase and page write time of the datasheets
+#define FLASHMODEL_EEPROM_US 3400 // erase and write of an EEPROM byte
+
+typedef struct {
+    uint8_t flash[FLASHEND + 1];
+    uint8_t pageBuffer[SPM_PAGESIZE];   // temporary page buffer, all 0xFF after a clear
+    uint8_t filled[SPM_PAGESIZE / 2];   // words written to the buffer since the last clear
+    int32_t bufferPage;                 // page address of the last fill, -1 if the buffer is empty
+
+    uint32_t eraseCycles[FLASHMODEL_PAGES];
+    uint32_t pageErases;
+    uint32_t pageWrites;
+    uint32_t bufferClears;
+    uint64_t programmingMicros;         // time the CPU is halted by page erase and page write
+
+    uint8_t eeprom[E2END + 1];
+    uint32_t eepromWrites;              // bytes which changed, eeprom_update_byte() skips equal bytes
+    uint64_t eepromMicros;
+
+    // misuse, each of these corrupts the flash or wears it out on the device
+    uint32_t doubleFills;               // word written twice without clearing the buffer, the second write is lost
+    uint32_t pageMismatches;            // page write to another page than the one the buffer was filled for
+    uint32_t unerasedWrites;            // page write which would have to program a 0 back to 1
+    uint32_t bootloaderWrites;          // page erase or page write at or above BOOTLOADER_ADDRESS
+    uint32_t unalignedErases;           // page erase address is not at the start of an erase unit
+    uint32_t eepromOverflows;           // EEPROM address above E2END, which wraps around on the device
+} flashModel_t;
+
+extern flashModel_t flashModel;
+
+// Erased flash and empty page buffer, statistics cleared
+void flashModelReset(void);
+
+// Executes the command in SPMCSR like the SPM instruction with Z = address and r1:r0 = data
+void flashModelSpm(uint16_t address, uint16_t data);
+
+// eeprom_update_byte()
+void flashModelEepromUpdate(uintptr_t address, uint8_t value);
+
+// pgm_read_byte() of a flash address or of a host pointer to PROGMEM data
+uint8_t flashModelRead(uintptr_t address);
+
+// Programming time, erase cycles and misuse counters
+void flashModelPrintStatistics(FILE *file);
+
+// Number of misuses of all kinds
+uint32_t flashModelMisuses(void);
+
+#endif /* __flashmodel_h_included__ */
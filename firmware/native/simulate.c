@@ -0,0 +1,310 @@
+/* Name: simulate.c
+ * Project: Micronucleus
+ * License: GNU GPL v2 (see License.txt)
+ *
+ * Host build of main.c against the flash model, see native/Readme.md.
+ * Uploads a program with the requests of the micronucleus command line tool, calling
+ * usbFunctionSetup() for each SETUP packet and executing the command like the main loop.
+ * Checks the flash content afterwards and prints the statistics of the flash model.
+ *
+ * Usage: simulate [file.hex | file.bin]
+ * Without a file, a program which fills the whole user flash is uploaded.
+ * Exits with 1 if the flash content is wrong or the flash was misused.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../main.c"
+
+#define USB_REQUEST_MICROS 2000 // a control transfer without data takes two frames of the low speed bus
+
+static uint8_t program[FLASHEND + 1];
+static uint16_t programSize;
+
+static uint32_t setupPackets;
+static uint64_t firmwareNanos;
+
+static uint64_t nanos(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * Processes a vendor request like V-USB and the main loop of main.c: usbFunctionSetup() is called
+ * for the SETUP packet and the command is executed after the status stage.
+ * Returns the length of the reply, which is copied to reply.
+ */
+static uint8_t sendRequest(uint8_t direction, uint8_t request, uint16_t value, uint16_t index, uint8_t *reply, uint8_t length) {
+    uint8_t setup[8] = { direction | USBRQ_TYPE_VENDOR, request, value, value >> 8, index, index >> 8, length, 0 };
+    uint64_t start = nanos();
+    uint8_t replyLength = usbFunctionSetup(setup);
+
+    if (replyLength > length) {
+        replyLength = length;
+    }
+    if (replyLength > 0) {
+        usbDeviceRead(reply, replyLength);
+    }
+    if (command == cmd_erase_application) {
+        eraseApplication();
+    }
+    if (command == cmd_write_page) {
+        writeFlashPage();
+    }
+#if ENABLE_EEPROM_WRITE
+    if (command == cmd_write_eeprom) {
+        writeEeprom();
+    }
+#endif
+    if (command != cmd_exit) {
+        command = cmd_local_nop;
+    }
+    firmwareNanos += nanos() - start;
+    setupPackets++;
+    return replyLength;
+}
+
+#if ENABLE_EEPROM_WRITE
+#define EEPROM_TEST_START 1   // odd start and length use both the 2 byte and the 1 byte write
+#define EEPROM_TEST_LENGTH 37
+
+/*
+ * Writes a pattern to the EEPROM like "micronucleus --eeprom" and a second time, when
+ * eeprom_update_byte() must not write anything. Returns the number of errors.
+ */
+static uint16_t simulateEeprom(uint64_t *uploadMicros) {
+    uint8_t reply[3];
+    uint16_t address, end, errors = 0;
+    uint32_t writes;
+    uint8_t writeSleep, pass;
+
+    if (sendRequest(USBRQ_DIR_DEVICE_TO_HOST, cmd_device_info, 2, 0, reply, 3) != 3) {
+        fprintf(stderr, "EEPROM reply is not 3 bytes\n");
+        return 1;
+    }
+    end = EEPROM_TEST_START + EEPROM_TEST_LENGTH;
+    writeSleep = reply[2];
+    printf("EEPROM: %u bytes, %u ms write sleep\n", reply[0] | (reply[1] << 8), writeSleep);
+    for (pass = 0; pass < 2; pass++) {
+        writes = flashModel.eepromWrites;
+        for (address = EEPROM_TEST_START; address < end; address += 2) {
+            uint16_t data = (uint8_t) (address * 7) | ((uint8_t) ((address + 1) * 7) << 8);
+            sendRequest(USBRQ_DIR_HOST_TO_DEVICE, cmd_write_eeprom, data, address + 1 < end ? address : address | 0x8000, reply, 0);
+            *uploadMicros += writeSleep * 1000;
+        }
+        if (pass == 1 && flashModel.eepromWrites != writes) {
+            fprintf(stderr, "Unchanged EEPROM bytes were written again\n");
+            errors++;
+        }
+    }
+    for (address = 0; address <= E2END; address++) {
+        uint8_t expected = address >= EEPROM_TEST_START && address < end ? (uint8_t) (address * 7) : 0xFF;
+        if (flashModel.eeprom[address] != expected) {
+            if (errors < 10) {
+                fprintf(stderr, "EEPROM at 0x%03X is 0x%02X instead of 0x%02X\n", address, flashModel.eeprom[address], expected);
+            }
+            errors++;
+        }
+    }
+    return errors;
+}
+#endif
+
+static int parseHex(FILE *file) {
+    char line[600];
+
+    while (fgets(line, sizeof(line), file)) {
+        unsigned int length, address, type, i, value;
+        if (line[0] != ':' || sscanf(line + 1, "%2x%4x%2x", &length, &address, &type) != 3) {
+            continue;
+        }
+        if (type == 1) {
+            break;
+        }
+        if (type != 0) {
+            continue;
+        }
+        for (i = 0; i < length; i++) {
+            if (sscanf(line + 9 + 2 * i, "%2x", &value) != 1 || address + i > FLASHEND) {
+                return -1;
+            }
+            program[address + i] = value;
+            if (address + i + 1 > programSize) {
+                programSize = address + i + 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int loadProgram(const char *fileName) {
+    FILE *file = fopen(fileName, "rb");
+    const char *extension = strrchr(fileName, '.');
+    int result = 0;
+
+    if (file == NULL) {
+        perror(fileName);
+        return -1;
+    }
+    memset(program, 0xFF, sizeof(program));
+    if (extension && strcmp(extension, ".hex") == 0) {
+        result = parseHex(file);
+    } else {
+        programSize = fread(program, 1, sizeof(program), file);
+    }
+    fclose(file);
+    return result;
+}
+
+// a program of the full user flash size, starting with an rjmp to its second word
+static void generateProgram(void) {
+    uint16_t i;
+
+    programSize = PROGMEM_SIZE;
+    srand(1);
+    for (i = 0; i < programSize; i++) {
+        program[i] = rand();
+    }
+    program[0] = 0x00;
+    program[1] = 0xC0;
+}
+
+/*
+ * Prepares a page like micronucleus_lib.c of the command line tool: the reset vector is replaced
+ * by a jump to the bootloader and the user reset vector is moved to the end of the last page.
+ * Serial numbers of ENABLE_SERIAL_NUMBER are not written.
+ */
+static void preparePage(uint16_t address, uint8_t *page, uint16_t userReset) {
+    uint16_t userResetAddress = BOOTLOADER_ADDRESS - TINYVECTOR_RESET_OFFSET;
+
+    memcpy(page, &program[address], SPM_PAGESIZE);
+    if (address == 0) {
+#if BOOTLOADER_ADDRESS > 0x2000
+        page[0] = 0x0C;
+        page[1] = 0x94;
+        page[2] = (BOOTLOADER_ADDRESS / 2) & 0xFF;
+        page[3] = (BOOTLOADER_ADDRESS / 2) >> 8;
+#else
+        uint16_t data = 0xC000 | ((BOOTLOADER_ADDRESS / 2 - 1) & 0x0FFF);
+        page[0] = data;
+        page[1] = data >> 8;
+#endif
+    }
+    if (address == BOOTLOADER_ADDRESS - SPM_PAGESIZE) {
+#if BOOTLOADER_ADDRESS > 0x2000
+        page[userResetAddress - address + 0] = 0x0C;
+        page[userResetAddress - address + 1] = 0x94;
+        page[userResetAddress - address + 2] = userReset & 0xFF;
+        page[userResetAddress - address + 3] = userReset >> 8;
+#else
+        uint16_t data = 0xC000 | ((userReset - userResetAddress / 2 - 1) & 0x0FFF);
+        page[userResetAddress - address + 0] = data;
+        page[userResetAddress - address + 1] = data >> 8;
+#endif
+    }
+}
+
+int main(int argc, char **argv) {
+    uint8_t reply[8];
+    uint8_t page[SPM_PAGESIZE];
+    uint8_t expected[BOOTLOADER_ADDRESS];
+    uint16_t address, i, userReset, word0, progmemSize, errors = 0;
+    uint8_t writeSleep, pageSize;
+    uint64_t uploadMicros;
+
+    if (argc > 2 || (argc == 2 && argv[1][0] == '-')) {
+        fprintf(stderr, "Usage: simulate [file.hex | file.bin]\n");
+        return 2;
+    }
+    flashModelReset();
+    memset(program, 0xFF, sizeof(program));
+    if (argc == 2) {
+        if (loadProgram(argv[1]) < 0) {
+            return 2;
+        }
+    } else {
+        generateProgram();
+    }
+    if (programSize > PROGMEM_SIZE) {
+        fprintf(stderr, "Program size %u is larger than the %u bytes of the bootloader\n", programSize, PROGMEM_SIZE);
+        return 2;
+    }
+
+    word0 = program[0] | (program[1] << 8);
+    if (word0 == 0x940C) {
+        userReset = program[2] | (program[3] << 8);
+    } else if ((word0 & 0xF000) == 0xC000) {
+        userReset = (word0 & 0x0FFF) + 1;
+    } else {
+        fprintf(stderr, "The reset vector of the program does not contain a branch instruction\n");
+        return 2;
+    }
+
+    OSCCAL = 0x5A; // the calibrated value which is stored with OSCCAL_SAVE_CALIB
+    command = cmd_local_nop;
+    currentAddress.w = 0;
+
+    // connect, erase, write, exit like "micronucleus --run"
+    if (sendRequest(USBRQ_DIR_DEVICE_TO_HOST, cmd_device_info, 0, 0, reply, 6) != 6) {
+        fprintf(stderr, "Device info reply is not 6 bytes\n");
+        return 1;
+    }
+    progmemSize = (reply[0] << 8) | reply[1];
+    pageSize = reply[2];
+    writeSleep = reply[3] & 0x7F;
+    printf("Device info: %u bytes user flash, %u byte pages, %u ms write sleep, signature 0x%02X 0x%02X\n",
+           progmemSize, pageSize, writeSleep, reply[4], reply[5]);
+
+    sendRequest(USBRQ_DIR_HOST_TO_DEVICE, cmd_erase_application, 0, 0, reply, 0);
+    uploadMicros = (uint64_t) writeSleep * 1000 * (progmemSize / pageSize + 1); // erase sleep of the command line tool
+
+    memcpy(expected, flashModel.flash, BOOTLOADER_ADDRESS);
+    for (address = 0; address < BOOTLOADER_ADDRESS; address += SPM_PAGESIZE) {
+        if (address >= programSize && address < BOOTLOADER_ADDRESS - SPM_PAGESIZE) {
+            continue; // the command line tool skips empty pages, but always writes the last page
+        }
+        preparePage(address, page, userReset);
+        sendRequest(USBRQ_DIR_HOST_TO_DEVICE, cmd_transfer_page, SPM_PAGESIZE, address, reply, 0);
+        for (i = 0; i < SPM_PAGESIZE; i += 4) {
+            sendRequest(USBRQ_DIR_HOST_TO_DEVICE, cmd_write_data, page[i] | (page[i + 1] << 8),
+                        page[i + 2] | (page[i + 3] << 8), reply, 0);
+        }
+        uploadMicros += writeSleep * 1000;
+        memcpy(&expected[address], page, SPM_PAGESIZE);
+    }
+#if ENABLE_EEPROM_WRITE
+    errors += simulateEeprom(&uploadMicros);
+#endif
+    sendRequest(USBRQ_DIR_HOST_TO_DEVICE, cmd_exit, 0, 0, reply, 0);
+    uploadMicros += (uint64_t) setupPackets * USB_REQUEST_MICROS;
+
+#if OSCCAL_SAVE_CALIB
+    expected[BOOTLOADER_ADDRESS - TINYVECTOR_OSCCAL_OFFSET] = OSCCAL; // writeWordToPageBuffer() stores it as a word
+    expected[BOOTLOADER_ADDRESS - TINYVECTOR_OSCCAL_OFFSET + 1] = 0;
+#endif
+    for (i = 0; i < BOOTLOADER_ADDRESS; i++) {
+        if (flashModel.flash[i] != expected[i]) {
+            if (errors < 10) {
+                fprintf(stderr, "Flash at 0x%04X is 0x%02X instead of 0x%02X\n", i, flashModel.flash[i], expected[i]);
+            }
+            errors++;
+        }
+    }
+    if (command != cmd_exit) {
+        fprintf(stderr, "The exit request did not set cmd_exit\n");
+        errors++;
+    }
+
+    printf("Uploaded %u bytes with %u SETUP packets, %.1f us firmware execution time on the host\n",
+           programSize, setupPackets, firmwareNanos / 1000.0);
+    flashModelPrintStatistics(stdout);
+    printf("Estimated upload time with the delays of the command line tool: %.1f ms\n", uploadMicros / 1000.0);
+    if (errors) {
+        printf("%u bytes of the flash or EEPROM differ from the uploaded program\n", errors);
+    }
+    return errors || flashModelMisuses() ? 1 : 0;
+}
@@ -0,0 +1,15 @@
+/* Name: delay.h
+ * Project: Micronucleus
+ * License: GNU GPL v2 (see License.txt)
+ *
+ * Replacement of <util/delay.h> for the host build of main.c, see native/Readme.md.
+ * Delays take no time on the host.
+ */
+
+#ifndef __native_util_delay_h_included__
+#define __native_util_delay_h_included__
+
+#define _delay_ms(ms) ((void) (ms))
+#define _delay_us(us) ((void) (us))
+
+#endif /* __native_util_delay_h_included__ */
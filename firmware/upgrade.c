@@ -2,12 +2,13 @@
 // The 'bootloaderAddress' variable in bootloader.h, and the bootloaderData
 // progmem array with the bootloader data, are generated by the makefile.
 //
-// Upgrade will firstly rewrite the interrupt vector table to disable the bootloader,
-// rewriting it to just run the upgrade app. Next it erases and writes each page of the
-// bootloader in sequence, erasing over any remaining pages leaving them set to 0xFFFF
-// Finally upgrader erases it's interrupt table again and fills it with RJMPs to
-// bootloaderAddress, effectively bridging the interrupts in to the new bootloader's
-// interrupts table.
+// Upgrade firstly compares the installed bootloader with the new one. Only if they differ,
+// it erases the interrupt vector table to disable the bootloader, so that a reset just
+// runs the upgrade app. Next it erases and writes each page of the bootloader, which
+// differs from the new one, and skips the erase of pages which are already blank.
+// Finally upgrader fills its interrupt table with RJMPs to bootloaderAddress, effectively
+// bridging the interrupts in to the new bootloader's interrupts table. This table is
+// only written if it is not already there.
 //
 // While upgrade has been written with attiny85 and micronucleus in mind, it should
 // work with other bootloaders and other chips with flash self program but no hardware
@@ -28,18 +29,29 @@
 // this file is generated by make script
 #include "bootloader.h"
 
+uint8_t bootloader_is_current(void);
 void secure_interrupt_vector_table(void);
 void write_new_bootloader(void);
 void forward_interrupt_vector_table(void);
 void beep(void);
 void reboot(void);
 
-void load_table(uint16_t address, uint16_t words[SPM_PAGESIZE / 2]);
+void load_new_bootloader_page(uint16_t page_addr, uint16_t words[SPM_PAGESIZE / 2]);
+uint8_t page_matches(uint16_t address, uint16_t words[SPM_PAGESIZE / 2]);
+uint8_t block_is_blank(uint16_t address);
+uint8_t bootloader_block_differs(uint16_t block_addr);
 void erase_page(uint16_t address);
 void write_page(uint16_t address, uint16_t words[SPM_PAGESIZE / 2]);
 
 #define TINYVECTOR_RESET_OFFSET     4 // the exact value does not matter since we erase the whole page
 
+// these devices erase 4 pages at once, so a changed page requires to rewrite its 3 neighbours
+#if (defined __AVR_ATtiny841__)||(defined __AVR_ATtiny441__)||(defined __AVR_ATtiny1634__)
+#define ERASE_BLOCK_SIZE (SPM_PAGESIZE * 4)
+#else
+#define ERASE_BLOCK_SIZE SPM_PAGESIZE
+#endif
+
 int main(void) {
   pinsOff(0xFF); // pull down all pins
   outputs(0xFF); // all to ground - force usb disconnect
@@ -48,8 +60,11 @@ int main(void) {
   delay(250);
   cli();
 
-  secure_interrupt_vector_table(); // reset our vector table to it's original state
-  write_new_bootloader();
+  // Nothing to do if the new bootloader is already installed e.g. if upgrade runs a second time after a power loss
+  if ( !bootloader_is_current() ) {
+    secure_interrupt_vector_table(); // reset our vector table to it's original state
+    write_new_bootloader();
+  }
   forward_interrupt_vector_table();
 
   beep();
@@ -62,52 +77,54 @@ int main(void) {
    *
    * So erase the page, the new bootloader checks for an existing "program" and then reboot.
    */
-  erase_page(BOOTLOADER_ADDRESS - TINYVECTOR_RESET_OFFSET + 1);
+  if ( !block_is_blank( BOOTLOADER_ADDRESS - ERASE_BLOCK_SIZE ) ) {
+    erase_page(BOOTLOADER_ADDRESS - TINYVECTOR_RESET_OFFSET + 1);
+  }
   reboot();
 
   return 0;
 }
 
 
-// erase first page, removing any interrupt table hooks the bootloader added when
-// upgrade was uploaded
-void secure_interrupt_vector_table( void ) {
-  uint16_t table[ SPM_PAGESIZE / 2 ];
-  load_table( 0, table );
-
-  // wipe out any interrupt hooks the bootloader rewrote
-  int iter = 0;
-  while ( iter < SPM_PAGESIZE / 2 ) {
-    table[ iter ] = 0xFFFF;
-    iter++;
+// check if the installed bootloader is identical to the new one
+uint8_t bootloader_is_current( void ) {
+  uint16_t block_addr = 0;
+  while ( block_addr < bootloader_size ) {
+    if ( bootloader_block_differs( block_addr ) ) {
+      return 0;
+    }
+    block_addr += ERASE_BLOCK_SIZE;
   }
+  return 1;
+}
 
+
+// erase first page, removing any interrupt table hooks the bootloader added when
+// upgrade was uploaded. The erased words (0xFFFF) let a reset slide into the upgrade app.
+void secure_interrupt_vector_table( void ) {
   erase_page( 0 );
-  write_page( 0, table );
 }
 
 
-// erase bootloader's section and write over it with new bootloader code
+// erase bootloader's section and write over it with new bootloader code, skipping unchanged pages
 void write_new_bootloader( void ) {
   uint16_t outgoing_page[ SPM_PAGESIZE / 2 ]; // 64 bytes = 32 words
-  int page_addr = 0;
-  while ( page_addr < bootloader_size ) {
-    // read in one page's worth of data from progmem
-    int word_addr = 0;
-    while ( word_addr < SPM_PAGESIZE ) {
-      int subaddress = ( (int) bootloader ) + page_addr + word_addr;
-      if ( subaddress < ( (int) bootloader_end ) ) { // valid boot code
-        outgoing_page[ word_addr / 2 ] = pgm_read_word( subaddress );
-      } else { // fill last words of last page
-        outgoing_page[ word_addr / 2 ] = 0xFFFF;
+  uint16_t block_addr = 0;
+  while ( block_addr < bootloader_size ) {
+    if ( bootloader_block_differs( block_addr ) ) {
+      // erase block in destination, if not already done
+      if ( !block_is_blank( bootloader_address + block_addr ) ) {
+        erase_page( bootloader_address + block_addr );
+      }
+      // write updated pages of this block
+      uint16_t page_addr = block_addr;
+      while ( page_addr < block_addr + ERASE_BLOCK_SIZE ) {
+        load_new_bootloader_page( page_addr, outgoing_page );
+        write_page( bootloader_address + page_addr, outgoing_page );
+        page_addr += SPM_PAGESIZE;
       }
-      word_addr += 2;
     }
-    // erase page in destination
-    erase_page( bootloader_address + page_addr );
-    // write updated page
-    write_page( bootloader_address + page_addr, outgoing_page );
-    page_addr += SPM_PAGESIZE;
+    block_addr += ERASE_BLOCK_SIZE;
   }
 }
 
@@ -143,7 +160,7 @@ void write_new_bootloader(void) {
 #endif
 
 
-// write in forwarding interrupt vector table
+// write in forwarding interrupt vector table, if not already there
 void forward_interrupt_vector_table( void ) {
   uint16_t vector_table[ SPM_PAGESIZE / 2 ];
 
@@ -154,19 +171,69 @@ void forward_interrupt_vector_table( void ) {
     iter++;
   }
 
-  erase_page( 0 );
+  if ( page_matches( 0, vector_table ) ) {
+    return;
+  }
+  if ( !block_is_blank( 0 ) ) {
+    erase_page( 0 );
+  }
   write_page( 0, vector_table );
 }
 
 
-void load_table( uint16_t address, uint16_t words[ SPM_PAGESIZE / 2 ] ) {
+// read one page's worth of data of the new bootloader from progmem
+void load_new_bootloader_page( uint16_t page_addr, uint16_t words[ SPM_PAGESIZE / 2 ] ) {
+  int word_addr = 0;
+  while ( word_addr < SPM_PAGESIZE ) {
+    int subaddress = ( (int) bootloader ) + page_addr + word_addr;
+    if ( subaddress < ( (int) bootloader_end ) ) { // valid boot code
+      words[ word_addr / 2 ] = pgm_read_word( subaddress );
+    } else { // fill last words of last page
+      words[ word_addr / 2 ] = 0xFFFF;
+    }
+    word_addr += 2;
+  }
+}
+
+
+// compare a page in flash with the words to be written
+uint8_t page_matches( uint16_t address, uint16_t words[ SPM_PAGESIZE / 2 ] ) {
   uint16_t subaddress = 0;
-  address -= address % SPM_PAGESIZE; // round down to nearest page start
+  while ( subaddress < SPM_PAGESIZE ) {
+    if ( pgm_read_word( address + subaddress ) != words[ subaddress / 2 ] ) {
+      return 0;
+    }
+    subaddress += 2;
+  }
+  return 1;
+}
+
 
-  while (subaddress < SPM_PAGESIZE) {
-    words[ subaddress / 2 ] = pgm_read_word( address + subaddress );
+// check if an erase block contains only 0xFFFF and need not to be erased
+uint8_t block_is_blank( uint16_t address ) {
+  uint16_t subaddress = 0;
+  while ( subaddress < ERASE_BLOCK_SIZE ) {
+    if ( pgm_read_word( address + subaddress ) != 0xFFFF ) {
+      return 0;
+    }
     subaddress += 2;
   }
+  return 1;
+}
+
+
+// compare all pages of an erase block of the installed bootloader with the new one
+uint8_t bootloader_block_differs( uint16_t block_addr ) {
+  uint16_t page[ SPM_PAGESIZE / 2 ];
+  uint16_t page_addr = block_addr;
+  while ( page_addr < block_addr + ERASE_BLOCK_SIZE ) {
+    load_new_bootloader_page( page_addr, page );
+    if ( !page_matches( bootloader_address + page_addr, page ) ) {
+      return 1;
+    }
+    page_addr += SPM_PAGESIZE;
+  }
+  return 0;
 }
 
 
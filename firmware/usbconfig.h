@@ -172,11 +172,21 @@
 
 #define USB_CFG_DESCR_PROPS_DEVICE                  0
 #define USB_CFG_DESCR_PROPS_CONFIGURATION           0
+#if ENABLE_SERIAL_NUMBER
+/* The serial number string descriptor is written by the host tool to the postscript in front of
+ * OSCCAL and the user reset vector and served from flash by usbDriverDescriptor().
+ */
+#define USB_CFG_SERIAL_NUMBER_SIZE                  (2 + 2 * SERIAL_NUMBER_LEN)
+#define USB_CFG_SERIAL_NUMBER_ADDRESS               (BOOTLOADER_ADDRESS - 6 - USB_CFG_SERIAL_NUMBER_SIZE)
+#define USB_CFG_DESCR_PROPS_STRINGS                 0
+#define USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER    USB_PROP_LENGTH(USB_CFG_SERIAL_NUMBER_SIZE)
+#else
 #define USB_CFG_DESCR_PROPS_STRINGS                 1
+#define USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER    0
+#endif
 #define USB_CFG_DESCR_PROPS_STRING_0                0
 #define USB_CFG_DESCR_PROPS_STRING_VENDOR           0
 #define USB_CFG_DESCR_PROPS_STRING_PRODUCT          0
-#define USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER    0
 #define USB_CFG_DESCR_PROPS_UNKNOWN                 0
 
 #endif /* __usbconfig_h_included__ */
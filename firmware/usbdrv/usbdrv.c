@@ -32,6 +32,24 @@ documentation of the entire driver.
 /* ------------------------------------------------------------------------- */
 
 /* raw USB registers / interface to assembler code: */
+#if (USB_SHARED_DRIVER_APP || ENABLE_SHARED_USB_DRIVER) && !defined(MICRONUCLEUS_NATIVE)
+/* The state shared with the asm code is at the fixed address of usbdrvshared.h, for the bootloader and the user program */
+#include "usbdrvshared.h"
+asm(USB_SHARED_STATE_ASM);
+#if USB_BUFSIZE != 11
+#error "The offsets of usbdrvshared.h require USB_BUFSIZE 11"
+#endif
+extern uchar usbRxBuf[2*USB_BUFSIZE];
+extern uchar       usbInputBufOffset;
+extern uchar       usbDeviceAddr;
+extern uchar       usbNewDeviceAddr;
+extern volatile schar usbRxLen;
+extern uchar       usbCurrentTok;
+extern uchar       usbRxToken;
+extern volatile uchar usbTxLen;
+extern uchar       usbTxBuf[USB_BUFSIZE];
+uchar       usbConfiguration;   /* currently selected configuration. Administered by driver, but not used */
+#else
 uchar usbRxBuf[2*USB_BUFSIZE];  /* raw RX buffer: PID, 8 bytes data, 2 bytes CRC */
 uchar       usbInputBufOffset;  /* offset in usbRxBuf used for low level receiving */
 uchar       usbDeviceAddr;      /* assigned during enumeration, defaults to 0 */
@@ -42,6 +60,7 @@ uchar       usbCurrentTok;      /* last token received or endpoint number for la
 uchar       usbRxToken;         /* token for data we received; or endpont number for last OUT */
 volatile uchar usbTxLen;   /* number of bytes to transmit with next IN token or handshake token */
 uchar       usbTxBuf[USB_BUFSIZE];/* data to transmit with next IN, free if usbTxLen contains handshake token */
+#endif
 
 /* USB status registers / not shared with asm code */
 usbMsgPtr_t         usbMsgPtr;      /* data to transmit next -- ROM or RAM address */
@@ -217,7 +236,15 @@ usbMsgLen_t len = 0;
         SWITCH_CASE(2)
             GET_DESCRIPTOR(USB_CFG_DESCR_PROPS_STRING_PRODUCT, usbDescriptorStringDevice)
         SWITCH_CASE(3)
+#ifdef USB_CFG_SERIAL_NUMBER_ADDRESS
+            /* written by the host tool, the length byte is 0xFF if no serial number was written */
+            len = USB_READ_FLASH(USB_CFG_SERIAL_NUMBER_ADDRESS);
+            if(len > USB_CFG_SERIAL_NUMBER_SIZE)
+                len = 0;
+            usbMsgPtr = (usbMsgPtr_t)(USB_CFG_SERIAL_NUMBER_ADDRESS);
+#else
             GET_DESCRIPTOR(USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER, usbDescriptorStringSerialNumber)
+#endif
         SWITCH_DEFAULT
         SWITCH_END
     SWITCH_DEFAULT
@@ -314,7 +341,11 @@ static uchar usbDeviceRead(uchar *data, usbMsgLen_t len)
         uchar i = len;
         usbMsgPtr_t r = usbMsgPtr;
             do{
+#ifdef USB_MSGPTR_RAM_END
+                uchar c = (unsigned int) r <= USB_MSGPTR_RAM_END ? *(uchar *) r : USB_READ_FLASH(r); /* low addresses are RAM */
+#else
                 uchar c = USB_READ_FLASH(r);    /* assign to char size variable to enforce byte ops */
+#endif
                 *data++ = c;
                 r++;
             }while(--i);
@@ -482,7 +482,7 @@ extern usbTxStatus_t   usbTxStatus1, usbTxStatus3;
 
 
 typedef union usbWord{
-    unsigned    word;
+    unsigned short  word;   /* same as unsigned on AVR, but also 16 bit in the host build of native/ */
     uchar       bytes[2];
 }usbWord_t;
 
@@ -0,0 +1,104 @@
+/* Name: usbdrvshared.c
+ * Project: Micronucleus
+ * Tabsize: 4
+ * License: GNU GPL v2 (see License.txt), GNU GPL v3 or proprietary (CommercialLicense.txt)
+ */
+
+/*
+General Description:
+This is the user program side of the V-USB driver which is shared by a bootloader
+built with ENABLE_SHARED_USB_DRIVER. The user program contains only the C part of
+the driver. The low level receive and transmit code and its state are used from
+the bootloader, which saves the usbdrvasm.S part of the user program.
+
+Usage:
+- Generate build/<configuration>/usbdrv_shared.ld with "make shared-usb-symbols".
+  It contains the addresses of the low level functions and of the ABI word of the bootloader.
+  The state of the low level driver is at the fixed address of usbdrvshared.h at the top
+  of the RAM, it is defined by usbdrv.c and does not depend on the build of the bootloader.
+- Include this file in the main C file of the user program, after the declaration of
+  usbFunctionSetup(), like main.c of the bootloader includes usbdrv.c.
+  The usbconfig.h of the user program may define its own descriptors, but the USB pins,
+  USB_INTR_* and the clock must be the same as those of the bootloader.
+  Do not link usbdrvasm.S.
+- Link the user program with usbdrv_shared.ld and the -Wl,--defsym=__stack option given in
+  usbdrv_shared.ld, so the stack starts below the state of the driver.
+- Call usbInit() before the first usbSharedPoll(). The bootloader leaves the device connected and
+  its address is lost when the user program starts, so the user program has to force a new
+  enumeration with usbDeviceDisconnect(), a delay of at least 250 ms and usbDeviceConnect().
+- Call usbSharedPoll() in a tight loop with interrupts disabled. Like the bootloader, the shared
+  driver is polled and can not be used as interrupt handler. Only replies from flash and no
+  interrupt endpoints are supported. usbSharedPoll() does nothing if the bootloader is
+  missing or was built with a different version of usbdrvshared.h, see usbSharedCompatible().
+*/
+
+#define USB_SHARED_DRIVER_APP 1
+#include "usbdrv.c"
+
+extern const uint16_t __shared_usb_abi; /* in the flash of the bootloader, see usbdrv_shared.ld */
+
+/*
+ * Returns 1 if the bootloader contains a shared driver with the interface of usbdrvshared.h.
+ */
+static uchar usbSharedCompatible(void) {
+    return pgm_read_word(&__shared_usb_abi) == USB_SHARED_ABI;
+}
+
+/*
+ * Call the low level driver of the bootloader. It saves Y, but uses r16 to r22, X, Z, r0 and SREG
+ * without saving them, so they are declared as clobbered.
+ */
+static inline void usbSharedHandler(void) {
+    asm volatile(
+#ifdef __AVR_HAVE_JMP_CALL__
+            "call USB_handler"
+#else
+            "rcall USB_handler"
+#endif
+            ::: "r0", "r16", "r17", "r18", "r19", "r20", "r21", "r22", "r23", "r24", "r25",
+            "r26", "r27", "r30", "r31", "memory");
+}
+
+/*
+ * Replaces usbPoll() of the original V-USB driver. Must be called in a tight loop while waiting
+ * for USB traffic, since the low level driver must start shortly after the SYNC pattern begins.
+ * Returns 1 if a packet was processed.
+ */
+static uchar usbSharedPoll(void) {
+    static uchar sResetDownCounter;
+    static uchar sCompatible = 2; // not checked yet
+
+    if (sCompatible == 2) {
+        sCompatible = usbSharedCompatible();
+    }
+    if (!sCompatible) {
+        return 0;
+    }
+
+    // If host resets us, both lines are driven to low (=SE0) for at least 2.5 ms
+    if ((USBIN & USBMASK) != 0) {
+        sResetDownCounter = 100;
+    } else if (--sResetDownCounter == 0) {
+        usbNewDeviceAddr = 0;
+        usbDeviceAddr = 0;
+    }
+
+    if (!(USB_INTR_PENDING & _BV(USB_INTR_PENDING_BIT))) {
+        return 0;
+    }
+    usbSharedHandler();
+    USB_INTR_PENDING = _BV(USB_INTR_PENDING_BIT);
+
+    // Parse data packet and construct response as the bootloader does in its main loop
+    schar len = usbRxLen - 3;
+    if (len >= 0) {
+        usbProcessRx(usbRxBuf + 1, len);
+        usbRxLen = 0; /* mark rx buffer as available */
+    }
+    if (usbTxLen & 0x10) { /* transmit system idle */
+        if (usbMsgLen != USB_NO_MSG) { /* transmit data pending? */
+            usbBuildTxBlock();
+        }
+    }
+    return 1;
+}
@@ -0,0 +1,59 @@
+/* Name: usbdrvshared.h
+ * Project: Micronucleus
+ * Tabsize: 4
+ * License: GNU GPL v2 (see License.txt), GNU GPL v3 or proprietary (CommercialLicense.txt)
+ */
+
+/*
+General Description:
+Fixed interface of the low level V-USB driver, which a bootloader built with
+ENABLE_SHARED_USB_DRIVER shares with the user program, see usbdrvshared.c.
+It does not depend on the build of the bootloader:
+
+- The state of the driver is at USB_SHARED_RAM_START, the last USB_SHARED_RAM_SIZE
+  bytes of the RAM, in the order of the offsets below. The stack starts below it.
+- The bootloader has jumps to USB_handler and usbCrc16Append at BOOTLOADER_ADDRESS + 4
+  and + 6 (+ 8 and + 12 for devices with jmp), followed by the word USB_SHARED_ABI.
+  The high byte marks the entry, the low byte is the version of this interface.
+  It is incremented for every change of the entries, the offsets or the registers
+  which USB_handler uses without saving them.
+
+This file is included by assembler and C files and contains only defines.
+*/
+
+#ifndef __usbdrvshared_h_included__
+#define __usbdrvshared_h_included__
+
+#define USB_SHARED_ABI          0x5501
+
+#define USB_SHARED_RAM_SIZE     40
+#define USB_SHARED_RAM_START    (RAMEND + 1 - USB_SHARED_RAM_SIZE)
+
+/* offsets of the variables of usbdrv.c, which the asm code uses */
+#define USB_SHARED_RXBUF            0   /* usbRxBuf[2 * USB_BUFSIZE] */
+#define USB_SHARED_INPUTBUFOFFSET   22  /* usbInputBufOffset */
+#define USB_SHARED_DEVICEADDR       23  /* usbDeviceAddr */
+#define USB_SHARED_NEWDEVICEADDR    24  /* usbNewDeviceAddr */
+#define USB_SHARED_RXLEN            25  /* usbRxLen */
+#define USB_SHARED_CURRENTTOK       26  /* usbCurrentTok */
+#define USB_SHARED_RXTOKEN          27  /* usbRxToken */
+#define USB_SHARED_TXLEN            28  /* usbTxLen */
+#define USB_SHARED_TXBUF            29  /* usbTxBuf[USB_BUFSIZE], up to USB_SHARED_RAM_SIZE */
+
+/* Top level asm, which defines the variables as absolute symbols in the data address space */
+#define USB_SHARED_STRING2(x) #x
+#define USB_SHARED_STRING(x) USB_SHARED_STRING2(x)
+#define USB_SHARED_SYMBOL(name, offset) \
+    ".global " #name "\n\t.set " #name ", 0x800000 + " USB_SHARED_STRING(USB_SHARED_RAM_START) " + " USB_SHARED_STRING(offset) "\n\t"
+#define USB_SHARED_STATE_ASM \
+    USB_SHARED_SYMBOL(usbRxBuf, USB_SHARED_RXBUF) \
+    USB_SHARED_SYMBOL(usbInputBufOffset, USB_SHARED_INPUTBUFOFFSET) \
+    USB_SHARED_SYMBOL(usbDeviceAddr, USB_SHARED_DEVICEADDR) \
+    USB_SHARED_SYMBOL(usbNewDeviceAddr, USB_SHARED_NEWDEVICEADDR) \
+    USB_SHARED_SYMBOL(usbRxLen, USB_SHARED_RXLEN) \
+    USB_SHARED_SYMBOL(usbCurrentTok, USB_SHARED_CURRENTTOK) \
+    USB_SHARED_SYMBOL(usbRxToken, USB_SHARED_RXTOKEN) \
+    USB_SHARED_SYMBOL(usbTxLen, USB_SHARED_TXLEN) \
+    USB_SHARED_SYMBOL(usbTxBuf, USB_SHARED_TXBUF)
+
+#endif /* __usbdrvshared_h_included__ */